@@ -1 +1 @@
-gcc mysh_ubuntu.c -o mysh
\ No newline at end of file
+gcc mysh_ubuntu.c -o mysh -pthread
\ No newline at end of file
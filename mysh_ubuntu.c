@@ -1,7 +1,22 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/file.h>
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,20 +26,219 @@
 #include <errno.h>
 #include <signal.h>
 #include <dirent.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sched.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
 
 #include <string.h>
 #include <ctype.h>
 #include <fnmatch.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 ////////////////////////////////////////
 //GLOBAL DEFINITIONS
 ////////////////////////////////////////
 
 #define MAX_COMLEN 1024
-#define MAX_ARGLEN 256
-#define MAX_DIRS 16
 #define MAX_HISTORIES 32
 #define MAX_PROMPTLEN 64
+#define MAX_PROMPTBUF 256
+#define MAX_SEGMENT 64
+#define MAX_VARNAME 256
+#define VAR_BUCKETS 64
+#define READ_BLOCK 8192
+#define MAX_LEXDEPTH 16
+#define MAX_REDIRS 16
+#define MAX_HEREDOCS 16
+#define MAX_ARITHSTACK 64
+#define ARENA_BLOCK 65536
+
+//DEFINITIONS FOR COMMAND flags
+
+#define CF_TTY 1
+#define CF_STATE 2
+
+//DEFINITIONS FOR lexNext
+
+#define T_EOF 0
+#define T_WORD 1
+#define T_IONUM 2
+#define T_NEWLINE 3
+#define T_SEMI 4
+#define T_DSEMI 5
+#define T_AMP 6
+#define T_AND 7
+#define T_PIPE 8
+#define T_OR 9
+#define T_LPAREN 10
+#define T_RPAREN 11
+#define T_LESS 12
+#define T_GREAT 13
+#define T_DGREAT 14
+#define T_CLOBBER 15
+#define T_DUPIN 16
+#define T_DUPOUT 17
+#define T_RDWR 18
+#define T_DLESS 19
+#define T_DLESSDASH 20
+#define T_TLESS 21
+
+//DEFINITIONS FOR lexWord (control bytes in parsed words)
+
+#define WC_ESC 1
+#define WC_VAR 2
+#define WC_ENDVAR 3
+#define WC_QUOTE 4
+#define WC_ARITH 5
+#define WC_PROC 6
+#define WC_LAST 8
+#define VF_BASE 0x10
+#define VF_QUOTED 1
+#define VF_OUTPUT 2
+
+//DEFINITIONS FOR parseSource
+
+#define PARSE_OK 0
+#define PARSE_MORE 1
+#define PARSE_ERR 2
+
+//DEFINITIONS FOR NODE type
+
+#define N_SIMPLE 0
+#define N_AND 1
+#define N_OR 2
+#define N_NOT 3
+#define N_PIPE 4
+#define N_BG 5
+#define N_SUBSHELL 6
+#define N_GROUP 7
+#define N_IF 8
+#define N_WHILE 9
+#define N_UNTIL 10
+#define N_FOR 11
+#define N_CASE 12
+#define N_CASEITEM 13
+#define N_FUNC 14
+
+//DEFINITIONS FOR REDIR type
+
+#define R_IN 0
+#define R_OUT 1
+#define R_APPEND 2
+#define R_RDWR 3
+#define R_DUPIN 4
+#define R_DUPOUT 5
+#define R_HEREDOC 6
+#define R_HERESTR 7
+
+//DEFINITIONS FOR PROGRAM code
+
+#define OP_END 0
+#define OP_EXIT 1
+#define OP_SIMPLE 2
+#define OP_JMP 3
+#define OP_JZ 4
+#define OP_JNZ 5
+#define OP_NOT 6
+#define OP_STATUS 7
+#define OP_PIPE 8
+#define OP_BG 9
+#define OP_SUBSHELL 10
+#define OP_REDIR 11
+#define OP_UNREDIR 12
+#define OP_LOOP 13
+#define OP_FOR 14
+#define OP_FORNEXT 15
+#define OP_LOOPSAVE 16
+#define OP_LOOPEND 17
+#define OP_CASE 18
+#define OP_MATCH 19
+#define OP_CASEEND 20
+#define OP_DEFUN 21
+
+//DEFINITIONS FOR loadCache/saveCache
+
+#define CACHE_MAGIC 0x4253594d
+#define CACHE_VERSION 2
+
+//DEFINITIONS FOR loadRc/saveRc
+
+#define RC_MAGIC 0x4352594d
+#define RC_VERSION 1
+
+//DEFINITIONS FOR openDirs/recordDir
+
+#define DIRDB_MAGIC 0x5244594d
+#define DIRDB_VERSION 1
+#define DIRDB_ENTRIES 1024
+#define DIRDB_POOL 65536
+#define DIRDB_MAXRANK 1000000
+
+//DEFINITIONS FOR mysh_memo
+
+#define MEMO_MAGIC 0x4f4d454d
+#define MEMO_VERSION 1
+
+//DEFINITIONS FOR ANODE op and PROGRAM expr
+
+#define AX_END 0
+#define AX_NUM 1
+#define AX_VAR 2
+#define AX_ASSIGN 3
+#define AX_PREINC 4
+#define AX_POSTINC 5
+#define AX_JZ 6
+#define AX_JNZ 7
+#define AX_JMP 8
+#define AX_BOOL 9
+#define AX_POP 10
+#define AX_POS 11
+#define AX_NEG 12
+#define AX_NOT 13
+#define AX_BNOT 14
+#define AX_MUL 15
+#define AX_DIV 16
+#define AX_MOD 17
+#define AX_ADD 18
+#define AX_SUB 19
+#define AX_SHL 20
+#define AX_SHR 21
+#define AX_LT 22
+#define AX_GT 23
+#define AX_LE 24
+#define AX_GE 25
+#define AX_EQ 26
+#define AX_NE 27
+#define AX_BAND 28
+#define AX_BXOR 29
+#define AX_BOR 30
+#define AX_AND 31
+#define AX_OR 32
+#define AX_COND 33
+#define AX_COMMA 34
+
+//DEFINITIONS FOR FRAME type
+
+#define FR_LOOP 0
+#define FR_CASE 1
+#define FR_REDIR 2
+
+//DEFINITIONS FOR XBUF flags
+
+#define F_QUOTED 1
+#define F_SPLIT 2
+#define F_BREAK 4
+
+//DEFINITIONS FOR readLine
+
+#define RL_SEEK 0
+#define RL_TEE 1
+#define RL_PEEK 2
+#define RL_BYTE 3
 
 //DEFINITIONS FOR escSequence
 
@@ -37,21 +251,116 @@
 #define ES_FUNC_HOME 6
 #define ES_FUNC_END 7
 
+//DEFINITIONS FOR readKey
+
+#define KEY_REPAINT 256
+
+//DEFINITIONS FOR recordLatency
+
+#define KEYHIST_BUCKETS 24
+
+//DEFINITIONS FOR mysh_onchange
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCH_DEBOUNCE 100
+
+//DEFINITIONS FOR mysh_with
+
+#define LIM_CPUS 1
+#define LIM_NICE 2
+#define MAX_LIMITS 8
+
+//DEFINITIONS FOR runServer
+
+#define SRV_COMMAND 0
+#define SRV_STDOUT 1
+#define SRV_STDERR 2
+#define SRV_STATUS 3
+#define SRV_BACKLOG 128
+#define SRV_MAXCOMMAND (MAX_COMLEN * 64)
+
+//DEFINITIONS FOR startFanout
+
+#define FANOUT_PIPE_SIZE (1024 * 1024)
+
+//DEFINITIONS FOR openHeredoc
+
+#define HEREDOC_PIPE 32768
+
+//DEFINITIONS FOR initLoop
+
+#define MAX_LOOPFDS 16
+#define SEGMENT_REFRESH 5
+
+//DEFINITIONS FOR highlightLine
+
+#define HL_NONE 0
+#define HL_COMMAND 1
+#define HL_BUILTIN 2
+#define HL_ALIAS 3
+#define HL_UNKNOWN 4
+#define HL_STRING 5
+#define HL_GLOB 6
+#define HL_KEYWORD 7
+
+#define HS_COMMAND 1
+#define HS_TARGET 2
+#define HS_NAME 4
+#define HS_NONE 255
+
 ////////////////////////////////////////
 //GLOBAL FUNCTIONS
 ////////////////////////////////////////
 
+struct LEXER;
+struct NODE;
+struct PROGRAM;
+struct FUNCTION;
+struct XBUF;
+struct ARITH;
+struct ANODE;
+struct ARGV;
+struct ARENAMARK;
+struct SEGMENTS;
+struct SEGREQUEST;
+struct HEREBUF;
+struct LIMITS;
+struct SRVHDR;
+struct DIRDBHDR;
+
 int mysh_exit(int argc, char* argv[]);
 int mysh_cd(int argc, char* argv[]);
+int mysh_pwd(int argc, char* argv[]);
 int mysh_pushd(int argc, char* argv[]);
 int mysh_dirs(int argc, char* argv[]);
 int mysh_popd(int argc, char* argv[]);
+int mysh_j(int argc, char* argv[]);
 int mysh_history(int argc, char* argv[]);
 int mysh_prompt(int argc, char* argv[]);
 int mysh_alias(int argc, char* argv[]);
 int mysh_unalias(int argc, char* argv[]);
 int mysh_lock(int argc, char* argv[]);
 int mysh_ver(int argc, char* argv[]);
+int mysh_true(int argc, char* argv[]);
+int mysh_false(int argc, char* argv[]);
+int mysh_echo(int argc, char* argv[]);
+int mysh_printf(int argc, char* argv[]);
+int mysh_test(int argc, char* argv[]);
+int mysh_cat(int argc, char* argv[]);
+int mysh_read(int argc, char* argv[]);
+int mysh_export(int argc, char* argv[]);
+int mysh_unset(int argc, char* argv[]);
+int mysh_break(int argc, char* argv[]);
+int mysh_continue(int argc, char* argv[]);
+int mysh_return(int argc, char* argv[]);
+int mysh_shift(int argc, char* argv[]);
+int mysh_exec(int argc, char* argv[]);
+int mysh_allocstats(int argc, char* argv[]);
+int mysh_memo(int argc, char* argv[]);
+int mysh_memostats(int argc, char* argv[]);
+int mysh_onchange(int argc, char* argv[]);
+int mysh_with(int argc, char* argv[]);
+int mysh_timeout(int argc, char* argv[]);
 
 void initSignal(void);
 void resetSignal(void);
@@ -61,16 +370,165 @@ int resetTerm(void);
 
 int escSequence(void);
 
-int checkExcl(char* command);
-int checkAlias(char* command);
-
-int commandToArgs(char* command, char* command_args[]);
-int expandArgs(char* command_args[], char* expanded_args[]);
+int checkExcl(const char* command, char** presult);
+
+void lexInit(struct LEXER* lx, const char* source);
+int lexPeek(struct LEXER* lx);
+int lexGetc(struct LEXER* lx);
+void lexPutc(struct LEXER* lx, int ch);
+int lexNext(struct LEXER* lx);
+int lexWord(struct LEXER* lx);
+int lexDollar(struct LEXER* lx, int quoted);
+int lexArith(struct LEXER* lx, int quoted);
+int lexProcess(struct LEXER* lx, int output);
+int lexHeredoc(struct LEXER* lx);
+int lexPeekNonBlank(struct LEXER* lx);
+
+int parseSource(const char* source, int final, struct PROGRAM** pprog);
+struct NODE* parseError(struct LEXER* lx);
+int atListEnd(struct LEXER* lx);
+int isKeyword(struct LEXER* lx, const char* word);
+int expectKeyword(struct LEXER* lx, const char* word);
+struct NODE* parseList(struct LEXER* lx);
+struct NODE* parseAndOr(struct LEXER* lx);
+struct NODE* parsePipeline(struct LEXER* lx);
+struct NODE* parseCommand(struct LEXER* lx);
+struct NODE* parseSimple(struct LEXER* lx);
+int parseRedirect(struct LEXER* lx, struct NODE* node);
+struct NODE* parseIf(struct LEXER* lx);
+struct NODE* parseLoop(struct LEXER* lx, int type);
+struct NODE* parseFor(struct LEXER* lx);
+struct NODE* parseCase(struct LEXER* lx);
+struct NODE* parseFunction(struct LEXER* lx);
+struct NODE* newNode(int type);
+void freeNode(struct NODE* node);
+int addWord(char*** pwords, int* pn, char* word);
+int isAssignWord(const char* word);
+
+struct PROGRAM* compileProgram(struct NODE* tree);
+void compileList(struct PROGRAM* prog, struct NODE* node);
+void compileNode(struct PROGRAM* prog, struct NODE* node);
+int emit(struct PROGRAM* prog, int value);
+int emitStr(struct PROGRAM* prog, const char* str);
+void releaseProgram(struct PROGRAM* prog);
+
+int emitWord(struct PROGRAM* prog, const char* word);
+int emitExpr(struct PROGRAM* prog, intmax_t value);
+int compileArith(struct PROGRAM* prog, const char* text, int len);
+int emitArith(struct PROGRAM* prog, struct ANODE* node);
+
+struct ANODE* parseArithComma(struct ARITH* ax);
+struct ANODE* parseArithAssign(struct ARITH* ax);
+struct ANODE* parseArithCond(struct ARITH* ax);
+struct ANODE* parseArithBinary(struct ARITH* ax, int minprec);
+struct ANODE* parseArithUnary(struct ARITH* ax);
+struct ANODE* parseArithPrimary(struct ARITH* ax);
+void arithSkip(struct ARITH* ax);
+int arithOperator(struct ARITH* ax, const char* op, int len);
+char* arithName(struct ARITH* ax);
+struct ANODE* newArith(struct ARITH* ax, int op, struct ANODE* a, struct ANODE* b, struct ANODE* c);
+void freeArith(struct ANODE* node);
+
+int evalArith(struct PROGRAM* prog, int pc, intmax_t* presult);
+intmax_t arithUnary(int op, intmax_t a);
+int arithBinary(int op, intmax_t a, intmax_t b, intmax_t* presult);
+int arithValue(const char* value, intmax_t* presult);
+
+int vmRun(struct PROGRAM* prog, int pc);
+int vmUnwind(int pc);
+int pushFrame(int type);
+void popFrame(void);
+
+int runSimple(struct PROGRAM* prog, int pc, int last);
+int runPipeline(struct PROGRAM* prog, int pc);
+void runChild(struct PROGRAM* prog, int pc);
+void runCommand(int argc, char* argv[]);
+void execCommand(struct PROGRAM* prog, int pc, char* command_args[]);
+void exportAssigns(struct PROGRAM* prog, int pc);
+int runBatches(struct PROGRAM* prog, int pc, struct ARGV* av);
+size_t argvSize(char** argv, int argc);
+int waitChild(pid_t child);
+int applyRedirs(struct PROGRAM* prog, int* redirs, int nredirs, int frame);
+int countOutputs(struct PROGRAM* prog, int* redirs, int nredirs, int fd);
+int startFanout(int fd, int* targets, int ntargets, int frame);
+void runFanout(int src, int* targets, int ntargets);
+int moveFanout(int from, int to, size_t* plen);
+int openHeredoc(int type, const char* word);
+int putHeredoc(struct HEREBUF* hb, const char* data, size_t len);
+int writeHeredoc(struct HEREBUF* hb, const char* data, size_t len);
+int expandList(struct PROGRAM* prog, int* words, int nwords, int frame);
+
+struct FUNCTION* findFunction(const char* name);
+int defineFunction(const char* name, struct PROGRAM* prog, int pc);
+int callFunction(struct FUNCTION* func, int argc, char* argv[]);
+void freeFunctions(void);
+
+int expandArgs(struct PROGRAM* prog, int* words, int nwords, struct ARGV* av);
+int braceExpand(const char* word, struct ARGV* av, struct XBUF* xb);
+const char* braceFind(const char* word, const char** pend, int* pseq);
+int braceSequence(const char* word, const char* open, const char* close, struct ARGV* av, struct XBUF* xb);
+int braceWord(const char* word, size_t prefix, const char* middle, size_t len, const char* rest, struct ARGV* av, struct XBUF* xb);
+void expandWord(const char* word, struct XBUF* xb);
+char* expandString(const char* word);
+char* expandPattern(const char* word);
+const char* lookupParam(const char* name, int namelen, char* buf);
+int startProcess(const char* source, int len, int output);
+void closeProcesses(int keep);
+int splitFields(struct XBUF* xb, struct ARGV* av);
+int globField(struct XBUF* xb, size_t start, size_t end, struct ARGV* av);
+int addArg(struct ARGV* av, char* arg);
+void xbufPut(struct XBUF* xb, int ch, int flags);
+int compareArgs(const void* a, const void* b);
+
+void* arenaAlloc(size_t size);
+void* arenaGrow(void* ptr, size_t oldsize, size_t size);
+char* arenaStrndup(const char* str, size_t len);
+void arenaMark(struct ARENAMARK* mark);
+void arenaRelease(const struct ARENAMARK* mark);
+void arenaReset(void);
+
+int runScript(const char* source);
+int runFile(const char* path);
+char* readScript(int fd, const char* path, size_t size);
+int cachePath(char* path, const struct stat* st);
+struct PROGRAM* loadCache(const struct stat* st);
+void saveCache(struct PROGRAM* prog, const struct stat* st);
+uint32_t cacheSum(const struct PROGRAM* prog);
+void loadRc(void);
+int mapRc(const struct stat* st, const char* path);
+void saveRc(struct PROGRAM* prog, const struct stat* st, const char* path);
+int addRecord(int type, const char* name, const char* value);
+uint32_t snapshotSum(uint32_t sum, const void* data, size_t len);
+int runServer(const char* path);
+int serveClient(int conn);
+int serveCommand(int conn, const char* command, int* fds, int nfds);
+int runClient(const char* path, const char* command);
+int sendFrame(int sock, int type, const void* data, size_t len, int* fds, int nfds);
+int recvFrame(int sock, struct SRVHDR* hdr, int* fds, int* pnfds);
+int readFull(int fd, void* buf, size_t len);
 
 int checkInternal(char* name);
 
+int escapeChar(char** pstr, int octal0);
+int printfNumber(char* arg, intmax_t* num);
+int testArgs(char** argv, int argc);
+int testExpr(char** argv, int argc, int* pos, int level);
+int testUnary(char* op, char* arg);
+int testBinary(char* op, char* lhs, char* rhs);
+int catFile(int fd);
+char* memoKey(char** argv, char** envs, int nenvs, char** inputs, int ninputs, size_t* plen);
+int memoCopy(int in, off_t off, size_t len, int out);
+int watchArg(const char* arg, int recursive);
+int addWatch(const char* dir, const char* pattern, int recursive);
+int matchWatch(const struct inotify_event* ev);
+void setForeground(pid_t pgrp);
+int parseLimit(struct LIMITS* lim, const char* spec);
+int applyLimits(struct LIMITS* lim);
+void printLimits(struct LIMITS* lim);
+int parseDuration(const char* arg, struct timespec* ts);
+
 int internalCommands(int index, int argc, char* command_args[]);
-int externalCommands(int argc, char* command_args[]);
+int externalCommands(int argc, char* command_args[], struct PROGRAM* prog, int pc);
 
 void initHistoryQueue(void);
 void queueHistoryQueue(char* command);
@@ -79,19 +537,83 @@ void saveHistoryQueue(void);
 
 void freeAliasList(void);
 
+unsigned int hashName(const char* name, int len);
+struct VARIABLE* findVar(const char* name, int len);
+char* getVar(const char* name, int len);
+int setVar(const char* name, const char* value);
+void unsetVar(const char* name);
+void freeVarTable(void);
+int isAssignName(const char* name, int len);
+
+int readLine(int fd, int delim, size_t start, size_t* plen);
+int isIfsSpace(int ch, const char* ifs);
+
+void initPwd(void);
+int changeDir(const char* path, int physical);
+int openDirs(void);
+int initDirs(int fd, uint32_t capacity, uint64_t poolsize);
+int checkDirs(const struct DIRDBHDR* hdr, size_t size);
+int lockDirs(void);
+uint32_t lookupDir(const char* path, size_t len);
+void recordDir(const char* path);
+int forgetDir(const char* path);
+int growDirs(uint64_t extra);
+struct DIRREC* findDir(const char* fragment);
+double dirScore(const struct DIRREC* rec, time_t now);
+uint32_t dirMask(const char* name);
+struct DIRREC* dirRecs(void);
+char* dirPool(void);
+char* logicalPath(const char* path);
+
 void exitShell(int exitcode);
 int haveChar(char* string, char ch);
 int redrawCommand(char* command, int len, int cursor, int s);
 
+void requestSegments(void);
+void* segmentWorker(void* arg);
+void gitSegment(struct SEGMENTS* seg, const struct SEGREQUEST* req);
+int gitDirty(const char* root, const struct SEGREQUEST* req);
+int renderPrompt(char* buf, int size);
+int readKey(void);
+int openKeyLog(const char* mode, const char* path);
+int readByte(void);
+void recordLatency(void);
+void printKeyHistogram(void);
+
+void initLoop(void);
+int loopWatch(int fd, int (*func)(int fd));
+int handleSignal(int fd);
+int handleTimer(int fd);
+int handleSegment(int fd);
+void addJob(pid_t pid);
+int reapJobs(int atPrompt);
+
+void initHighlight(void);
+void buildCommandIndex(const char* path);
+int indexCommand(const char* name, int len);
+int findCommand(const char* name, int len);
+int commandClass(const char* word, int len);
+const unsigned char* highlightLine(const char* text, int len);
+int highlightWord(const char* text, int i, int len, unsigned char* cls);
+void putHighlighted(const char* text, const unsigned char* cls, int from, int to);
+
+int utf8Decode(const char* text, int len, int* pcp);
+int charWidth(int cp);
+int displayWidth(const char* text, int len);
+int nextChar(const char* text, int len, int pos);
+int prevChar(const char* text, int pos);
+
 ////////////////////////////////////////
 //GLOBAL TYPE/STRUCT DEFINITIONS
 ////////////////////////////////////////
 
 typedef int(*comfunc)(int argc, char* command_args[]);
+typedef int(*loopfunc)(int fd);
 
 struct COMMAND {
 	char* name;
 	comfunc func;
+	int flags;
 };
 
 struct HISTORY {
@@ -99,12 +621,248 @@ struct HISTORY {
 	int num;
 };
 
+struct LOOPFD {
+	int fd;
+	loopfunc func;
+};
+
+struct JOB {
+	pid_t pid;
+	int id;
+	struct JOB* next;
+};
+
 struct ALIAS {
 	char* alias;
 	char* command;
 	struct ALIAS* next;
 };
 
+struct VARIABLE {
+	char* name;
+	char* value;
+	struct VARIABLE* next;
+};
+
+struct HEREDOC {
+	struct NODE* node;
+	int index;
+	int strip, quoted;
+};
+
+struct LEXER {
+	const char* src[MAX_LEXDEPTH];
+	int depth;
+	int tok;
+	int ionum;
+	char* word;
+	int wlen, wsize;
+	int error;
+	struct HEREDOC heredocs[MAX_HEREDOCS];
+	int nheredocs;
+};
+
+struct HEREBUF {
+	int fd, rfd;
+	size_t len;
+	char buf[READ_BLOCK];
+};
+
+struct REDIR {
+	int type;
+	int fd;
+	char* word;
+};
+
+struct NODE {
+	int type;
+	struct NODE* body[3];
+	struct NODE* next;
+	char** words;
+	int nwords;
+	char** assigns;
+	int nassigns;
+	struct REDIR* redirs;
+	int nredirs;
+	char* name;
+};
+
+struct PROGRAM {
+	int* code;
+	int ncode, codesize;
+	char* strs;
+	int nstrs, strsize;
+	intmax_t* expr;
+	int nexpr, exprsize;
+	int refs;
+	int error;
+	void* map;
+	size_t maplen;
+};
+
+struct CACHEHDR {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dev, ino;
+	int64_t mtime, mtimensec;
+	int64_t size;
+	int32_t ncode, nstrs;
+	uint32_t sum;
+	int32_t nexpr;
+};
+
+struct RCHDR {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dev, ino;
+	int64_t mtime, mtimensec;
+	int64_t size;
+	uint64_t cmdkey;
+	int32_t ncode, nstrs, nexpr, ntable;
+	uint64_t npool, nindex, nrecords;
+	uint32_t sum;
+};
+
+struct DIRDBHDR {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nentries, capacity, nslots, pad;
+	uint64_t poollen, nameslen, poolsize;
+	uint64_t total;
+};
+
+struct DIRREC {
+	uint64_t offset;
+	uint32_t name, len;
+	uint32_t rank, mask;
+	int64_t atime;
+};
+
+struct MEMOHDR {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t keylen, outlen, errlen;
+	int64_t usec;
+	int32_t status;
+};
+
+struct WATCH {
+	int wd;
+	int recursive;
+	char* dir;
+	char* pattern;
+};
+
+struct PROCSUBST {
+	int fd;
+	pid_t pid;
+};
+
+struct LIMITS {
+	int flags;
+	int nice;
+	cpu_set_t cpus;
+	int resources[MAX_LIMITS];
+	rlim_t values[MAX_LIMITS];
+	int nlimits;
+};
+
+struct SRVHDR {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct MEMOSTATS {
+	unsigned long hits, misses;
+	unsigned long long bytes, usec;
+};
+
+struct ARITH {
+	char* text;
+	const char* pchar;
+	int depth;
+	int error;
+};
+
+struct ANODE {
+	int op;
+	intmax_t value;
+	char* name;
+	struct ANODE* kid[3];
+};
+
+struct HIGHLIGHT {
+	char* text;
+	unsigned char* cls;
+	unsigned char* state;
+	int len, size;
+};
+
+struct WIDTHRANGE {
+	unsigned int first, last;
+};
+
+struct SEGMENTS {
+	char repo[PATH_MAX];
+	struct timespec index, head;
+	char branch[MAX_SEGMENT];
+	int dirty;
+	char load[16];
+};
+
+struct SEGREQUEST {
+	char* pwd;
+	char* git;
+	char** env;
+};
+
+struct ARENABLOCK {
+	struct ARENABLOCK* next;
+	size_t size;
+	char data[];
+};
+
+struct ARENAMARK {
+	struct ARENABLOCK* block;
+	size_t used, base;
+};
+
+struct FRAME {
+	int type;
+	int cont, brk;
+	int saved;
+	char* var;
+	char** items;
+	int nitems, item;
+	char* subject;
+	int fds[MAX_REDIRS * 2];
+	int nfds;
+	pid_t fanouts[MAX_REDIRS];
+	int nfanouts;
+	struct ARENAMARK mark;
+};
+
+struct FUNCTION {
+	char* name;
+	struct PROGRAM* prog;
+	int pc;
+	struct FUNCTION* next;
+};
+
+struct ARGV {
+	char** argv;
+	int argc, size;
+	int batch, nbatch;
+};
+
+struct XBUF {
+	char* str;
+	char* flags;
+	size_t len, size;
+	int mark;
+	int err;
+};
+
 ////////////////////////////////////////
 //GLOBAL VARIABLES
 ////////////////////////////////////////
@@ -112,59 +870,323 @@ struct ALIAS {
 struct termios old, cur;
 
 int myshOntty;
-int foreground;
+int termRaw = 0;
+int termFd = -1;
+int lastStatus = 0;
+int promptCont = 0;
 
 const char* mysh_version = "mysh v0.4";
 
 const struct COMMAND commands[] = {
-	{ "exit", mysh_exit },
-	{ "cd", mysh_cd },
-	{ "pushd", mysh_pushd },
-	{ "dirs", mysh_dirs },
-	{ "popd", mysh_popd },
-	{ "history", mysh_history },
-	{ "prompt", mysh_prompt },
-	{ "alias", mysh_alias },
-	{ "unalias", mysh_unalias },
-	{ "lock", mysh_lock },
-	{ "ver", mysh_ver }
+	{ "exit", mysh_exit, 0 },
+	{ "cd", mysh_cd, 0 },
+	{ "pwd", mysh_pwd, 0 },
+	{ "pushd", mysh_pushd, 0 },
+	{ "dirs", mysh_dirs, 0 },
+	{ "popd", mysh_popd, 0 },
+	{ "j", mysh_j, 0 },
+	{ "history", mysh_history, 0 },
+	{ "prompt", mysh_prompt, CF_STATE },
+	{ "alias", mysh_alias, CF_STATE },
+	{ "unalias", mysh_unalias, CF_STATE },
+	{ "lock", mysh_lock, CF_TTY },
+	{ "ver", mysh_ver, 0 },
+	{ "true", mysh_true, CF_STATE },
+	{ ":", mysh_true, CF_STATE },
+	{ "false", mysh_false, CF_STATE },
+	{ "echo", mysh_echo, 0 },
+	{ "printf", mysh_printf, 0 },
+	{ "test", mysh_test, CF_STATE },
+	{ "[", mysh_test, CF_STATE },
+	{ "cat", mysh_cat, CF_TTY },
+	{ "read", mysh_read, CF_TTY },
+	{ "export", mysh_export, CF_STATE },
+	{ "unset", mysh_unset, 0 },
+	{ "break", mysh_break, CF_STATE },
+	{ "continue", mysh_continue, CF_STATE },
+	{ "return", mysh_return, CF_STATE },
+	{ "shift", mysh_shift, CF_STATE },
+	{ "exec", mysh_exec, CF_TTY },
+	{ "allocstats", mysh_allocstats, 0 },
+	{ "memo", mysh_memo, CF_TTY },
+	{ "memostats", mysh_memostats, 0 },
+	{ "onchange", mysh_onchange, CF_TTY },
+	{ "with", mysh_with, CF_TTY },
+	{ "timeout", mysh_timeout, CF_TTY }
 };
 const int nCommands = sizeof(commands) / sizeof(struct COMMAND);
 
-char* dirStack[MAX_DIRS];
+char** dirStack = 0;
 int pDirStack = 0;
+int sizeDirStack = 0;
+
+struct DIRDBHDR* dirDb = 0;
+size_t dirDbLen = 0;
+ino_t dirDbIno = 0;
+int dirDbFd = -1;
+char dirDbPath[MAX_COMLEN];
 
 struct HISTORY historyQueue[MAX_HISTORIES];
 int startHistoryQueue = 0;
 int nHistoryQueue = 0;
 
 char prompt[MAX_PROMPTLEN] = "mysh$";
+long long lastDuration = -1;
+
+pthread_mutex_t segLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t segCond = PTHREAD_COND_INITIALIZER;
+struct SEGMENTS segments;
+struct SEGREQUEST* segRequest = 0;
+int segStarted = 0;
+int segPipe[2] = { -1, -1 };
+
+FILE* recordFile = 0;
+FILE* replayFile = 0;
+int replayCols = 80;
+struct timespec recordStart, keyStart;
+int keyPending = 0;
+int keyUnread = -1;
+unsigned long keyHist[KEYHIST_BUCKETS];
+unsigned long keyCount = 0;
+long long keyTotal = 0, keyMax = 0;
+
+int loopFd = -1;
+int sigFd = -1;
+int timerFd = -1;
+struct LOOPFD loopFds[MAX_LOOPFDS];
+int nLoopFds = 0;
+sigset_t loopMask;
+struct JOB* jobList = 0;
+
+int hlEnabled = 0;
+struct HIGHLIGHT hlCache[2];
+int hlCur = 0;
+const char* hlColors[] = { "\033[0m", "\033[32m", "\033[36m", "\033[35m", "\033[31m", "\033[33m", "\033[34m", "\033[1m" };
+const char* hlKeywords[] = { "if", "then", "else", "elif", "fi", "do", "done", "while", "until", "for", "in", "case", "esac", "function", "{", "}", "!" };
+
+const struct WIDTHRANGE widthZero[] = {
+	{ 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 },
+	{ 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A }, { 0x061C, 0x061C }, { 0x064B, 0x065F },
+	{ 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 }, { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED },
+	{ 0x0711, 0x0711 }, { 0x0730, 0x074A }, { 0x07A6, 0x07B0 }, { 0x07EB, 0x07F3 }, { 0x07FD, 0x07FD },
+	{ 0x0816, 0x0819 }, { 0x081B, 0x0823 }, { 0x0825, 0x0827 }, { 0x0829, 0x082D }, { 0x0859, 0x085B },
+	{ 0x0898, 0x089F }, { 0x08CA, 0x08E1 }, { 0x08E3, 0x0902 }, { 0x093A, 0x093A }, { 0x093C, 0x093C },
+	{ 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 },
+	{ 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 }, { 0x09CD, 0x09CD }, { 0x09E2, 0x09E3 }, { 0x09FE, 0x0A02 },
+	{ 0x0A3C, 0x0A3C }, { 0x0A41, 0x0A51 }, { 0x0A70, 0x0A71 }, { 0x0A75, 0x0A75 }, { 0x0A81, 0x0A82 },
+	{ 0x0ABC, 0x0ABC }, { 0x0AC1, 0x0AC8 }, { 0x0ACD, 0x0ACD }, { 0x0AE2, 0x0AE3 }, { 0x0AFA, 0x0B01 },
+	{ 0x0B3C, 0x0B3C }, { 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B44 }, { 0x0B4D, 0x0B56 }, { 0x0B62, 0x0B63 },
+	{ 0x0B82, 0x0B82 }, { 0x0BC0, 0x0BC0 }, { 0x0BCD, 0x0BCD }, { 0x0C00, 0x0C00 }, { 0x0C04, 0x0C04 },
+	{ 0x0C3C, 0x0C3C }, { 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C56 }, { 0x0C62, 0x0C63 }, { 0x0C81, 0x0C81 },
+	{ 0x0CBC, 0x0CBC }, { 0x0CBF, 0x0CBF }, { 0x0CC6, 0x0CC6 }, { 0x0CCC, 0x0CCD }, { 0x0CE2, 0x0CE3 },
+	{ 0x0D00, 0x0D01 }, { 0x0D3B, 0x0D3C }, { 0x0D41, 0x0D44 }, { 0x0D4D, 0x0D4D }, { 0x0D62, 0x0D63 },
+	{ 0x0D81, 0x0D81 }, { 0x0DCA, 0x0DCA }, { 0x0DD2, 0x0DD6 }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A },
+	{ 0x0E47, 0x0E4E }, { 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EBC }, { 0x0EC8, 0x0ECD }, { 0x0F18, 0x0F19 },
+	{ 0x0F35, 0x0F35 }, { 0x0F37, 0x0F37 }, { 0x0F39, 0x0F39 }, { 0x0F71, 0x0F7E }, { 0x0F80, 0x0F84 },
+	{ 0x0F86, 0x0F87 }, { 0x0F8D, 0x0FBC }, { 0x0FC6, 0x0FC6 }, { 0x102D, 0x1030 }, { 0x1032, 0x1037 },
+	{ 0x1039, 0x103A }, { 0x103D, 0x103E }, { 0x1058, 0x1059 }, { 0x105E, 0x1060 }, { 0x1071, 0x1074 },
+	{ 0x1082, 0x1082 }, { 0x1085, 0x1086 }, { 0x108D, 0x108D }, { 0x109D, 0x109D }, { 0x1160, 0x11FF },
+	{ 0x135D, 0x135F }, { 0x1712, 0x1714 }, { 0x1732, 0x1733 }, { 0x1752, 0x1753 }, { 0x1772, 0x1773 },
+	{ 0x17B4, 0x17B5 }, { 0x17B7, 0x17BD }, { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 }, { 0x17DD, 0x17DD },
+	{ 0x180B, 0x180F }, { 0x1885, 0x1886 }, { 0x18A9, 0x18A9 }, { 0x1920, 0x1922 }, { 0x1927, 0x1928 },
+	{ 0x1932, 0x1932 }, { 0x1939, 0x193B }, { 0x1A17, 0x1A18 }, { 0x1A1B, 0x1A1B }, { 0x1A56, 0x1A56 },
+	{ 0x1A58, 0x1A60 }, { 0x1A62, 0x1A62 }, { 0x1A65, 0x1A6C }, { 0x1A73, 0x1A7F }, { 0x1AB0, 0x1B03 },
+	{ 0x1B34, 0x1B34 }, { 0x1B36, 0x1B3A }, { 0x1B3C, 0x1B3C }, { 0x1B42, 0x1B42 }, { 0x1B6B, 0x1B73 },
+	{ 0x1B80, 0x1B81 }, { 0x1BA2, 0x1BA5 }, { 0x1BA8, 0x1BA9 }, { 0x1BAB, 0x1BAD }, { 0x1BE6, 0x1BE6 },
+	{ 0x1BE8, 0x1BE9 }, { 0x1BED, 0x1BED }, { 0x1BEF, 0x1BF1 }, { 0x1C2C, 0x1C33 }, { 0x1C36, 0x1C37 },
+	{ 0x1CD0, 0x1CD2 }, { 0x1CD4, 0x1CE0 }, { 0x1CE2, 0x1CE8 }, { 0x1CED, 0x1CED }, { 0x1CF4, 0x1CF4 },
+	{ 0x1CF8, 0x1CF9 }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E }, { 0x2060, 0x206F },
+	{ 0x20D0, 0x20F0 }, { 0x2CEF, 0x2CF1 }, { 0x2D7F, 0x2D7F }, { 0x2DE0, 0x2DFF }, { 0x302A, 0x302D },
+	{ 0x3099, 0x309A }, { 0xA66F, 0xA672 }, { 0xA674, 0xA67D }, { 0xA69E, 0xA69F }, { 0xA6F0, 0xA6F1 },
+	{ 0xA802, 0xA802 }, { 0xA806, 0xA806 }, { 0xA80B, 0xA80B }, { 0xA825, 0xA826 }, { 0xA82C, 0xA82C },
+	{ 0xA8C4, 0xA8C5 }, { 0xA8E0, 0xA8F1 }, { 0xA8FF, 0xA8FF }, { 0xA926, 0xA92D }, { 0xA947, 0xA951 },
+	{ 0xA980, 0xA982 }, { 0xA9B3, 0xA9B3 }, { 0xA9B6, 0xA9B9 }, { 0xA9BC, 0xA9BD }, { 0xA9E5, 0xA9E5 },
+	{ 0xAA29, 0xAA2E }, { 0xAA31, 0xAA32 }, { 0xAA35, 0xAA36 }, { 0xAA43, 0xAA43 }, { 0xAA4C, 0xAA4C },
+	{ 0xAA7C, 0xAA7C }, { 0xAAB0, 0xAAB0 }, { 0xAAB2, 0xAAB4 }, { 0xAAB7, 0xAAB8 }, { 0xAABE, 0xAABF },
+	{ 0xAAC1, 0xAAC1 }, { 0xAAEC, 0xAAED }, { 0xAAF6, 0xAAF6 }, { 0xABE5, 0xABE5 }, { 0xABE8, 0xABE8 },
+	{ 0xABED, 0xABED }, { 0xD7B0, 0xD7FB }, { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+	{ 0xFEFF, 0xFEFF }, { 0xFFF9, 0xFFFB }, { 0x101FD, 0x101FD }, { 0x102E0, 0x102E0 }, { 0x10376, 0x1037A },
+	{ 0x10A01, 0x10A0F }, { 0x10A38, 0x10A3F }, { 0x10AE5, 0x10AE6 }, { 0x10D24, 0x10D27 }, { 0x10EAB, 0x10EAC },
+	{ 0x10F46, 0x10F50 }, { 0x10F82, 0x10F85 }, { 0x11001, 0x11001 }, { 0x11038, 0x11046 }, { 0x11070, 0x11070 },
+	{ 0x11073, 0x11074 }, { 0x1107F, 0x11081 }, { 0x110B3, 0x110B6 }, { 0x110B9, 0x110BA }, { 0x110C2, 0x110C2 },
+	{ 0x11100, 0x11102 }, { 0x11127, 0x1112B }, { 0x1112D, 0x11134 }, { 0x11173, 0x11173 }, { 0x11180, 0x11181 },
+	{ 0x111B6, 0x111BE }, { 0x111C9, 0x111CC }, { 0x111CF, 0x111CF }, { 0x1122F, 0x11231 }, { 0x11234, 0x11234 },
+	{ 0x11236, 0x11237 }, { 0x1123E, 0x1123E }, { 0x112DF, 0x112DF }, { 0x112E3, 0x112EA }, { 0x11300, 0x11301 },
+	{ 0x1133B, 0x1133C }, { 0x11340, 0x11340 }, { 0x11366, 0x11374 }, { 0x11438, 0x1143F }, { 0x11442, 0x11444 },
+	{ 0x11446, 0x11446 }, { 0x1145E, 0x1145E }, { 0x114B3, 0x114B8 }, { 0x114BA, 0x114BA }, { 0x114BF, 0x114C0 },
+	{ 0x114C2, 0x114C3 }, { 0x115B2, 0x115B5 }, { 0x115BC, 0x115BD }, { 0x115BF, 0x115C0 }, { 0x115DC, 0x115DD },
+	{ 0x11633, 0x1163A }, { 0x1163D, 0x1163D }, { 0x1163F, 0x11640 }, { 0x116AB, 0x116AB }, { 0x116AD, 0x116AD },
+	{ 0x116B0, 0x116B5 }, { 0x116B7, 0x116B7 }, { 0x1171D, 0x1171F }, { 0x11722, 0x11725 }, { 0x11727, 0x1172B },
+	{ 0x1182F, 0x11837 }, { 0x11839, 0x1183A }, { 0x1193B, 0x1193C }, { 0x1193E, 0x1193E }, { 0x11943, 0x11943 },
+	{ 0x119D4, 0x119DB }, { 0x119E0, 0x119E0 }, { 0x11A01, 0x11A0A }, { 0x11A33, 0x11A38 }, { 0x11A3B, 0x11A3E },
+	{ 0x11A47, 0x11A47 }, { 0x11A51, 0x11A56 }, { 0x11A59, 0x11A5B }, { 0x11A8A, 0x11A96 }, { 0x11A98, 0x11A99 },
+	{ 0x11C30, 0x11C3D }, { 0x11C3F, 0x11C3F }, { 0x11C92, 0x11CA7 }, { 0x11CAA, 0x11CB0 }, { 0x11CB2, 0x11CB3 },
+	{ 0x11CB5, 0x11CB6 }, { 0x11D31, 0x11D45 }, { 0x11D47, 0x11D47 }, { 0x11D90, 0x11D91 }, { 0x11D95, 0x11D95 },
+	{ 0x11D97, 0x11D97 }, { 0x11EF3, 0x11EF4 }, { 0x13430, 0x13438 }, { 0x16AF0, 0x16AF4 }, { 0x16B30, 0x16B36 },
+	{ 0x16F4F, 0x16F4F }, { 0x16F8F, 0x16F92 }, { 0x16FE4, 0x16FE4 }, { 0x1BC9D, 0x1BC9E }, { 0x1BCA0, 0x1CF46 },
+	{ 0x1D167, 0x1D169 }, { 0x1D173, 0x1D182 }, { 0x1D185, 0x1D18B }, { 0x1D1AA, 0x1D1AD }, { 0x1D242, 0x1D244 },
+	{ 0x1DA00, 0x1DA36 }, { 0x1DA3B, 0x1DA6C }, { 0x1DA75, 0x1DA75 }, { 0x1DA84, 0x1DA84 }, { 0x1DA9B, 0x1DAAF },
+	{ 0x1E000, 0x1E02A }, { 0x1E130, 0x1E136 }, { 0x1E2AE, 0x1E2AE }, { 0x1E2EC, 0x1E2EF }, { 0x1E8D0, 0x1E8D6 },
+	{ 0x1E944, 0x1E94A }, { 0xE0001, 0xE01EF }
+};
+const struct WIDTHRANGE widthWide[] = {
+	{ 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 },
+	{ 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x267F, 0x267F },
+	{ 0x2693, 0x2693 }, { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+	{ 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+	{ 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B }, { 0x2728, 0x2728 },
+	{ 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+	{ 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 },
+	{ 0x2E80, 0x3029 }, { 0x302E, 0x303E }, { 0x3041, 0x3096 }, { 0x309B, 0xA4C6 }, { 0xA960, 0xA97C },
+	{ 0xAC00, 0xD7A3 }, { 0xF900, 0xFAD9 }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6B }, { 0xFF01, 0xFF60 },
+	{ 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE3 }, { 0x16FF0, 0x1B2FB }, { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF },
+	{ 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C },
+	{ 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 },
+	{ 0x1F3F8, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC }, { 0x1F4FF, 0x1F53D }, { 0x1F54B, 0x1F54E },
+	{ 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F },
+	{ 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC }, { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6DF }, { 0x1F6EB, 0x1F6EC },
+	{ 0x1F6F4, 0x1F6FC }, { 0x1F7E0, 0x1F7F0 }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF },
+	{ 0x1FA70, 0x1FAF6 }, { 0x20000, 0x3134A }
+};
+const int nWidthZero = sizeof(widthZero) / sizeof(struct WIDTHRANGE);
+const int nWidthWide = sizeof(widthWide) / sizeof(struct WIDTHRANGE);
+int* cmdTable = 0;
+int cmdTableSize = 0;
+int nCmdIndex = 0;
+char* cmdPool = 0;
+size_t cmdPoolLen = 0;
+size_t cmdPoolSize = 0;
+unsigned long cmdIndexKey = 0;
 
 struct ALIAS* aliasList = 0;
 
+int rcLoading = 0;
+int rcPure = 0;
+char* rcRecords = 0;
+size_t rcRecordLen = 0;
+size_t rcRecordSize = 0;
+
+struct VARIABLE* varTable[VAR_BUCKETS];
+
+char* readBuf = 0;
+size_t readBufSize = 0;
+
+const char* scriptName = "mysh";
+char** posArgs = 0;
+int nPosArgs = 0;
+pid_t shellPid;
+pid_t lastBgPid = 0;
+
+struct MEMOSTATS memoLocal;
+struct MEMOSTATS* memoStats = &memoLocal;
+
+struct LIMITS bgLimits;
+
+struct PROCSUBST* procSubsts = 0;
+int nProcSubsts = 0;
+int sizeProcSubsts = 0;
+
+int watchFd = -1;
+struct WATCH* watchList = 0;
+int nWatches = 0;
+int sizeWatches = 0;
+
+struct FRAME* frames = 0;
+int nFrames = 0;
+int sizeFrames = 0;
+struct PROGRAM* vmProg = 0;
+int vmBase = 0;
+int vmForked = 0;
+int vmBackground = 0;
+int vmPipeOut = 0;
+int vmBreak = 0;
+int vmContinue = 0;
+int vmReturn = 0;
+
+struct FUNCTION* funcTable[VAR_BUCKETS];
+int nFunctions = 0;
+
+char* logicalPwd = 0;
+int cwdFd = AT_FDCWD;
+
+struct ARENABLOCK* arenaHead = 0;
+struct ARENABLOCK* arenaBlock = 0;
+void* arenaLast = 0;
+size_t arenaUsed = 0;
+size_t arenaBase = 0;
+size_t arenaPeak = 0;
+unsigned long nMallocs = 0;
+unsigned long nReallocs = 0;
+unsigned long nFrees = 0;
+unsigned long nExecuted = 0;
+
 ////////////////////////////////////////
 //FUNCTION main
 ////////////////////////////////////////
 
 int main(int argc, char *argv[]) {
 	char command[MAX_COMLEN];
-	char* command_args[MAX_ARGLEN];
-	char* expanded_args[MAX_ARGLEN];
-	int ch, ret, nargs;
+	struct PROGRAM* prog;
+	char* source = 0;
+	char* pchar = 0;
+	int ch, ret;
 	int commandlen, len;
 	int history, historyIndex;
-	int i, isEnd = 0, cursor, s;
+	int i, isEnd = 0, cursor, s, charlen;
+	char utf8[4];
+	size_t linelen, sourcelen = 0, sourcesize = 0;
+	struct timespec start, end;
+
+	shellPid = getpid();
+	initPwd();
+
+	//shared so that memo runs in pipelines and subshells are counted
+	pchar = mmap(NULL, sizeof(struct MEMOSTATS), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pchar != MAP_FAILED) memoStats = (struct MEMOSTATS*)pchar;
+	pchar = 0;
+
+	if (argc == 3 && (strcmp(argv[1], "--record") == 0 || strcmp(argv[1], "--replay") == 0)) {
+		if (openKeyLog(argv[1] + 2, argv[2]) < 0) exitShell(2);
+		argc = 1;
+	}
+	if (argc == 3 && strcmp(argv[1], "--server") == 0) exitShell(runServer(argv[2]));
+	if (argc == 4 && strcmp(argv[1], "--client") == 0) exitShell(runClient(argv[2], argv[3]));
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "mysh: -c: option requires an argument\n");
+			exitShell(2);
+		}
+		if (argc > 3) scriptName = argv[3];
+		posArgs = argv + (argc > 3 ? 4 : 3);
+		nPosArgs = argc > 4 ? argc - 4 : 0;
+		exitShell(runScript(argv[2]));
+	}
+	else if (argc > 1) {
+		scriptName = argv[1];
+		posArgs = argv + 2;
+		nPosArgs = argc - 2;
+		exitShell(runFile(argv[1]));
+	}
+	scriptName = argv[0];
 
-	if (!isatty(0)) myshOntty = 0;
+	if (!isatty(0) && !replayFile) myshOntty = 0;
 	else myshOntty = 1;
 
 	if (myshOntty) {
-		initHistoryQueue();
+		setvbuf(stdin, NULL, _IONBF, 0);
+		hlEnabled = !getenv("NO_COLOR") && (!getenv("TERM") || strcmp(getenv("TERM"), "dumb") != 0);
+		if (!replayFile) initHistoryQueue();
 		initSignal();
+		if (!replayFile) initLoop();
+		if (!replayFile) loadRc();
 	}
 
 main_start:
-	if (myshOntty) {
+	if (nProcSubsts > 0) closeProcesses(0);
+	reapJobs(0);
+
+	if (myshOntty && !termRaw && !replayFile) {
 		ret = initTerm();
 		if (ret < 0) {
 			perror("mysh: initTerm()");
@@ -174,24 +1196,38 @@ main_start:
 
 command_start:
 	if (myshOntty) {
+		if (!promptCont) requestSegments();
+		initHighlight();
+		keyPending = 0;
 		redrawCommand(command, 0, 0, 0);
 
 		commandlen = cursor = s = 0;
 		history = 0;
-		while ((ch = getchar()) != '\n') {
-			if (isprint(ch)) {
+		while ((ch = readKey()) != '\n') {
+			if (ch == KEY_REPAINT) {
+				if (history != 0) s = redrawCommand(historyQueue[historyIndex].command, len, cursor, s);
+				else s = redrawCommand(command, commandlen, cursor, s);
+			}
+			else if (isprint(ch) || (ch >= 0xC2 && ch <= 0xF4)) {
 				if (history != 0) {
 					strcpy(command, historyQueue[historyIndex].command);
 					commandlen = len;
 					history = 0;
 				}
-				if (commandlen < MAX_COMLEN - 1) {
-					for (i = commandlen; i > cursor; i--) {
-						command[i] = command[i - 1];
-					}
-					command[cursor] = ch;
-					commandlen++;
-					cursor++;
+				utf8[0] = ch;
+				charlen = ch < 0x80 ? 1 : ch < 0xE0 ? 2 : ch < 0xF0 ? 3 : 4;
+				for (i = 1; i < charlen; i++) {
+					ch = readByte();
+					if ((ch & 0xC0) != 0x80) break;
+					utf8[i] = ch;
+				}
+				//a byte that cuts the sequence short is a key of its own
+				if (i < charlen && ch != EOF) keyUnread = ch;
+				if (i == charlen && commandlen + charlen < MAX_COMLEN) {
+					memmove(command + cursor + charlen, command + cursor, commandlen - cursor);
+					memcpy(command + cursor, utf8, charlen);
+					commandlen += charlen;
+					cursor += charlen;
 					s = redrawCommand(command, commandlen, cursor, s);
 				}
 			} //if (isprint(ch))
@@ -205,11 +1241,10 @@ command_start:
 							commandlen = len;
 							history = 0;
 						}
-						for (i = cursor; i < commandlen; i++) {
-							command[i-1] = command[i];
-						}
-						commandlen--;
-						cursor--;
+						i = prevChar(command, cursor);
+						memmove(command + i, command + cursor, commandlen - cursor);
+						commandlen -= cursor - i;
+						cursor = i;
 						s = redrawCommand(command, commandlen, cursor, s);
 					}
 					break;
@@ -219,6 +1254,8 @@ command_start:
 					goto command_end;
 				case 3: //SIGINT
 					fputs("^C\n", stdout);
+					promptCont = 0;
+					sourcelen = 0;
 					goto command_start;
 				case 27: //Escape
 					switch (escSequence()) {
@@ -248,21 +1285,22 @@ command_start:
 						break;
 					case ES_ARROW_RIGHT:
 						if (history != 0 && cursor < len) {
-							cursor++;
+							cursor = nextChar(historyQueue[historyIndex].command, len, cursor);
 							s = redrawCommand(historyQueue[historyIndex].command, len, cursor, s);
 						}
-						else if (cursor < commandlen) {
-							cursor++;
+						else if (history == 0 && cursor < commandlen) {
+							cursor = nextChar(command, commandlen, cursor);
 							s = redrawCommand(command, commandlen, cursor, s);
 						}
 						break;
 					case ES_ARROW_LEFT:
 						if (cursor > 0) {
-							cursor--;
 							if (history != 0) {
+								cursor = prevChar(historyQueue[historyIndex].command, cursor);
 								s = redrawCommand(historyQueue[historyIndex].command, len, cursor, s);
 							}
 							else {
+								cursor = prevChar(command, cursor);
 								s = redrawCommand(command, commandlen, cursor, s);
 							}
 						}
@@ -273,11 +1311,10 @@ command_start:
 							commandlen = len;
 							history = 0;
 						}
-						if (cursor < commandlen) {
-							for (i = cursor + 1; i < commandlen; i++) {
-								command[i - 1] = command[i];
-							}
-							commandlen--;
+						if (history == 0 && cursor < commandlen) {
+							i = nextChar(command, commandlen, cursor);
+							memmove(command + cursor, command + i, commandlen - i);
+							commandlen -= i - cursor;
 							s = redrawCommand(command, commandlen, cursor, s);
 						}
 						break;
@@ -317,69 +1354,65 @@ command_start:
 	else {
 		if (isEnd) goto command_end;
 
-		commandlen = 0;
-		while ((ch = getchar()) != '\n' && ch != 0 && ch != EOF) {
-			if (commandlen < MAX_COMLEN - 1) {
-				command[commandlen++] = ch;
-			}
+		ret = readLine(0, '\n', 0, &linelen);
+		if (ret < 0) {
+			perror("mysh: readLine()");
+			goto command_end;
 		}
-		command[commandlen] = 0;
+		if (memchr(readBuf, 0, linelen)) {
+			linelen = strlen(readBuf);
+			ret = 0;
+		}
+		pchar = readBuf;
+		commandlen = linelen;
 
-		if (ch == 0 || ch == EOF) isEnd = 1;
+		if (ret == 0) isEnd = 1;
 	} //else
 
 	if (myshOntty) {
-		ret = checkExcl(command);
-		if (ret < 0 || *command == 0) goto command_start;
-		else if (ret>0) puts(command);
+		ret = checkExcl(command, &pchar);
+		if (ret < 0 || (*pchar == 0 && !promptCont)) goto command_start;
+		else if (ret>0) puts(pchar);
 
-		queueHistoryQueue(command);
+		if (*pchar) queueHistoryQueue(pchar);
+		commandlen = strlen(pchar);
 	}
 
-	while ((ret = checkAlias(command)) == 1);
-	if (ret < 0 || *command == 0) goto command_start;
-
-	ret = commandToArgs(command, command_args);
-	if (ret == -1) {
-		fprintf(stderr, "mysh: too many argument\n");
-		goto command_start;
-	}
-	else if (ret == 0) goto command_start;
-
-	nargs = expandArgs(command_args, expanded_args);
-	if (nargs == -1) {
-		goto command_start;
-	}
-
-	if (myshOntty) {
-		ret = resetTerm();
-		if (ret < 0) {
-			perror("mysh: resetTerm()");
+	if (sourcelen + commandlen + 2 > sourcesize) {
+		sourcesize = sourcelen + commandlen + 2 + sourcesize;
+		if (!(source = realloc(source, sourcesize))) {
+			perror("mysh: main()");
 			exitShell(1);
 		}
 	}
-
-	ret = checkInternal(expanded_args[0]);
-	if (ret != -1) {
-		ret = internalCommands(ret, nargs, expanded_args);
-		if (ret < 0) {
-			perror("mysh: internalCommands()");
-		}
+	memcpy(source + sourcelen, pchar, commandlen);
+	sourcelen += commandlen;
+	source[sourcelen++] = '\n';
+	source[sourcelen] = 0;
+
+	ret = parseSource(source, isEnd, &prog);
+	if (ret == PARSE_MORE) {
+		promptCont = 1;
+		goto command_start;
 	}
-	else {
-		ret = externalCommands(nargs, expanded_args);
-		if (ret < 0) {
-			perror("mysh: externalCommands()");
-		}
+	promptCont = 0;
+	sourcelen = 0;
+
+	if (ret == PARSE_ERR) lastStatus = 2;
+	else if (prog) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		vmRun(prog, 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		lastDuration = (end.tv_sec - start.tv_sec) * 1000LL + (end.tv_nsec - start.tv_nsec) / 1000000;
+		vmBreak = vmContinue = vmReturn = 0;
+		releaseProgram(prog);
 	}
-
-	i = 0;
-	while (expanded_args[i]) free(expanded_args[i++]);
+	arenaReset();
 
 	goto main_start;
 
 command_end:
-	if (myshOntty) {
+	if (termRaw) {
 		ret = resetTerm();
 		if (ret < 0) {
 			perror("mysh: resetTerm()");
@@ -387,7 +1420,8 @@ command_end:
 		}
 	}
 
-	exitShell(0);
+	free(source);
+	exitShell(lastStatus);
 	return 0;
 }
 
@@ -396,49 +1430,97 @@ command_end:
 ////////////////////////////////////////
 
 int mysh_exit(int argc, char* argv[]) {
-	exitShell(0);
+	exitShell(argc > 1 ? atoi(argv[1]) & 255 : lastStatus);
 	return 0;
 }
 
 int mysh_cd(int argc, char* argv[]) {
-	int ret;
 	char* dirname;
 	char* errstr;
+	int i, physical = 0, print = 0;
 
-	if (argc == 1) {
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+		if (strcmp(argv[i], "-P") == 0) physical = 1;
+		else if (strcmp(argv[i], "-L") == 0) physical = 0;
+		else if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		}
+		else {
+			fprintf(stderr, "cd: %s: invalid option\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (i == argc) {
 		if (!(dirname = getenv("HOME"))) {
 			fprintf(stderr, "cd: invalid HOME directory\n");
 			return 1;
 		}
 	}
-	else if (argc == 2) dirname = argv[1];
+	else if (i == argc - 1) dirname = argv[i];
 	else {
 		fprintf(stderr, "cd: too many argment\n");
 		return 1;
 	}
 
-	ret = chdir(dirname);
-	if (ret != 0) {
+	if (strcmp(dirname, "-") == 0) {
+		if (!(dirname = getVar("OLDPWD", 6))) {
+			fprintf(stderr, "cd: OLDPWD not set\n");
+			return 1;
+		}
+		print = 1;
+	}
+
+	if (changeDir(dirname, physical) != 0) {
 		errstr = strerror(errno);
 		fprintf(stderr, "cd: %s: %s\n", dirname, errstr);
 		return 1;
 	}
+	if (print) puts(logicalPwd);
+	return 0;
+}
+
+int mysh_pwd(int argc, char* argv[]) {
+	char* pchar;
+
+	if (argc > 1 && strcmp(argv[1], "-P") == 0) {
+		if (!(pchar = getcwd(NULL, 0))) {
+			perror("pwd");
+			return 1;
+		}
+		puts(pchar);
+		free(pchar);
+		return 0;
+	}
+	else if (argc > 1 && strcmp(argv[1], "-L") != 0) {
+		fprintf(stderr, "pwd: %s: invalid option\n", argv[1]);
+		return 1;
+	}
+
+	if (!logicalPwd) {
+		fprintf(stderr, "pwd: current directory is unknown\n");
+		return 1;
+	}
+	puts(logicalPwd);
 	return 0;
 }
 
 int mysh_pushd(int argc, char* argv[]) {
 	char *pchar;
+	char** stack;
 
-	if (pDirStack < MAX_DIRS) {
-		pchar = getcwd(NULL, 0);
-		if (pchar) {
-			dirStack[pDirStack++] = pchar;
-			return 0;
-		}
-		else perror("pushd");
+	if (pDirStack == sizeDirStack) {
+		if (!(stack = realloc(dirStack, sizeof(char*) * (sizeDirStack * 2 + 16)))) goto error;
+		dirStack = stack;
+		sizeDirStack = sizeDirStack * 2 + 16;
 	}
-	else fprintf(stderr, "pushd: directory stack is full\n");
+	if (!(pchar = logicalPwd ? strdup(logicalPwd) : getcwd(NULL, 0))) goto error;
+	dirStack[pDirStack++] = pchar;
+	return 0;
 
+error:
+	perror("pushd");
 	return 1;
 }
 
@@ -455,7 +1537,7 @@ int mysh_dirs(int argc, char* argv[]) {
 int mysh_popd(int argc, char* argv[]) {
 	if (pDirStack > 0) {
 		pDirStack--;
-		if (chdir(dirStack[pDirStack]) != 0) {
+		if (changeDir(dirStack[pDirStack], 0) != 0) {
 			perror("popd");
 			free(dirStack[pDirStack]);
 			return 1;
@@ -470,6 +1552,46 @@ int mysh_popd(int argc, char* argv[]) {
 	return 1;
 }
 
+int mysh_j(int argc, char* argv[]) {
+	struct DIRREC* rec;
+	char* path;
+
+	if (argc != 2 || !*argv[1]) {
+		fprintf(stderr, "j: usage: j fragment\n");
+		return 2;
+	}
+	if (openDirs() < 0) {
+		fprintf(stderr, "j: directory database is unavailable\n");
+		return 1;
+	}
+
+	while ((rec = findDir(argv[1]))) {
+		if (!(path = strdup(dirPool() + rec->offset))) {
+			perror("j");
+			return 1;
+		}
+		if (changeDir(path, 0) == 0) {
+			free(path);
+			return 0;
+		}
+		if (errno != ENOENT && errno != ENOTDIR) {
+			fprintf(stderr, "j: %s: %s\n", path, strerror(errno));
+			free(path);
+			return 1;
+		}
+		//forget directories that have gone away and try the next best one
+		if (forgetDir(path) < 0) {
+			fprintf(stderr, "j: directory database is unavailable\n");
+			free(path);
+			return 1;
+		}
+		free(path);
+	}
+
+	fprintf(stderr, "j: %s: no matching directory\n", argv[1]);
+	return 1;
+}
+
 int mysh_history(int argc, char* argv[]) {
 	int i;
 
@@ -683,494 +1805,7738 @@ int mysh_ver(int argc, char* argv[]) {
 	return 0;
 }
 
-////////////////////////////////////////
-//FUNCTION initSignal
-//FUNCTION resetSignal
-////////////////////////////////////////
+int mysh_true(int argc, char* argv[]) {
+	return 0;
+}
 
-void initSignal(void) {
-	signal(SIGINT, SIG_IGN);
-	signal(SIGQUIT, SIG_IGN);
+int mysh_false(int argc, char* argv[]) {
+	return 1;
 }
 
-void resetSignal(void) {
-	signal(SIGINT, SIG_DFL);
-	signal(SIGQUIT, SIG_DFL);
+int mysh_echo(int argc, char* argv[]) {
+	char* pchar;
+	int i = 1, ch, newline = 1;
+
+	if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+		newline = 0;
+		i++;
+	}
+
+	for (; i < argc; i++) {
+		pchar = argv[i];
+		while (*pchar) {
+			if (*pchar == '\\') {
+				pchar++;
+				if ((ch = escapeChar(&pchar, 1)) == -1) return 0;
+				putchar(ch);
+			}
+			else putchar(*(pchar++));
+		}
+		if (i < argc - 1) putchar(' ');
+	}
+	if (newline) putchar('\n');
+
+	return 0;
 }
 
-////////////////////////////////////////
-//FUNCTION initTerm
-//FUNCTION resetTerm
-////////////////////////////////////////
+int mysh_printf(int argc, char* argv[]) {
+	char spec[64];
+	char* pchar;
+	char* arg;
+	char* tmp;
+	int argi, consumed, speclen, ch, ret = 0;
+	intmax_t num;
 
-int initTerm(void) {
-	int ret;
+	if (argc < 2) {
+		fprintf(stderr, "printf: usage: printf format [argument...]\n");
+		return 2;
+	}
 
-	ret = tcgetattr(0, &old);
-	if (ret != 0) return -1;
+	argi = 2;
+	do {
+		consumed = argi;
+		pchar = argv[1];
+		while (*pchar) {
+			if (*pchar == '\\') {
+				pchar++;
+				if ((ch = escapeChar(&pchar, 0)) == -1) return ret;
+				putchar(ch);
+				continue;
+			}
+			else if (*pchar != '%') {
+				putchar(*(pchar++));
+				continue;
+			}
+			else if (*(pchar + 1) == '%') {
+				putchar('%');
+				pchar += 2;
+				continue;
+			}
 
-	cur = old;
-	cur.c_lflag &= ~(ICANON | ECHO | ISIG);
-	ret = tcsetattr(0, TCSANOW, &cur);
-	if (ret != 0) return -1;
+			speclen = 0;
+			spec[speclen++] = *(pchar++);
+			while (*pchar && strchr("-+ #0", *pchar) && speclen < 8) spec[speclen++] = *(pchar++);
+			if (*pchar == '*') {
+				arg = argi < argc ? argv[argi++] : "0";
+				if (printfNumber(arg, &num) < 0) ret = 1;
+				speclen += snprintf(spec + speclen, 12, "%d", (int)num);
+				pchar++;
+			}
+			else while (isdigit(*pchar) && speclen < 20) spec[speclen++] = *(pchar++);
+			if (*pchar == '.') {
+				spec[speclen++] = *(pchar++);
+				if (*pchar == '*') {
+					arg = argi < argc ? argv[argi++] : "0";
+					if (printfNumber(arg, &num) < 0) ret = 1;
+					speclen += snprintf(spec + speclen, 12, "%d", (int)num);
+					pchar++;
+				}
+				else while (isdigit(*pchar) && speclen < 40) spec[speclen++] = *(pchar++);
+			}
 
-	return 0;
+			arg = argi < argc ? argv[argi++] : NULL;
+			switch (*pchar) {
+			case 'd':
+			case 'i':
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				spec[speclen++] = 'j';
+				spec[speclen++] = *pchar;
+				spec[speclen] = 0;
+				if (printfNumber(arg ? arg : "0", &num) < 0) ret = 1;
+				printf(spec, num);
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+				spec[speclen++] = *pchar;
+				spec[speclen] = 0;
+				if (!arg) arg = "0";
+				errno = 0;
+				if (*arg == '\'' || *arg == '"') printf(spec, (double)(unsigned char)arg[1]);
+				else {
+					double dnum = strtod(arg, &tmp);
+					if (tmp == arg || *tmp || errno) {
+						fprintf(stderr, "printf: %s: invalid number\n", arg);
+						ret = 1;
+					}
+					printf(spec, dnum);
+				}
+				break;
+			case 'c':
+				spec[speclen++] = 'c';
+				spec[speclen] = 0;
+				if (arg && *arg) printf(spec, *arg);
+				else if (arg) printf(spec, 0);
+				break;
+			case 's':
+				spec[speclen++] = 's';
+				spec[speclen] = 0;
+				printf(spec, arg ? arg : "");
+				break;
+			case 'b':
+				spec[speclen++] = 's';
+				spec[speclen] = 0;
+				if (!arg) arg = "";
+				if (!(tmp = malloc(strlen(arg) + 1))) {
+					perror("printf");
+					return 1;
+				}
+				for (speclen = 0; *arg; ) {
+					if (*arg == '\\') {
+						arg++;
+						if ((ch = escapeChar(&arg, 1)) == -1) {
+							tmp[speclen] = 0;
+							printf(spec, tmp);
+							free(tmp);
+							return ret;
+						}
+						tmp[speclen++] = ch;
+					}
+					else tmp[speclen++] = *(arg++);
+				}
+				tmp[speclen] = 0;
+				printf(spec, tmp);
+				free(tmp);
+				break;
+			default:
+				fprintf(stderr, "printf: %%%c: invalid directive\n", *pchar ? *pchar : ' ');
+				return 1;
+			}
+			pchar++;
+		} //while (*pchar)
+	} while (argi < argc && argi > consumed);
+
+	return ret;
 }
 
-int resetTerm(void) {
+int mysh_test(int argc, char* argv[]) {
 	int ret;
 
-	ret = tcsetattr(0, TCSANOW, &old);
-	if (ret != 0) return -1;
+	if (strcmp(argv[0], "[") == 0) {
+		if (strcmp(argv[argc - 1], "]") != 0) {
+			fprintf(stderr, "[: missing ']'\n");
+			return 2;
+		}
+		argc--;
+	}
 
-	return 0;
+	ret = testArgs(argv + 1, argc - 1);
+	if (ret < 0) return 2;
+	return !ret;
 }
 
-////////////////////////////////////////
-//FUNCTION escSequence
-////////////////////////////////////////
+int mysh_cat(int argc, char* argv[]) {
+	int i, fd, ret = 0;
+	char* errstr;
 
-int escSequence(void) {
-	switch (getchar()) {
-	case '[':
-		switch (getchar()) {
-		case 'A':
-			return ES_ARROW_UP;
-		case 'B':
-			return ES_ARROW_DOWN;
-		case 'C':
-			return ES_ARROW_RIGHT;
-		case 'D':
-			return ES_ARROW_LEFT;
-		case '3':
-			if (getchar() == '~') return ES_FUNC_DELETE;
-			break;
+	fflush(stdout);
+
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
 		}
-		break;
-	case 'O':
-		switch (getchar()) {
-		case 'H':
-			return ES_FUNC_HOME;
-		case 'F':
-			return ES_FUNC_END;
+		else if (strcmp(argv[i], "-u") != 0) {
+			fprintf(stderr, "cat: %s: invalid option\n", argv[i]);
+			return 1;
 		}
-		break;
 	}
 
-	return ES_NO_SEQ;
-}
+	if (i == argc) {
+		if (catFile(0) < 0) {
+			perror("cat");
+			return 1;
+		}
+		return 0;
+	}
 
-////////////////////////////////////////
-//FUNCTION checkExcl
-//FUNCTION checkAlias
-////////////////////////////////////////
+	for (; i < argc; i++) {
+		if (strcmp(argv[i], "-") == 0) fd = 0;
+		else if ((fd = open(argv[i], O_RDONLY)) < 0) {
+			errstr = strerror(errno);
+			fprintf(stderr, "cat: %s: %s\n", argv[i], errstr);
+			ret = 1;
+			continue;
+		}
 
-int checkExcl(char* command) {
-	char* pchar;
-	char* history;
-	char* tmp;
-	int historyIndex;
-	int len, historylen, count = 0;
+		if (catFile(fd) < 0) {
+			errstr = strerror(errno);
+			fprintf(stderr, "cat: %s: %s\n", argv[i], errstr);
+			ret = 1;
+		}
+		if (fd != 0) close(fd);
+	}
 
-	pchar = command;
-	while (*pchar == ' ' || *pchar == '\t') pchar++;
-	strcpy(command, pchar);
+	return ret;
+}
 
-	pchar = command;
-	while (*pchar != 0) {
-		if (*pchar == '!') {
-			if (*(pchar + 1) == '!') {
-				len = 2;
-				historyIndex = checkHistoryQueue(-1, NULL, 0);
+int mysh_read(int argc, char* argv[]) {
+	char* pchar;
+	char* ifs;
+	char* value;
+	char* end;
+	size_t len, p, w;
+	long n;
+	int i, v, ret, raw = 0, delim = '\n', fd = 0, nnames;
+
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (pchar = argv[i] + 1; *pchar; pchar++) {
+			if (*pchar == 'r') raw = 1;
+			else if (*pchar == 'd' || *pchar == 'u') {
+				if (*(pchar + 1)) value = pchar + 1;
+				else if (i + 1 < argc) value = argv[++i];
+				else {
+					fprintf(stderr, "read: -%c: option requires an argument\n", *pchar);
+					return 2;
+				}
+				if (*pchar == 'd') delim = (unsigned char)*value;
+				else {
+					n = strtol(value, &end, 10);
+					if (*end || end == value || n < 0 || n > INT_MAX) {
+						fprintf(stderr, "read: %s: invalid file descriptor\n", value);
+						return 2;
+					}
+					fd = n;
+				}
+				break;
 			}
 			else {
-				len = strtol(pchar + 1, &tmp, 10);
-				if ((pchar + 1) != tmp) {
-					historyIndex = checkHistoryQueue(len, NULL, 0);
-					len = tmp - pchar;
+				fprintf(stderr, "read: -%c: invalid option\n", *pchar);
+				return 2;
+			}
+		}
+	}
+
+	nnames = argc - i;
+	for (v = i; v < argc; v++) {
+		if (!isAssignName(argv[v], strlen(argv[v]))) {
+			fprintf(stderr, "read: %s: invalid variable name\n", argv[v]);
+			return 2;
+		}
+	}
+
+	fflush(stdout);
+
+	len = 0;
+	for (;;) {
+		ret = readLine(fd, delim, len, &len);
+		if (ret < 0) {
+			perror("read");
+			return 2;
+		}
+		if (raw) break;
+		for (p = len; p > 0 && readBuf[p - 1] == '\\'; p--);
+		if ((len - p) % 2 == 0) break;
+		len--;
+		if (ret == 0) break;
+	}
+	readBuf[len] = 0;
+
+	if (nnames == 0) {
+		if (!raw) {
+			for (p = w = 0; p < len; p++) {
+				if (readBuf[p] == '\\' && p + 1 < len) p++;
+				else if (readBuf[p] == '\\') continue;
+				readBuf[w++] = readBuf[p];
+			}
+			readBuf[w] = 0;
+		}
+		setVar("REPLY", readBuf);
+		return !ret;
+	}
+
+	if (!(ifs = getVar("IFS", 3))) ifs = " \t\n";
+
+	p = w = 0;
+	while (p < len && isIfsSpace(readBuf[p], ifs)) p++;
+	for (v = 0; v < nnames; v++) {
+		value = readBuf + w;
+		if (v == nnames - 1) {
+			size_t keep = w;
+
+			while (p < len) {
+				if (!raw && readBuf[p] == '\\') {
+					if (++p < len) readBuf[w++] = readBuf[p++];
+					keep = w;
 				}
 				else {
-					len = 1;
-					while (*(pchar + len) != ' '&&*(pchar + len) != 0 && *(pchar + len) != '\t') len++;
-					historyIndex = checkHistoryQueue(0, pchar + 1, len - 1);
+					if (!isIfsSpace(readBuf[p], ifs)) keep = w + 1;
+					readBuf[w++] = readBuf[p++];
 				}
 			}
-			if (historyIndex == -1) {
-				fprintf(stderr, "mysh: history not found\n");
-				return -1;
+			w = keep;
+		}
+		else {
+			while (p < len) {
+				if (!raw && readBuf[p] == '\\') {
+					if (++p < len) readBuf[w++] = readBuf[p++];
+				}
+				else if (readBuf[p] && strchr(ifs, readBuf[p])) break;
+				else readBuf[w++] = readBuf[p++];
 			}
+			if (p < len && !isIfsSpace(readBuf[p], ifs)) p++;
 			else {
-				history = historyQueue[historyIndex].command;
-				if ((historylen = strlen(history)) + strlen(command) - len < MAX_COMLEN) {
-					tmp = strdup(pchar + len);
-					if (!tmp) {
-						perror("mysh: checkExcl()");
-						return -1;
-					}
-					strcpy(pchar, history);
-					strcpy(pchar + historylen, tmp);
-					free(tmp);
-					count++;
-				}
-				else {
-					fprintf(stderr, "mysh: command is too long\n");
-					return -1;
+				while (p < len && isIfsSpace(readBuf[p], ifs)) p++;
+				if (p < len && readBuf[p] != '\\' && readBuf[p] && strchr(ifs, readBuf[p])) p++;
+			}
+			while (p < len && isIfsSpace(readBuf[p], ifs)) p++;
+		}
+		readBuf[w++] = 0;
+		if (setVar(argv[i + v], value) < 0) return 2;
+	}
+
+	return !ret;
+}
+
+int mysh_export(int argc, char* argv[]) {
+	extern char** environ;
+	char** env;
+	char* value;
+	int i, len, ret = 0;
+
+	if (argc == 1) {
+		for (env = environ; *env; env++) printf("export %s\n", *env);
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if ((value = strchr(argv[i], '='))) len = value++ - argv[i];
+		else len = strlen(argv[i]);
+
+		if (!isAssignName(argv[i], len)) {
+			fprintf(stderr, "export: %s: invalid variable name\n", argv[i]);
+			ret = 1;
+			continue;
+		}
+		if (!value && !(value = getVar(argv[i], len))) value = "";
+
+		//set the variable first so that it sees the inherited environment, then export its copy
+		argv[i][len] = 0;
+		if (setVar(argv[i], value) < 0 || setenv(argv[i], getVar(argv[i], len), 1) < 0) {
+			perror("export");
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+int mysh_unset(int argc, char* argv[]) {
+	int i;
+
+	for (i = 1; i < argc; i++) unsetVar(argv[i]);
+	return 0;
+}
+
+int mysh_break(int argc, char* argv[]) {
+	int n = argc > 1 ? atoi(argv[1]) : 1;
+
+	if (n < 1) {
+		fprintf(stderr, "%s: bad loop count\n", argv[0]);
+		return 1;
+	}
+	if (strcmp(argv[0], "break") == 0) vmBreak = n;
+	else vmContinue = n;
+	return 0;
+}
+
+int mysh_continue(int argc, char* argv[]) {
+	return mysh_break(argc, argv);
+}
+
+int mysh_return(int argc, char* argv[]) {
+	vmReturn = 1;
+	return argc > 1 ? atoi(argv[1]) & 255 : lastStatus;
+}
+
+int mysh_shift(int argc, char* argv[]) {
+	int n = argc > 1 ? atoi(argv[1]) : 1;
+
+	if (n < 0 || n > nPosArgs) {
+		fprintf(stderr, "shift: can't shift that many\n");
+		return 1;
+	}
+	posArgs += n;
+	nPosArgs -= n;
+	return 0;
+}
+
+int mysh_exec(int argc, char* argv[]) {
+	if (argc < 2) return 0;
+
+	if (myshOntty && !vmForked && !replayFile) saveHistoryQueue();
+	execCommand(0, 0, argv + 1);
+	return 127;
+}
+
+int mysh_allocstats(int argc, char* argv[]) {
+	if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+		nMallocs = nReallocs = nFrees = nExecuted = 0;
+		arenaPeak = arenaBase + arenaUsed;
+		return 0;
+	}
+	else if (argc > 1) {
+		fprintf(stderr, "allocstats: usage: allocstats [-r]\n");
+		return 1;
+	}
+
+#if defined(MYSH_ALLOCSTATS) && !defined(__SANITIZE_ADDRESS__)
+	printf("malloc   %lu\n", __atomic_load_n(&nMallocs, __ATOMIC_RELAXED));
+	printf("realloc  %lu\n", __atomic_load_n(&nReallocs, __ATOMIC_RELAXED));
+	printf("free     %lu\n", __atomic_load_n(&nFrees, __ATOMIC_RELAXED));
+	printf("commands %lu", nExecuted);
+	if (nExecuted > 0) printf(" (%.2f malloc per command)", (double)nMallocs / nExecuted);
+	putchar('\n');
+#else
+	printf("commands %lu (malloc counts need a -DMYSH_ALLOCSTATS build)\n", nExecuted);
+#endif
+	printf("arena    %zu bytes in use, %zu peak\n", arenaBase + arenaUsed, arenaPeak);
+	return 0;
+}
+
+int mysh_memo(int argc, char* argv[]) {
+	char path[MAX_COMLEN];
+	char tmp[MAX_COMLEN];
+	struct MEMOHDR hdr;
+	struct stat st;
+	struct timespec start, end;
+	char** envs;
+	char** inputs = 0;
+	char* key;
+	char* cached;
+	char* homedir;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i, keylen;
+	pid_t child;
+	int arg, nenvs = 0, ninputs = 0, fd = -1, errfd = -1, status, ret = 1, created = 0;
+
+	if (!(envs = arenaAlloc(sizeof(char*) * argc))) goto syscall_error;
+
+	for (arg = 1; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		if (strcmp(argv[arg], "--") == 0) {
+			arg++;
+			break;
+		}
+		else if (strcmp(argv[arg], "--env") == 0 && arg + 1 < argc) envs[nenvs++] = argv[++arg];
+		else if (strcmp(argv[arg], "--inputs") == 0) {
+			inputs = argv + arg + 1;
+			for (arg++; arg < argc && strcmp(argv[arg], "--") != 0; arg++) ninputs++;
+			if (arg == argc) goto usage;
+		}
+		else goto usage;
+	}
+	if (arg >= argc) goto usage;
+
+	if (!(homedir = getenv("HOME"))) {
+		fprintf(stderr, "memo: HOME not set\n");
+		return 1;
+	}
+	if (!(key = memoKey(argv + arg, envs, nenvs, inputs, ninputs, &keylen))) goto syscall_error;
+	for (i = 0; i < keylen; i++) hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+	if (snprintf(path, MAX_COMLEN, "%s/.mysh_cache/memo-%016" PRIx64, homedir, hash) >= MAX_COMLEN - 16) {
+		fprintf(stderr, "memo: cache path too long\n");
+		goto error;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+		if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == MEMO_MAGIC &&
+			hdr.version == MEMO_VERSION && hdr.keylen == keylen && fstat(fd, &st) == 0 &&
+			sizeof(hdr) + hdr.keylen + hdr.outlen + hdr.errlen == (uint64_t)st.st_size &&
+			(cached = arenaAlloc(keylen)) && pread(fd, cached, keylen, sizeof(hdr)) == (ssize_t)keylen &&
+			memcmp(cached, key, keylen) == 0) {
+			__atomic_fetch_add(&memoStats->hits, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&memoStats->bytes, hdr.outlen + hdr.errlen, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&memoStats->usec, hdr.usec, __ATOMIC_RELAXED);
+			goto replay;
+		}
+		close(fd);
+	}
+
+	snprintf(tmp, MAX_COMLEN, "%s/.mysh_cache", homedir);
+	if (mkdir(tmp, 0700) < 0 && errno != EEXIST) goto syscall_error;
+	if (snprintf(tmp, MAX_COMLEN, "%s.%d", path, (int)getpid()) >= MAX_COMLEN) goto error;
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) goto syscall_error;
+	created = 1;
+	if ((errfd = memfd_create("memo", MFD_CLOEXEC)) < 0) goto syscall_error;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || pwrite(fd, key, keylen, sizeof(hdr)) != (ssize_t)keylen) {
+		goto syscall_error;
+	}
+	lseek(fd, sizeof(hdr) + keylen, SEEK_SET);
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((child = fork()) == 0) {
+		if (dup2(fd, 1) < 0 || dup2(errfd, 2) < 0) _exit(126);
+		if (myshOntty && !vmBackground) resetSignal();
+		runCommand(argc - arg, argv + arg);
+	}
+	else if (child < 0) goto syscall_error;
+
+	while (waitpid(child, &status, 0) < 0) {
+		if (errno != EINTR) goto syscall_error;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	hdr.magic = MEMO_MAGIC;
+	hdr.version = MEMO_VERSION;
+	hdr.keylen = keylen;
+	hdr.outlen = lseek(fd, 0, SEEK_END) - sizeof(hdr) - keylen;
+	hdr.errlen = lseek(errfd, 0, SEEK_END);
+	hdr.usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+	hdr.status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+	if (memoCopy(errfd, 0, hdr.errlen, fd) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) goto syscall_error;
+	//an interrupted run is shown but never cached
+	if (WIFSIGNALED(status) || rename(tmp, path) < 0) unlink(tmp);
+	created = 0;
+	__atomic_fetch_add(&memoStats->misses, 1, __ATOMIC_RELAXED);
+
+replay:
+	fflush(stdout);
+	if (memoCopy(fd, sizeof(hdr) + hdr.keylen, hdr.outlen, 1) < 0 ||
+		memoCopy(fd, sizeof(hdr) + hdr.keylen + hdr.outlen, hdr.errlen, 2) < 0) {
+		goto syscall_error;
+	}
+	ret = hdr.status;
+	goto done;
+
+usage:
+	fprintf(stderr, "memo: usage: memo [--inputs file... --] [--env name]... command [arg...]\n");
+	return 2;
+syscall_error:
+	perror("memo");
+error:
+	ret = 1;
+done:
+	if (created) unlink(tmp);
+	if (fd >= 0) close(fd);
+	if (errfd >= 0) close(errfd);
+	return ret;
+}
+
+int mysh_memostats(int argc, char* argv[]) {
+	if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+		memset(memoStats, 0, sizeof(struct MEMOSTATS));
+		return 0;
+	}
+	else if (argc > 1) {
+		fprintf(stderr, "memostats: usage: memostats [-r]\n");
+		return 1;
+	}
+
+	printf("hits     %lu", memoStats->hits);
+	if (memoStats->hits + memoStats->misses > 0) {
+		printf(" (%.1f%% hit rate)", 100.0 * memoStats->hits / (memoStats->hits + memoStats->misses));
+	}
+	putchar('\n');
+	printf("misses   %lu\n", memoStats->misses);
+	printf("saved    %llu bytes replayed, %llu.%03llu s not run\n", memoStats->bytes,
+		memoStats->usec / 1000000, memoStats->usec / 1000 % 1000);
+	return 0;
+}
+
+int mysh_onchange(int argc, char* argv[]) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event* ev;
+	struct signalfd_siginfo si;
+	struct pollfd pfd[3];
+	struct timespec now;
+	sigset_t mask, oldmask;
+	void (*oldint)(int);
+	char* end;
+	long long deadline = -1, ms;
+	ssize_t n;
+	pid_t child = -1;
+	int i, sep, status, recursive = 0, cancel = 0, debounce = WATCH_DEBOUNCE, pending = 0;
+	int sigfd = -1, pidfd = -1, ret = 1, tty;
+
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != 0 && strcmp(argv[i], "--") != 0; i++) {
+		if (strcmp(argv[i], "-r") == 0) recursive = 1;
+		else if (strcmp(argv[i], "-k") == 0) cancel = 1;
+		else if (strcmp(argv[i], "-q") == 0) cancel = 0;
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			debounce = strtol(argv[++i], &end, 10);
+			if (*end || end == argv[i] || debounce < 0) {
+				fprintf(stderr, "onchange: %s: invalid debounce\n", argv[i]);
+				return 2;
+			}
+		}
+		else goto usage;
+	}
+	for (sep = i; sep < argc && strcmp(argv[sep], "--") != 0; sep++);
+	if (sep == i || sep + 1 >= argc) goto usage;
+
+	watchList = 0;
+	nWatches = sizeWatches = 0;
+	if ((watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) goto syscall_error;
+	for (; i < sep; i++) {
+		if (watchArg(argv[i], recursive) < 0) goto error;
+	}
+
+	//SIGINT is ignored at the prompt; take it through a signalfd to stop watching
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	oldint = signal(SIGINT, SIG_DFL);
+	if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) goto restore;
+
+	//each run gets its own process group, which must own the terminal while it runs
+	tty = isatty(0) && tcgetpgrp(0) == getpgrp();
+
+	for (;;) {
+		ms = -1;
+		if (deadline >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ms = deadline - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+			if (ms < 0) ms = 0;
+		}
+
+		pfd[0].fd = watchFd;
+		pfd[1].fd = sigfd;
+		pfd[2].fd = pidfd;
+		pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+		if (poll(pfd, 3, ms) < 0) {
+			if (errno == EINTR) continue;
+			goto restore;
+		}
+
+		if (pfd[1].revents) {
+			while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+			if (child > 0) {
+				kill(-child, SIGINT);
+				waitpid(child, &status, 0);
+				if (tty) setForeground(getpgrp());
+			}
+			ret = 130;
+			break;
+		}
+
+		if (pfd[0].revents) {
+			while ((n = read(watchFd, buf, sizeof(buf))) > 0) {
+				for (i = 0; i < n; i += sizeof(struct inotify_event) + ev->len) {
+					ev = (const struct inotify_event*)(buf + i);
+					if (!matchWatch(ev)) continue;
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					deadline = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + debounce;
 				}
 			}
-			pchar += historylen;
-		} //if (*pchar == '!')
-		else pchar++;
-	} //while (*pchar != 0)
+		}
+
+		if (pfd[2].revents) {
+			waitpid(child, &status, 0);
+			if (tty) setForeground(getpgrp());
+			lastStatus = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+			close(pidfd);
+			pidfd = child = -1;
+		}
+
+		if (deadline >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec * 1000LL + now.tv_nsec / 1000000 >= deadline) {
+				deadline = -1;
+				pending = 1;
+				if (child > 0 && cancel) kill(-child, SIGTERM);
+			}
+		}
+
+		if (pending && child < 0) {
+			pending = 0;
+			fflush(stdout);
+			if ((child = fork()) == 0) {
+				setpgid(0, 0);
+				if (tty) setForeground(getpgrp());
+				signal(SIGINT, SIG_DFL);
+				sigprocmask(SIG_SETMASK, &oldmask, 0);
+				runCommand(argc - sep - 1, argv + sep + 1);
+			}
+			else if (child < 0) goto restore;
+			setpgid(child, child);
+			if (tty) setForeground(child);
+			if ((pidfd = pidfd_open(child, 0)) < 0) {
+				kill(-child, SIGTERM);
+				waitpid(child, &status, 0);
+				if (tty) setForeground(getpgrp());
+				goto restore;
+			}
+		}
+	}
+
+restore:
+	if (ret != 130) perror("onchange");
+	signal(SIGINT, oldint);
+	sigprocmask(SIG_SETMASK, &oldmask, 0);
+	goto done;
+
+usage:
+	fprintf(stderr, "onchange: usage: onchange [-r] [-k|-q] [-d ms] path... -- command [arg...]\n");
+	return 2;
+syscall_error:
+	perror("onchange");
+error:
+	ret = 1;
+done:
+	if (sigfd >= 0) close(sigfd);
+	if (pidfd >= 0) close(pidfd);
+	if (watchFd >= 0) close(watchFd);
+	watchFd = -1;
+	nWatches = 0;
+	return ret;
+}
+
+int mysh_with(int argc, char* argv[]) {
+	struct LIMITS lim;
+	pid_t child;
+	int i, background = 0;
+
+	memset(&lim, 0, sizeof(lim));
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		background = 1;
+		if (argc == 2) {
+			printLimits(&bgLimits);
+			return 0;
+		}
+		if (argc == 3 && strcmp(argv[2], "-r") == 0) {
+			memset(&bgLimits, 0, sizeof(bgLimits));
+			return 0;
+		}
+	}
+
+	for (i = 1 + background; i < argc && strcmp(argv[i], "--") != 0 && strchr(argv[i], '='); i++) {
+		if (parseLimit(&lim, argv[i]) < 0) return 2;
+	}
+	if (i < argc && strcmp(argv[i], "--") == 0) i++;
+
+	if (background) {
+		if (i < argc) goto usage;
+		bgLimits = lim;
+		return 0;
+	}
+	if (i >= argc) goto usage;
+
+	fflush(stdout);
+	if ((child = fork()) == 0) {
+		if (applyLimits(&lim) < 0) _exit(126);
+		runCommand(argc - i, argv + i);
+	}
+	else if (child < 0) {
+		perror("with: fork()");
+		return 1;
+	}
+	return waitChild(child);
+
+usage:
+	fprintf(stderr, "with: usage: with key=value... [--] command [arg...]\n");
+	fprintf(stderr, "with: usage: with -b [key=value... | -r]\n");
+	fprintf(stderr, "with: keys: cpus=LIST nice=N mem=SIZE cpu=SEC files=N procs=N stack=SIZE core=SIZE\n");
+	return 2;
+}
+
+int mysh_timeout(int argc, char* argv[]) {
+	struct itimerspec its;
+	struct timespec grace = { 0, 0 };
+	struct signalfd_siginfo si;
+	struct pollfd pfd[3];
+	sigset_t mask, oldmask;
+	void (*oldint)(int);
+	uint64_t ticks;
+	pid_t child, target;
+	int i, status, foreground = 0, stage = 0, sigfd = -1, timerfd = -1, pidfd = -1, ret = 125;
+
+	memset(&its, 0, sizeof(its));
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != 0 && strcmp(argv[i], "--") != 0; i++) {
+		if (strcmp(argv[i], "-f") == 0) foreground = 1;
+		else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			if (parseDuration(argv[++i], &grace) < 0) goto invalid;
+		}
+		else goto usage;
+	}
+	if (i < argc && strcmp(argv[i], "--") == 0) i++;
+	if (i + 1 >= argc) goto usage;
+	if (parseDuration(argv[i], &its.it_value) < 0) goto invalid;
+	i++;
+
+	//forward ^C to the command, which may not be in the terminal's process group
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	oldint = signal(SIGINT, SIG_DFL);
+
+	fflush(stdout);
+	if ((child = fork()) == 0) {
+		if (!foreground) setpgid(0, 0);
+		signal(SIGINT, SIG_DFL);
+		sigprocmask(SIG_SETMASK, &oldmask, 0);
+		runCommand(argc - i, argv + i);
+	}
+	else if (child < 0) goto restore;
+	if (!foreground) setpgid(child, child);
+	target = foreground ? child : -child;
+
+	if ((pidfd = pidfd_open(child, 0)) < 0 || (sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+		(timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 || timerfd_settime(timerfd, 0, &its, 0) < 0) {
+		kill(target, SIGKILL);
+		waitpid(child, &status, 0);
+		goto restore;
+	}
+
+	pfd[0].fd = timerfd;
+	pfd[1].fd = sigfd;
+	pfd[2].fd = pidfd;
+	pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 3, -1) < 0) {
+			if (errno == EINTR) continue;
+			kill(target, SIGKILL);
+			waitpid(child, &status, 0);
+			goto restore;
+		}
+		if (pfd[2].revents) break;
+
+		if (pfd[1].revents) {
+			while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+			kill(target, SIGINT);
+		}
+		if (pfd[0].revents && read(timerfd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+			if (stage++ == 0) {
+				kill(target, SIGTERM);
+				kill(target, SIGCONT);
+				its.it_value = grace;
+				if (grace.tv_sec || grace.tv_nsec) timerfd_settime(timerfd, 0, &its, 0);
+			}
+			else kill(target, SIGKILL);
+		}
+	}
+
+	while (waitpid(child, &status, 0) < 0 && errno == EINTR);
+	if (stage == 0) ret = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+	else ret = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL ? 128 + SIGKILL : 124;
+	signal(SIGINT, oldint);
+	sigprocmask(SIG_SETMASK, &oldmask, 0);
+	goto done;
+
+restore:
+	perror("timeout");
+	signal(SIGINT, oldint);
+	sigprocmask(SIG_SETMASK, &oldmask, 0);
+done:
+	if (sigfd >= 0) close(sigfd);
+	if (pidfd >= 0) close(pidfd);
+	if (timerfd >= 0) close(timerfd);
+	return ret;
+
+invalid:
+	fprintf(stderr, "timeout: %s: invalid duration\n", argv[i]);
+	return 125;
+usage:
+	fprintf(stderr, "timeout: usage: timeout [-f] [-k grace] duration command [arg...]\n");
+	return 125;
+}
+
+////////////////////////////////////////
+//FUNCTION escapeChar
+//FUNCTION printfNumber
+////////////////////////////////////////
+
+int escapeChar(char** pstr, int octal0) {
+	char* pchar = *pstr;
+	int i, ch;
+
+	switch (*pchar) {
+	case 'a': ch = '\a'; break;
+	case 'b': ch = '\b'; break;
+	case 'c':
+		*pstr = pchar + 1;
+		return -1;
+	case 'e': ch = 27; break;
+	case 'f': ch = '\f'; break;
+	case 'n': ch = '\n'; break;
+	case 'r': ch = '\r'; break;
+	case 't': ch = '\t'; break;
+	case 'v': ch = '\v'; break;
+	case '\\': ch = '\\'; break;
+	case '0': case '1': case '2': case '3':
+	case '4': case '5': case '6': case '7':
+		if (octal0) {
+			if (*pchar != '0') return '\\';
+			pchar++;
+		}
+		ch = 0;
+		for (i = 0; i < 3 && *pchar >= '0' && *pchar <= '7'; i++) {
+			ch = ch * 8 + (*(pchar++) - '0');
+		}
+		*pstr = pchar;
+		return ch & 0xff;
+	default:
+		return '\\';
+	}
+
+	*pstr = pchar + 1;
+	return ch;
+}
+
+int printfNumber(char* arg, intmax_t* num) {
+	char* end;
+
+	if (*arg == '\'' || *arg == '"') {
+		*num = (unsigned char)arg[1];
+		return 0;
+	}
+
+	errno = 0;
+	*num = strtoimax(arg, &end, 0);
+	if (end == arg || *end || errno) {
+		fprintf(stderr, "printf: %s: invalid number\n", arg);
+		return -1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+//FUNCTION testArgs
+//FUNCTION testExpr
+//FUNCTION testUnary
+//FUNCTION testBinary
+////////////////////////////////////////
+
+int testArgs(char** argv, int argc) {
+	int pos = 0, ret;
+
+	switch (argc) {
+	case 0:
+		return 0;
+	case 1:
+		return argv[0][0] != 0;
+	case 2:
+		if (strcmp(argv[0], "!") == 0) return argv[1][0] == 0;
+		break;
+	case 3:
+		if (testBinary(argv[1], NULL, NULL) >= 0) return testBinary(argv[1], argv[0], argv[2]);
+		if (strcmp(argv[0], "!") == 0) {
+			if ((ret = testArgs(argv + 1, 2)) < 0) return ret;
+			return !ret;
+		}
+		if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0) return testArgs(argv + 1, 1);
+		break;
+	case 4:
+		if (strcmp(argv[0], "!") == 0) {
+			if ((ret = testArgs(argv + 1, 3)) < 0) return ret;
+			return !ret;
+		}
+		if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0) return testArgs(argv + 1, 2);
+		break;
+	}
+
+	ret = testExpr(argv, argc, &pos, 0);
+	if (ret >= 0 && pos < argc) {
+		fprintf(stderr, "test: %s: unexpected operator\n", argv[pos]);
+		return -1;
+	}
+	return ret;
+}
+
+int testExpr(char** argv, int argc, int* pos, int level) {
+	int ret, rhs;
+
+	if (level < 2) {
+		if ((ret = testExpr(argv, argc, pos, level + 1)) < 0) return ret;
+		while (*pos < argc && strcmp(argv[*pos], level == 0 ? "-o" : "-a") == 0) {
+			(*pos)++;
+			if ((rhs = testExpr(argv, argc, pos, level + 1)) < 0) return rhs;
+			ret = level == 0 ? (ret || rhs) : (ret && rhs);
+		}
+		return ret;
+	}
+
+	if (*pos >= argc) {
+		fprintf(stderr, "test: argument expected\n");
+		return -1;
+	}
+
+	if (strcmp(argv[*pos], "!") == 0) {
+		(*pos)++;
+		if ((ret = testExpr(argv, argc, pos, 2)) < 0) return ret;
+		return !ret;
+	}
+	else if (strcmp(argv[*pos], "(") == 0 && !(*pos + 2 < argc && testBinary(argv[*pos + 1], NULL, NULL) >= 0)) {
+		(*pos)++;
+		if ((ret = testExpr(argv, argc, pos, 0)) < 0) return ret;
+		if (*pos >= argc || strcmp(argv[*pos], ")") != 0) {
+			fprintf(stderr, "test: closing paren expected\n");
+			return -1;
+		}
+		(*pos)++;
+		return ret;
+	}
+	else if (*pos + 2 < argc && testBinary(argv[*pos + 1], NULL, NULL) >= 0) {
+		*pos += 3;
+		return testBinary(argv[*pos - 2], argv[*pos - 3], argv[*pos - 1]);
+	}
+	else if (*pos + 1 < argc && testUnary(argv[*pos], NULL) >= 0) {
+		*pos += 2;
+		return testUnary(argv[*pos - 2], argv[*pos - 1]);
+	}
+
+	return argv[(*pos)++][0] != 0;
+}
+
+int testUnary(char* op, char* arg) {
+	struct stat st;
+	char* end;
+	long fd;
+
+	if (op[0] != '-' || op[1] == 0 || op[2] != 0 || !strchr("bcdefghLnprsStuwxz", op[1])) return -1;
+	if (!arg) return 0;
+
+	switch (op[1]) {
+	case 'n':
+		return *arg != 0;
+	case 'z':
+		return *arg == 0;
+	case 't':
+		fd = strtol(arg, &end, 10);
+		if (end == arg || *end) {
+			fprintf(stderr, "test: %s: integer expression expected\n", arg);
+			return -1;
+		}
+		return isatty(fd);
+	case 'r':
+		return faccessat(cwdFd, arg, R_OK, AT_EACCESS) == 0;
+	case 'w':
+		return faccessat(cwdFd, arg, W_OK, AT_EACCESS) == 0;
+	case 'x':
+		return faccessat(cwdFd, arg, X_OK, AT_EACCESS) == 0;
+	case 'h':
+	case 'L':
+		return fstatat(cwdFd, arg, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+	}
+
+	if (fstatat(cwdFd, arg, &st, 0) != 0) return 0;
+
+	switch (op[1]) {
+	case 'b': return S_ISBLK(st.st_mode);
+	case 'c': return S_ISCHR(st.st_mode);
+	case 'd': return S_ISDIR(st.st_mode);
+	case 'e': return 1;
+	case 'f': return S_ISREG(st.st_mode);
+	case 'g': return (st.st_mode & S_ISGID) != 0;
+	case 'p': return S_ISFIFO(st.st_mode);
+	case 's': return st.st_size > 0;
+	case 'S': return S_ISSOCK(st.st_mode);
+	case 'u': return (st.st_mode & S_ISUID) != 0;
+	}
+
+	return 0;
+}
+
+int testBinary(char* op, char* lhs, char* rhs) {
+	static const char* intops[] = { "-eq", "-ne", "-gt", "-ge", "-lt", "-le" };
+	struct stat lst, rst;
+	intmax_t lnum, rnum;
+	char* end;
+	int i, cmp;
+
+	for (i = 0; i < 6; i++) {
+		if (strcmp(op, intops[i]) == 0) break;
+	}
+
+	if (i < 6) {
+		if (!lhs) return 0;
+		lnum = strtoimax(lhs, &end, 10);
+		if (end == lhs || *end) {
+			fprintf(stderr, "test: %s: integer expression expected\n", lhs);
+			return -1;
+		}
+		rnum = strtoimax(rhs, &end, 10);
+		if (end == rhs || *end) {
+			fprintf(stderr, "test: %s: integer expression expected\n", rhs);
+			return -1;
+		}
+		switch (i) {
+		case 0: return lnum == rnum;
+		case 1: return lnum != rnum;
+		case 2: return lnum > rnum;
+		case 3: return lnum >= rnum;
+		case 4: return lnum < rnum;
+		default: return lnum <= rnum;
+		}
+	}
+
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return lhs ? strcmp(lhs, rhs) == 0 : 0;
+	else if (strcmp(op, "!=") == 0) return lhs ? strcmp(lhs, rhs) != 0 : 0;
+	else if (strcmp(op, "<") == 0) return lhs ? strcmp(lhs, rhs) < 0 : 0;
+	else if (strcmp(op, ">") == 0) return lhs ? strcmp(lhs, rhs) > 0 : 0;
+	else if (strcmp(op, "-nt") != 0 && strcmp(op, "-ot") != 0 && strcmp(op, "-ef") != 0) return -1;
+	if (!lhs) return 0;
+
+	if (fstatat(cwdFd, lhs, &lst, 0) != 0) {
+		if (strcmp(op, "-ot") == 0) return fstatat(cwdFd, rhs, &rst, 0) == 0;
+		return 0;
+	}
+	if (fstatat(cwdFd, rhs, &rst, 0) != 0) return strcmp(op, "-nt") == 0;
+
+	if (strcmp(op, "-ef") == 0) return lst.st_dev == rst.st_dev && lst.st_ino == rst.st_ino;
+
+	if (lst.st_mtim.tv_sec != rst.st_mtim.tv_sec) cmp = lst.st_mtim.tv_sec > rst.st_mtim.tv_sec ? 1 : -1;
+	else if (lst.st_mtim.tv_nsec != rst.st_mtim.tv_nsec) cmp = lst.st_mtim.tv_nsec > rst.st_mtim.tv_nsec ? 1 : -1;
+	else cmp = 0;
+	return strcmp(op, "-nt") == 0 ? cmp > 0 : cmp < 0;
+}
+
+////////////////////////////////////////
+//FUNCTION catFile
+//FUNCTION memoKey
+//FUNCTION memoCopy
+//FUNCTION watchArg
+//FUNCTION addWatch
+//FUNCTION matchWatch
+//FUNCTION setForeground
+//FUNCTION parseLimit
+//FUNCTION applyLimits
+//FUNCTION printLimits
+//FUNCTION parseDuration
+////////////////////////////////////////
+
+int catFile(int fd) {
+	static char buf[65536];
+	struct stat inst, outst;
+	ssize_t n, w, total;
+	char* pchar;
+
+	if (fstat(fd, &inst) == 0 && S_ISREG(inst.st_mode) && fstat(1, &outst) == 0) {
+		total = 0;
+		if (S_ISREG(outst.st_mode)) {
+			while ((n = copy_file_range(fd, NULL, 1, NULL, 1 << 30, 0)) > 0) total += n;
+			if (n == 0) return 0;
+			if (total > 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)) {
+				return -1;
+			}
+		}
+		while ((n = sendfile(1, fd, NULL, 1 << 30)) > 0) total += n;
+		if (n == 0) return 0;
+		if (total > 0 || (errno != EINVAL && errno != ENOSYS)) return -1;
+	}
+
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n == 0) break;
+		else if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		pchar = buf;
+		while (n > 0) {
+			w = write(1, pchar, n);
+			if (w < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			pchar += w;
+			n -= w;
+		}
+	}
+
+	return 0;
+}
+
+char* memoKey(char** argv, char** envs, int nenvs, char** inputs, int ninputs, size_t* plen) {
+	struct stat st;
+	FILE* fp;
+	char* key = 0;
+	const char* name;
+	char* value;
+	int i;
+
+	if (!(fp = open_memstream(&key, plen))) return 0;
+
+	for (i = 0; argv[i]; i++) fwrite(argv[i], 1, strlen(argv[i]) + 1, fp);
+	fputc(0, fp);
+	fwrite(logicalPwd ? logicalPwd : "", 1, logicalPwd ? strlen(logicalPwd) + 1 : 1, fp);
+
+	for (i = -1; i < nenvs; i++) {
+		name = i < 0 ? "PATH" : envs[i];
+		if ((value = getenv(name))) fprintf(fp, "%s=%s", name, value);
+		else fputs(name, fp);
+		fputc(0, fp);
+	}
+
+	for (i = 0; i < ninputs; i++) {
+		if (stat(inputs[i], &st) < 0) fprintf(fp, "%s -", inputs[i]);
+		else {
+			fprintf(fp, "%s %jx %jx %jd.%09ld %jd", inputs[i], (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+				(intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (intmax_t)st.st_size);
+		}
+		fputc(0, fp);
+	}
+
+	if (fclose(fp) != 0) {
+		free(key);
+		return 0;
+	}
+	value = arenaStrndup(key, *plen);
+	free(key);
+	return value;
+}
+
+int memoCopy(int in, off_t off, size_t len, int out) {
+	char buf[8192];
+	char* pchar;
+	ssize_t n, w;
+
+	while (len > 0) {
+		n = sendfile(out, in, &off, len);
+		if (n > 0) len -= n;
+		else if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
+		else if (errno == EINVAL || errno == ENOSYS) break;
+		else if (errno != EINTR) return -1;
+	}
+
+	//sendfile refuses O_APPEND outputs
+	while (len > 0) {
+		n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			if (n == 0) errno = EIO;
+			return -1;
+		}
+		off += n;
+		len -= n;
+		for (pchar = buf; n > 0; pchar += w, n -= w) {
+			if ((w = write(out, pchar, n)) < 0) {
+				if (errno != EINTR) return -1;
+				w = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int watchArg(const char* arg, int recursive) {
+	char dir[PATH_MAX];
+	struct stat st;
+	const char* name;
+
+	if (!strpbrk(arg, "*?[") && stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) return addWatch(arg, 0, recursive);
+
+	//files and globs are matched by name in their directory, which also catches rename-on-save
+	if ((name = strrchr(arg, '/'))) {
+		if (name - arg >= PATH_MAX) {
+			fprintf(stderr, "onchange: %s: path too long\n", arg);
+			return -1;
+		}
+		memcpy(dir, arg, name - arg);
+		dir[name - arg] = 0;
+		if (name == arg) strcpy(dir, "/");
+		name++;
+	}
+	else {
+		strcpy(dir, ".");
+		name = arg;
+	}
+	if (strpbrk(dir, "*?[")) {
+		fprintf(stderr, "onchange: %s: glob is only allowed in the last component\n", arg);
+		return -1;
+	}
+	if (*name == 0) return addWatch(dir, 0, recursive);
+
+	return addWatch(dir, name, recursive);
+}
+
+int addWatch(const char* dir, const char* pattern, int recursive) {
+	char path[PATH_MAX];
+	struct WATCH* watch;
+	struct dirent* entry;
+	struct stat st;
+	DIR* pd;
+	int wd;
+
+	if ((wd = inotify_add_watch(watchFd, dir, WATCH_EVENTS)) < 0) {
+		fprintf(stderr, "onchange: %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	if (nWatches == sizeWatches) {
+		if (!(watch = arenaGrow(watchList, sizeof(struct WATCH) * sizeWatches, sizeof(struct WATCH) * (sizeWatches * 2 + 16)))) {
+			perror("onchange");
+			return -1;
+		}
+		watchList = watch;
+		sizeWatches = sizeWatches * 2 + 16;
+	}
+	watch = &watchList[nWatches];
+	watch->wd = wd;
+	watch->recursive = recursive;
+	watch->dir = arenaStrndup(dir, strlen(dir));
+	watch->pattern = pattern ? arenaStrndup(pattern, strlen(pattern)) : 0;
+	if (!watch->dir || (pattern && !watch->pattern)) {
+		perror("onchange");
+		return -1;
+	}
+	nWatches++;
+
+	if (!recursive || !(pd = opendir(dir))) return 0;
+	while ((entry = readdir(pd))) {
+		if (entry->d_name[0] == '.') continue;
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) continue;
+		if (snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name) >= PATH_MAX) continue;
+		if (entry->d_type == DT_UNKNOWN && (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode))) continue;
+		if (addWatch(path, pattern, 1) < 0) {
+			closedir(pd);
+			return -1;
+		}
+	}
+	closedir(pd);
+
+	return 0;
+}
+
+int matchWatch(const struct inotify_event* ev) {
+	char path[PATH_MAX];
+	int i, match = 0;
+
+	if (ev->mask & IN_Q_OVERFLOW) return 1;
+
+	for (i = 0; i < nWatches; i++) {
+		if (watchList[i].wd != ev->wd || ev->len == 0) continue;
+
+		if (watchList[i].recursive && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->name[0] != '.') {
+			if (snprintf(path, PATH_MAX, "%s/%s", watchList[i].dir, ev->name) < PATH_MAX) addWatch(path, watchList[i].pattern, 1);
+		}
+		if (fnmatch(watchList[i].pattern ? watchList[i].pattern : "*", ev->name, FNM_PERIOD) == 0) match = 1;
+	}
+
+	return match;
+}
+
+void setForeground(pid_t pgrp) {
+	void (*oldttou)(int);
+
+	//a background group may only take the terminal with SIGTTOU ignored
+	oldttou = signal(SIGTTOU, SIG_IGN);
+	tcsetpgrp(0, pgrp);
+	signal(SIGTTOU, oldttou);
+}
+
+int parseLimit(struct LIMITS* lim, const char* spec) {
+	static const char* names[] = { "mem", "cpu", "files", "procs", "stack", "core" };
+	static const int resources[] = { RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE, RLIMIT_NPROC, RLIMIT_STACK, RLIMIT_CORE };
+	const char* value = strchr(spec, '=') + 1;
+	const char* pchar;
+	char* end;
+	unsigned long long n;
+	long first, last;
+	int i, j, shift = 0;
+
+	if (strncmp(spec, "cpus=", 5) == 0) {
+		CPU_ZERO(&lim->cpus);
+		for (pchar = value; *pchar; pchar = *end ? end + 1 : end) {
+			first = last = strtol(pchar, &end, 10);
+			if (end != pchar && *end == '-') last = strtol(pchar = end + 1, &end, 10);
+			if (end == pchar || (*end && *end != ',') || first < 0 || last < first || last >= CPU_SETSIZE) goto invalid;
+			for (; first <= last; first++) CPU_SET(first, &lim->cpus);
+		}
+		if (CPU_COUNT(&lim->cpus) == 0) goto invalid;
+		lim->flags |= LIM_CPUS;
+		return 0;
+	}
+	if (strncmp(spec, "nice=", 5) == 0) {
+		lim->nice = strtol(value, &end, 10);
+		if (end == value || *end || lim->nice < -40 || lim->nice > 40) goto invalid;
+		lim->flags |= LIM_NICE;
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(names) / sizeof(char*); i++) {
+		if (strncmp(spec, names[i], value - spec - 1) == 0 && names[i][value - spec - 1] == 0) break;
+	}
+	if (i == sizeof(names) / sizeof(char*)) {
+		fprintf(stderr, "with: %s: unknown limit\n", spec);
+		return -1;
+	}
+
+	if (strcmp(value, "unlimited") == 0) n = RLIM_INFINITY;
+	else {
+		errno = 0;
+		n = strtoull(value, &end, 10);
+		if (end == value || *value == '-' || errno == ERANGE) goto invalid;
+		switch (*end) {
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+		case 't': case 'T': shift = 40; end++; break;
+		}
+		if (*end || n > (RLIM_INFINITY - 1) >> shift) goto invalid;
+		n <<= shift;
+	}
+
+	for (j = 0; j < lim->nlimits && lim->resources[j] != resources[i]; j++);
+	if (j == MAX_LIMITS) goto invalid;
+	lim->resources[j] = resources[i];
+	lim->values[j] = n;
+	if (j == lim->nlimits) lim->nlimits++;
+	return 0;
+
+invalid:
+	fprintf(stderr, "with: %s: invalid value\n", spec);
+	return -1;
+}
+
+int applyLimits(struct LIMITS* lim) {
+	struct rlimit rl;
+	int i;
+
+	if ((lim->flags & LIM_CPUS) && sched_setaffinity(0, sizeof(cpu_set_t), &lim->cpus) < 0) {
+		perror("with: cpus");
+		return -1;
+	}
+	errno = 0;
+	if ((lim->flags & LIM_NICE) && nice(lim->nice) == -1 && errno) {
+		perror("with: nice");
+		return -1;
+	}
+	for (i = 0; i < lim->nlimits; i++) {
+		//only the soft limit moves, so the command can still raise it back up to the hard one
+		if (getrlimit(lim->resources[i], &rl) < 0) {
+			perror("with: getrlimit()");
+			return -1;
+		}
+		rl.rlim_cur = lim->values[i];
+		if (rl.rlim_cur > rl.rlim_max) rl.rlim_max = rl.rlim_cur;
+		if (setrlimit(lim->resources[i], &rl) < 0) {
+			perror("with: setrlimit()");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void printLimits(struct LIMITS* lim) {
+	static const char* names[] = { "mem", "cpu", "files", "procs", "stack", "core" };
+	static const int resources[] = { RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE, RLIMIT_NPROC, RLIMIT_STACK, RLIMIT_CORE };
+	const char* sep = "";
+	int i, j, first;
+
+	if (lim->flags & LIM_CPUS) {
+		printf("cpus=");
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (!CPU_ISSET(i, &lim->cpus)) continue;
+			for (first = i; i + 1 < CPU_SETSIZE && CPU_ISSET(i + 1, &lim->cpus); i++);
+			if (first == i) printf("%s%d", sep, i);
+			else printf("%s%d-%d", sep, first, i);
+			sep = ",";
+		}
+		sep = " ";
+	}
+	if (lim->flags & LIM_NICE) {
+		printf("%snice=%d", sep, lim->nice);
+		sep = " ";
+	}
+	for (i = 0; i < lim->nlimits; i++) {
+		for (j = 0; resources[j] != lim->resources[i]; j++);
+		if (lim->values[i] == RLIM_INFINITY) printf("%s%s=unlimited", sep, names[j]);
+		else printf("%s%s=%llu", sep, names[j], (unsigned long long)lim->values[i]);
+		sep = " ";
+	}
+	if (*sep) putchar('\n');
+}
+
+int parseDuration(const char* arg, struct timespec* ts) {
+	char* end;
+	double value;
+
+	value = strtod(arg, &end);
+	if (end == arg || value < 0 || value != value) return -1;
+	switch (*end) {
+	case 's': end++; break;
+	case 'm': value *= 60; end++; break;
+	case 'h': value *= 3600; end++; break;
+	case 'd': value *= 86400; end++; break;
+	}
+	if (*end || value > 1e9) return -1;
+
+	ts->tv_sec = (time_t)value;
+	ts->tv_nsec = (long)((value - ts->tv_sec) * 1e9 + 0.5);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+//FUNCTION initSignal
+//FUNCTION resetSignal
+////////////////////////////////////////
+
+void initSignal(void) {
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+}
+
+void resetSignal(void) {
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+}
+
+////////////////////////////////////////
+//FUNCTION initTerm
+//FUNCTION resetTerm
+////////////////////////////////////////
+
+int initTerm(void) {
+	int ret;
+
+	if (termFd < 0 && (termFd = fcntl(0, F_DUPFD_CLOEXEC, 10)) < 0) return -1;
+	ret = tcgetattr(termFd, &old);
+	if (ret != 0) return -1;
+
+	cur = old;
+	cur.c_lflag &= ~(ICANON | ECHO | ISIG);
+	ret = tcsetattr(termFd, TCSANOW, &cur);
+	if (ret != 0) return -1;
+
+	termRaw = 1;
+	return 0;
+}
+
+int resetTerm(void) {
+	int ret;
+
+	ret = tcsetattr(termFd, TCSANOW, &old);
+	if (ret != 0) return -1;
+
+	termRaw = 0;
+	return 0;
+}
+
+////////////////////////////////////////
+//FUNCTION escSequence
+////////////////////////////////////////
+
+int escSequence(void) {
+	switch (readByte()) {
+	case '[':
+		switch (readByte()) {
+		case 'A':
+			return ES_ARROW_UP;
+		case 'B':
+			return ES_ARROW_DOWN;
+		case 'C':
+			return ES_ARROW_RIGHT;
+		case 'D':
+			return ES_ARROW_LEFT;
+		case '3':
+			if (readByte() == '~') return ES_FUNC_DELETE;
+			break;
+		}
+		break;
+	case 'O':
+		switch (readByte()) {
+		case 'H':
+			return ES_FUNC_HOME;
+		case 'F':
+			return ES_FUNC_END;
+		}
+		break;
+	}
+
+	return ES_NO_SEQ;
+}
+
+////////////////////////////////////////
+//FUNCTION checkExcl
+////////////////////////////////////////
+
+int checkExcl(const char* command, char** presult) {
+	struct XBUF xb = { 0 };
+	const char* history;
+	char* end;
+	int historyIndex;
+	int len, count = 0;
+
+	while (*command == ' ' || *command == '\t') command++;
+
+	while (*command) {
+		if (*command != '!' || strchr(" \t=(", *(command + 1))) {
+			xbufPut(&xb, *(command++), 0);
+			continue;
+		}
+
+		if (*(command + 1) == '!') {
+			len = 2;
+			historyIndex = checkHistoryQueue(-1, NULL, 0);
+		}
+		else {
+			len = strtol(command + 1, &end, 10);
+			if ((command + 1) != end) {
+				historyIndex = checkHistoryQueue(len, NULL, 0);
+				len = end - command;
+			}
+			else {
+				len = 1 + strcspn(command + 1, " \t");
+				historyIndex = checkHistoryQueue(0, (char*)command + 1, len - 1);
+			}
+		}
+		if (historyIndex == -1) {
+			fprintf(stderr, "mysh: history not found\n");
+			return -1;
+		}
+
+		for (history = historyQueue[historyIndex].command; *history; history++) xbufPut(&xb, *history, 0);
+		command += len;
+		count++;
+	}
+
+	xbufPut(&xb, 0, 0);
+	if (xb.err) {
+		perror("mysh: checkExcl()");
+		return -1;
+	}
+	*presult = xb.str;
+	return count;
+}
+
+////////////////////////////////////////
+//FUNCTION lexInit
+//FUNCTION lexPeek
+//FUNCTION lexGetc
+//FUNCTION lexPutc
+//FUNCTION lexNext
+//FUNCTION lexWord
+//FUNCTION lexDollar
+//FUNCTION lexArith
+//FUNCTION lexProcess
+//FUNCTION lexHeredoc
+//FUNCTION lexPeekNonBlank
+////////////////////////////////////////
+
+void lexInit(struct LEXER* lx, const char* source) {
+	memset(lx, 0, sizeof(struct LEXER));
+	lx->src[0] = source;
+	lx->tok = T_EOF;
+	lx->ionum = -1;
+}
+
+int lexPeek(struct LEXER* lx) {
+	while (*lx->src[lx->depth] == 0 && lx->depth > 0) lx->depth--;
+	return *lx->src[lx->depth] ? (unsigned char)*lx->src[lx->depth] : -1;
+}
+
+int lexGetc(struct LEXER* lx) {
+	int ch = lexPeek(lx);
+
+	if (ch != -1) lx->src[lx->depth]++;
+	return ch;
+}
+
+void lexPutc(struct LEXER* lx, int ch) {
+	char* pchar;
+
+	if (lx->wlen + 1 >= lx->wsize) {
+		if (!(pchar = realloc(lx->word, lx->wsize * 2 + 64))) {
+			perror("mysh: lexPutc()");
+			lx->error = PARSE_ERR;
+			return;
+		}
+		lx->word = pchar;
+		lx->wsize = lx->wsize * 2 + 64;
+	}
+	lx->word[lx->wlen++] = ch;
+}
+
+int lexNext(struct LEXER* lx) {
+	int ch;
+
+	lx->wlen = 0;
+	lx->ionum = -1;
+	if (lx->error) return lx->tok = T_EOF;
+
+	for (;;) {
+		ch = lexPeek(lx);
+		if (ch == ' ' || ch == '\t') lexGetc(lx);
+		else if (ch == '\\' && lx->src[lx->depth][1] == '\n') lx->src[lx->depth] += 2;
+		else if (ch == '#') {
+			while ((ch = lexPeek(lx)) != -1 && ch != '\n') lexGetc(lx);
+		}
+		else break;
+	}
+
+	switch (lexGetc(lx)) {
+	case -1:
+		return lx->tok = T_EOF;
+	case '\n':
+		if (lx->nheredocs > 0 && lexHeredoc(lx) < 0) return lx->tok = T_EOF;
+		return lx->tok = T_NEWLINE;
+	case ';':
+		if (lexPeek(lx) != ';') return lx->tok = T_SEMI;
+		lexGetc(lx);
+		return lx->tok = T_DSEMI;
+	case '&':
+		if (lexPeek(lx) != '&') return lx->tok = T_AMP;
+		lexGetc(lx);
+		return lx->tok = T_AND;
+	case '|':
+		if (lexPeek(lx) != '|') return lx->tok = T_PIPE;
+		lexGetc(lx);
+		return lx->tok = T_OR;
+	case '(':
+		return lx->tok = T_LPAREN;
+	case ')':
+		return lx->tok = T_RPAREN;
+	case '<':
+		if (lexPeek(lx) == '(') break;
+		switch (lexPeek(lx)) {
+		case '<':
+			lexGetc(lx);
+			if (lexPeek(lx) == '<') {
+				lexGetc(lx);
+				return lx->tok = T_TLESS;
+			}
+			if (lexPeek(lx) == '-') {
+				lexGetc(lx);
+				return lx->tok = T_DLESSDASH;
+			}
+			return lx->tok = T_DLESS;
+		case '&':
+			lexGetc(lx);
+			return lx->tok = T_DUPIN;
+		case '>':
+			lexGetc(lx);
+			return lx->tok = T_RDWR;
+		}
+		return lx->tok = T_LESS;
+	case '>':
+		if (lexPeek(lx) == '(') break;
+		switch (lexPeek(lx)) {
+		case '>':
+			lexGetc(lx);
+			return lx->tok = T_DGREAT;
+		case '&':
+			lexGetc(lx);
+			return lx->tok = T_DUPOUT;
+		case '|':
+			lexGetc(lx);
+			return lx->tok = T_CLOBBER;
+		}
+		return lx->tok = T_GREAT;
+	}
+
+	lx->src[lx->depth]--;
+	return lx->tok = lexWord(lx);
+}
+
+int lexWord(struct LEXER* lx) {
+	int ch, next, digits = 1;
+
+	for (;;) {
+		ch = lexPeek(lx);
+		if (ch == -1 || (strchr(" \t\n;&|()<>", ch) && !((ch == '<' || ch == '>') && lx->src[lx->depth][1] == '('))) break;
+		lexGetc(lx);
+		if (!isdigit(ch)) digits = 0;
+
+		if (ch == '\\') {
+			if ((ch = lexGetc(lx)) == '\n') continue;
+			lexPutc(lx, WC_ESC);
+			lexPutc(lx, ch == -1 ? '\\' : ch);
+			if (ch == -1) break;
+		}
+		else if (ch == '\'') {
+			lexPutc(lx, WC_QUOTE);
+			while ((ch = lexGetc(lx)) != '\'') {
+				if (ch == -1) {
+					lx->error = PARSE_MORE;
+					return T_EOF;
+				}
+				lexPutc(lx, WC_ESC);
+				lexPutc(lx, ch);
+			}
+		}
+		else if (ch == '"') {
+			lexPutc(lx, WC_QUOTE);
+			while ((ch = lexGetc(lx)) != '"') {
+				if (ch == -1) {
+					lx->error = PARSE_MORE;
+					return T_EOF;
+				}
+				else if (ch == '\\' && (next = lexPeek(lx)) != -1 && strchr("$`\"\\\n", next)) {
+					lexGetc(lx);
+					if (next == '\n') continue;
+					lexPutc(lx, WC_ESC);
+					lexPutc(lx, next);
+				}
+				else if (ch == '$') {
+					if (lexDollar(lx, VF_QUOTED) < 0) return T_EOF;
+				}
+				else {
+					lexPutc(lx, WC_ESC);
+					lexPutc(lx, ch);
+				}
+			}
+		}
+		else if (ch == '$') {
+			if (lexDollar(lx, 0) < 0) return T_EOF;
+		}
+		else if (ch == '<' || ch == '>') {
+			lexGetc(lx);
+			if (lexProcess(lx, ch == '>' ? VF_OUTPUT : 0) < 0) return T_EOF;
+		}
+		else if (ch <= WC_LAST) {
+			lexPutc(lx, WC_ESC);
+			lexPutc(lx, ch);
+		}
+		else lexPutc(lx, ch);
+	}
+
+	lexPutc(lx, 0);
+	lx->wlen--;
+	if (lx->error) return T_EOF;
+
+	if (digits && lx->wlen > 0 && (ch == '<' || ch == '>')) {
+		lx->ionum = atoi(lx->word);
+		return T_IONUM;
+	}
+	return T_WORD;
+}
+
+int lexDollar(struct LEXER* lx, int quoted) {
+	int ch, brace = 0;
+
+	if ((ch = lexPeek(lx)) == '(' && lx->src[lx->depth][1] == '(') {
+		lx->src[lx->depth] += 2;
+		return lexArith(lx, quoted);
+	}
+	else if (ch == '{') {
+		brace = 1;
+		lexGetc(lx);
+		ch = lexPeek(lx);
+	}
+
+	if (ch != -1 && (isalpha(ch) || ch == '_')) {
+		lexPutc(lx, WC_VAR);
+		lexPutc(lx, VF_BASE | quoted);
+		while ((ch = lexPeek(lx)) != -1 && (isalnum(ch) || ch == '_')) lexPutc(lx, lexGetc(lx));
+	}
+	else if (ch != -1 && (isdigit(ch) || strchr("?#@*$!-", ch))) {
+		lexPutc(lx, WC_VAR);
+		lexPutc(lx, VF_BASE | quoted);
+		lexPutc(lx, lexGetc(lx));
+		while (brace && isdigit(ch) && (ch = lexPeek(lx)) != -1 && isdigit(ch)) lexPutc(lx, lexGetc(lx));
+	}
+	else if (brace) {
+		if (ch == -1) lx->error = PARSE_MORE;
+		else {
+			fprintf(stderr, "mysh: bad substitution\n");
+			lx->error = PARSE_ERR;
+		}
+		return -1;
+	}
+	else {
+		if (quoted) lexPutc(lx, WC_ESC);
+		lexPutc(lx, '$');
+		return 0;
+	}
+
+	if (brace && (ch = lexGetc(lx)) != '}') {
+		if (ch == -1) lx->error = PARSE_MORE;
+		else {
+			fprintf(stderr, "mysh: bad substitution\n");
+			lx->error = PARSE_ERR;
+		}
+		return -1;
+	}
+	lexPutc(lx, WC_ENDVAR);
+
+	return 0;
+}
+
+int lexArith(struct LEXER* lx, int quoted) {
+	int ch, depth = 0;
+
+	lexPutc(lx, WC_ARITH);
+	lexPutc(lx, VF_BASE | quoted);
+
+	for (;;) {
+		if ((ch = lexGetc(lx)) == -1) {
+			lx->error = PARSE_MORE;
+			return -1;
+		}
+		else if (ch <= WC_LAST) {
+			fprintf(stderr, "mysh: syntax error: bad character in arithmetic expression\n");
+			lx->error = PARSE_ERR;
+			return -1;
+		}
+		else if (ch == '(') depth++;
+		else if (ch == ')' && depth > 0) depth--;
+		else if (ch == ')') {
+			if ((ch = lexGetc(lx)) == ')') break;
+			if (ch == -1) lx->error = PARSE_MORE;
+			else {
+				fprintf(stderr, "mysh: syntax error: missing '))'\n");
+				lx->error = PARSE_ERR;
+			}
+			return -1;
+		}
+		lexPutc(lx, ch);
+	}
+	lexPutc(lx, WC_ENDVAR);
+
+	return 0;
+}
+
+int lexProcess(struct LEXER* lx, int output) {
+	int ch, quote = 0, depth = 0;
+
+	lexPutc(lx, WC_PROC);
+	lexPutc(lx, VF_BASE | output);
+
+	for (;;) {
+		if ((ch = lexGetc(lx)) == '\\' && quote != '\'' && lexPeek(lx) != -1) {
+			lexPutc(lx, ch);
+			ch = lexGetc(lx);
+		}
+		else if (quote) {
+			if (ch == quote) quote = 0;
+		}
+		else if (ch == '\'' || ch == '"') quote = ch;
+		else if (ch == '(') depth++;
+		else if (ch == ')' && depth-- == 0) break;
+
+		if (ch == -1) {
+			lx->error = PARSE_MORE;
+			return -1;
+		}
+		else if (ch <= WC_LAST) {
+			fprintf(stderr, "mysh: syntax error: bad character in process substitution\n");
+			lx->error = PARSE_ERR;
+			return -1;
+		}
+		lexPutc(lx, ch);
+	}
+	lexPutc(lx, WC_ENDVAR);
+
+	return 0;
+}
+
+int lexHeredoc(struct LEXER* lx) {
+	struct HEREDOC* hd;
+	struct REDIR* redir;
+	const char* line;
+	char* body;
+	size_t len;
+	int i, ch, next;
+
+	for (i = 0; i < lx->nheredocs; i++) {
+		hd = &lx->heredocs[i];
+		redir = &hd->node->redirs[hd->index];
+		len = strlen(redir->word);
+		lx->wlen = 0;
+
+		for (;;) {
+			while (hd->strip && lexPeek(lx) == '\t') lexGetc(lx);
+			if (lexPeek(lx) == -1) {
+				lx->error = PARSE_MORE;
+				return -1;
+			}
+			line = lx->src[lx->depth];
+			if (strncmp(line, redir->word, len) == 0 && (line[len] == '\n' || line[len] == 0)) {
+				lx->src[lx->depth] += line[len] ? len + 1 : len;
+				break;
+			}
+
+			while ((ch = lexGetc(lx)) != '\n') {
+				if (ch == -1) {
+					lx->error = PARSE_MORE;
+					return -1;
+				}
+				else if (!hd->quoted && ch == '\\' && (next = lexPeek(lx)) != -1 && strchr("$`\\\n", next)) {
+					lexGetc(lx);
+					if (next == '\n') continue;
+					ch = next;
+				}
+				else if (!hd->quoted && ch == '$') {
+					if (lexDollar(lx, VF_QUOTED) < 0) return -1;
+					continue;
+				}
+				if (ch <= WC_LAST) lexPutc(lx, WC_ESC);
+				lexPutc(lx, ch);
+			}
+			lexPutc(lx, '\n');
+		}
+
+		lexPutc(lx, 0);
+		if (lx->error) return -1;
+		if (!(body = strdup(lx->word))) {
+			perror("mysh: lexHeredoc()");
+			lx->error = PARSE_ERR;
+			return -1;
+		}
+		free(redir->word);
+		redir->word = body;
+	}
+
+	lx->nheredocs = 0;
+	lx->wlen = 0;
+	return 0;
+}
+
+int lexPeekNonBlank(struct LEXER* lx) {
+	const char* pchar = lx->src[lx->depth];
+
+	while (*pchar == ' ' || *pchar == '\t') pchar++;
+	return *pchar ? (unsigned char)*pchar : -1;
+}
+
+////////////////////////////////////////
+//FUNCTION parseSource
+//FUNCTION parseError
+//FUNCTION parseList
+//FUNCTION parseAndOr
+//FUNCTION parsePipeline
+//FUNCTION parseCommand
+//FUNCTION parseSimple
+//FUNCTION parseRedirect
+//FUNCTION parseIf
+//FUNCTION parseLoop
+//FUNCTION parseFor
+//FUNCTION parseCase
+//FUNCTION parseFunction
+//FUNCTION newNode
+//FUNCTION freeNode
+////////////////////////////////////////
+
+int parseSource(const char* source, int final, struct PROGRAM** pprog) {
+	struct LEXER lx;
+	struct NODE* tree;
+
+	*pprog = 0;
+	lexInit(&lx, source);
+	lexNext(&lx);
+	tree = parseList(&lx);
+	if (!lx.error && lx.tok != T_EOF) parseError(&lx);
+	if (!lx.error && lx.nheredocs > 0) lx.error = PARSE_MORE;
+	free(lx.word);
+
+	if (lx.error) {
+		freeNode(tree);
+		if (lx.error == PARSE_MORE && final) {
+			fprintf(stderr, "mysh: syntax error: unexpected end of file\n");
+			return PARSE_ERR;
+		}
+		return lx.error;
+	}
+	if (!tree) return PARSE_OK;
+
+	*pprog = compileProgram(tree);
+	freeNode(tree);
+	if (!*pprog) return PARSE_ERR;
+
+	return PARSE_OK;
+}
+
+struct NODE* parseError(struct LEXER* lx) {
+	static const char* tokens[] = {
+		"end of file", 0, 0, "newline", ";", ";;", "&", "&&", "|", "||",
+		"(", ")", "<", ">", ">>", ">|", "<&", ">&", "<>", "<<", "<<-", "<<<"
+	};
+
+	if (lx->error) return 0;
+
+	if (lx->tok == T_EOF) lx->error = PARSE_MORE;
+	else {
+		fprintf(stderr, "mysh: syntax error near \'%s\'\n", tokens[lx->tok] ? tokens[lx->tok] : lx->word);
+		lx->error = PARSE_ERR;
+	}
+	return 0;
+}
+
+int atListEnd(struct LEXER* lx) {
+	static const char* words[] = { "then", "else", "elif", "fi", "do", "done", "esac", "}" };
+	int i;
+
+	if (lx->tok == T_EOF || lx->tok == T_RPAREN || lx->tok == T_DSEMI) return 1;
+	if (lx->tok != T_WORD) return 0;
+
+	for (i = 0; i < sizeof(words) / sizeof(char*); i++) {
+		if (strcmp(lx->word, words[i]) == 0) return 1;
+	}
+	return 0;
+}
+
+int isKeyword(struct LEXER* lx, const char* word) {
+	return lx->tok == T_WORD && strcmp(lx->word, word) == 0;
+}
+
+int expectKeyword(struct LEXER* lx, const char* word) {
+	if (!isKeyword(lx, word)) {
+		parseError(lx);
+		return -1;
+	}
+	lexNext(lx);
+	return 0;
+}
+
+struct NODE* parseList(struct LEXER* lx) {
+	struct NODE* head = 0;
+	struct NODE** tail = &head;
+	struct NODE* node;
+
+	for (;;) {
+		while (lx->tok == T_NEWLINE) lexNext(lx);
+		if (lx->error || atListEnd(lx)) break;
+
+		if (!(node = parseAndOr(lx))) break;
+		if (lx->tok == T_AMP) {
+			struct NODE* bg;
+
+			if (!(bg = newNode(N_BG))) {
+				lx->error = PARSE_ERR;
+				freeNode(node);
+				break;
+			}
+			bg->body[0] = node;
+			node = bg;
+			lexNext(lx);
+		}
+		*tail = node;
+		tail = &node->next;
+
+		if (lx->tok == T_SEMI) lexNext(lx);
+		else if (lx->tok != T_NEWLINE && !atListEnd(lx)) {
+			parseError(lx);
+			break;
+		}
+	}
+
+	if (lx->error) {
+		freeNode(head);
+		return 0;
+	}
+	return head;
+}
+
+struct NODE* parseAndOr(struct LEXER* lx) {
+	struct NODE* left;
+	struct NODE* node;
+
+	if (!(left = parsePipeline(lx))) return 0;
+
+	while (lx->tok == T_AND || lx->tok == T_OR) {
+		if (!(node = newNode(lx->tok == T_AND ? N_AND : N_OR))) {
+			lx->error = PARSE_ERR;
+			break;
+		}
+		node->body[0] = left;
+		left = node;
+
+		do lexNext(lx); while (lx->tok == T_NEWLINE);
+		if (!(node->body[1] = parsePipeline(lx))) break;
+	}
+
+	if (lx->error) {
+		freeNode(left);
+		return 0;
+	}
+	return left;
+}
+
+struct NODE* parsePipeline(struct LEXER* lx) {
+	struct NODE* node;
+	struct NODE* pipe;
+	struct NODE** tail;
+	int negate = 0;
+
+	if (isKeyword(lx, "!")) {
+		negate = 1;
+		lexNext(lx);
+	}
+
+	if (!(node = parseCommand(lx))) return 0;
+
+	if (lx->tok == T_PIPE) {
+		if (!(pipe = newNode(N_PIPE))) {
+			lx->error = PARSE_ERR;
+			freeNode(node);
+			return 0;
+		}
+		pipe->body[0] = node;
+		tail = &node->next;
+		while (lx->tok == T_PIPE) {
+			do lexNext(lx); while (lx->tok == T_NEWLINE);
+			if (!(*tail = parseCommand(lx))) {
+				freeNode(pipe);
+				return 0;
+			}
+			tail = &(*tail)->next;
+		}
+		node = pipe;
+	}
+
+	if (negate) {
+		if (!(pipe = newNode(N_NOT))) {
+			lx->error = PARSE_ERR;
+			freeNode(node);
+			return 0;
+		}
+		pipe->body[0] = node;
+		node = pipe;
+	}
+
+	return node;
+}
+
+struct NODE* parseCommand(struct LEXER* lx) {
+	struct ALIAS* expanded[MAX_LEXDEPTH];
+	struct ALIAS* alias;
+	struct NODE* node;
+	int i, nexpanded = 0;
+
+	while (lx->tok == T_WORD && lx->depth < MAX_LEXDEPTH - 1) {
+		for (alias = aliasList; alias; alias = alias->next) {
+			if (strcmp(alias->alias, lx->word) == 0) break;
+		}
+		for (i = 0; alias && i < nexpanded; i++) {
+			if (expanded[i] == alias) alias = 0;
+		}
+		if (!alias) break;
+
+		expanded[nexpanded++] = alias;
+		lx->src[++lx->depth] = alias->command;
+		lexNext(lx);
+	}
+
+	if (lx->tok == T_WORD) {
+		if (isKeyword(lx, "if")) node = parseIf(lx);
+		else if (isKeyword(lx, "while")) node = parseLoop(lx, N_WHILE);
+		else if (isKeyword(lx, "until")) node = parseLoop(lx, N_UNTIL);
+		else if (isKeyword(lx, "for")) node = parseFor(lx);
+		else if (isKeyword(lx, "case")) node = parseCase(lx);
+		else if (isKeyword(lx, "{")) {
+			lexNext(lx);
+			if ((node = newNode(N_GROUP))) node->body[0] = parseList(lx);
+			else lx->error = PARSE_ERR;
+			if (!lx->error && !node->body[0]) parseError(lx);
+			expectKeyword(lx, "}");
+		}
+		else if (isAssignName(lx->word, lx->wlen) && lexPeekNonBlank(lx) == '(') return parseFunction(lx);
+		else return parseSimple(lx);
+	}
+	else if (lx->tok == T_LPAREN) {
+		lexNext(lx);
+		if ((node = newNode(N_SUBSHELL))) node->body[0] = parseList(lx);
+		else lx->error = PARSE_ERR;
+		if (!lx->error && !node->body[0]) parseError(lx);
+		if (!lx->error && lx->tok != T_RPAREN) parseError(lx);
+		lexNext(lx);
+	}
+	else if (lx->tok == T_IONUM || (lx->tok >= T_LESS && lx->tok <= T_TLESS)) return parseSimple(lx);
+	else return parseError(lx);
+
+	while (!lx->error && (lx->tok == T_IONUM || (lx->tok >= T_LESS && lx->tok <= T_TLESS))) {
+		parseRedirect(lx, node);
+	}
+
+	if (lx->error) {
+		freeNode(node);
+		return 0;
+	}
+	return node;
+}
+
+struct NODE* parseSimple(struct LEXER* lx) {
+	struct NODE* node;
+	char* word;
+
+	if (!(node = newNode(N_SIMPLE))) {
+		lx->error = PARSE_ERR;
+		return 0;
+	}
+
+	while (!lx->error) {
+		if (lx->tok == T_IONUM || (lx->tok >= T_LESS && lx->tok <= T_TLESS)) {
+			parseRedirect(lx, node);
+			continue;
+		}
+		else if (lx->tok != T_WORD) break;
+
+		if (!(word = strdup(lx->word))) {
+			perror("mysh: parseSimple()");
+			lx->error = PARSE_ERR;
+			break;
+		}
+		if (node->nwords == 0 && isAssignWord(word)) {
+			if (addWord(&node->assigns, &node->nassigns, word) < 0) lx->error = PARSE_ERR;
+		}
+		else if (addWord(&node->words, &node->nwords, word) < 0) lx->error = PARSE_ERR;
+		lexNext(lx);
+	}
+
+	if (!lx->error && node->nwords == 0 && node->nassigns == 0 && node->nredirs == 0) parseError(lx);
+	if (lx->error) {
+		freeNode(node);
+		return 0;
+	}
+	return node;
+}
+
+int parseRedirect(struct LEXER* lx, struct NODE* node) {
+	struct HEREDOC* hd;
+	struct REDIR* redirs;
+	char* pchar;
+	char* delim;
+	int fd = -1, type, strip;
+
+	if (lx->tok == T_IONUM) {
+		fd = lx->ionum;
+		lexNext(lx);
+	}
+
+	switch (lx->tok) {
+	case T_LESS: type = R_IN; break;
+	case T_GREAT: type = R_OUT; break;
+	case T_CLOBBER: type = R_OUT; break;
+	case T_DGREAT: type = R_APPEND; break;
+	case T_DUPIN: type = R_DUPIN; break;
+	case T_DUPOUT: type = R_DUPOUT; break;
+	case T_RDWR: type = R_RDWR; break;
+	case T_DLESS: type = R_HEREDOC; break;
+	case T_DLESSDASH: type = R_HEREDOC; break;
+	case T_TLESS: type = R_HERESTR; break;
+	default:
+		parseError(lx);
+		return -1;
+	}
+	if (fd < 0) fd = (type == R_OUT || type == R_APPEND || type == R_DUPOUT) ? 1 : 0;
+	strip = lx->tok == T_DLESSDASH;
+
+	if (lexNext(lx) != T_WORD) {
+		parseError(lx);
+		return -1;
+	}
+
+	if (!(redirs = realloc(node->redirs, sizeof(struct REDIR) * (node->nredirs + 1)))) {
+		perror("mysh: parseRedirect()");
+		lx->error = PARSE_ERR;
+		return -1;
+	}
+	node->redirs = redirs;
+	redirs[node->nredirs].type = type;
+	redirs[node->nredirs].fd = fd;
+	if (!(redirs[node->nredirs].word = strdup(lx->word))) {
+		perror("mysh: parseRedirect()");
+		lx->error = PARSE_ERR;
+		return -1;
+	}
+
+	if (type == R_HEREDOC) {
+		if (lx->nheredocs >= MAX_HEREDOCS) {
+			fprintf(stderr, "mysh: too many here-documents\n");
+			lx->error = PARSE_ERR;
+			free(redirs[node->nredirs].word);
+			return -1;
+		}
+		hd = &lx->heredocs[lx->nheredocs++];
+		hd->node = node;
+		hd->index = node->nredirs;
+		hd->strip = strip;
+		hd->quoted = 0;
+		for (delim = pchar = redirs[node->nredirs].word; *pchar; pchar++) {
+			if (*pchar == WC_QUOTE) hd->quoted = 1;
+			else if (*pchar == WC_ESC) {
+				hd->quoted = 1;
+				*(delim++) = *(++pchar);
+			}
+			else *(delim++) = *pchar;
+		}
+		*delim = 0;
+	}
+	node->nredirs++;
+
+	lexNext(lx);
+	return 0;
+}
+
+struct NODE* parseIf(struct LEXER* lx) {
+	struct NODE* node;
+
+	if (!(node = newNode(N_IF))) {
+		lx->error = PARSE_ERR;
+		return 0;
+	}
+
+	lexNext(lx);
+	if (!(node->body[0] = parseList(lx)) || expectKeyword(lx, "then") < 0 ||
+		!(node->body[1] = parseList(lx))) {
+		parseError(lx);
+	}
+	else if (isKeyword(lx, "elif")) node->body[2] = parseIf(lx);
+	else {
+		if (isKeyword(lx, "else")) {
+			lexNext(lx);
+			if (!(node->body[2] = parseList(lx))) parseError(lx);
+		}
+		if (!lx->error) expectKeyword(lx, "fi");
+	}
+
+	if (lx->error) {
+		freeNode(node);
+		return 0;
+	}
+	return node;
+}
+
+struct NODE* parseLoop(struct LEXER* lx, int type) {
+	struct NODE* node;
+
+	if (!(node = newNode(type))) {
+		lx->error = PARSE_ERR;
+		return 0;
+	}
+
+	lexNext(lx);
+	if (!(node->body[0] = parseList(lx)) || expectKeyword(lx, "do") < 0 ||
+		!(node->body[1] = parseList(lx)) || expectKeyword(lx, "done") < 0) {
+		parseError(lx);
+		freeNode(node);
+		return 0;
+	}
+
+	return node;
+}
+
+struct NODE* parseFor(struct LEXER* lx) {
+	struct NODE* node;
+	char* word;
+
+	if (!(node = newNode(N_FOR))) {
+		lx->error = PARSE_ERR;
+		return 0;
+	}
+	node->nwords = -1;
+
+	if (lexNext(lx) != T_WORD || !isAssignName(lx->word, lx->wlen)) {
+		parseError(lx);
+		goto error;
+	}
+	if (!(node->name = strdup(lx->word))) {
+		lx->error = PARSE_ERR;
+		goto error;
+	}
+
+	lexNext(lx);
+	while (lx->tok == T_NEWLINE) lexNext(lx);
+	if (isKeyword(lx, "in")) {
+		node->nwords = 0;
+		while (lexNext(lx) == T_WORD) {
+			if (!(word = strdup(lx->word)) || addWord(&node->words, &node->nwords, word) < 0) {
+				lx->error = PARSE_ERR;
+				goto error;
+			}
+		}
+		if (lx->tok != T_SEMI && lx->tok != T_NEWLINE) {
+			parseError(lx);
+			goto error;
+		}
+		lexNext(lx);
+	}
+	else if (lx->tok == T_SEMI) lexNext(lx);
+
+	while (lx->tok == T_NEWLINE) lexNext(lx);
+	if (expectKeyword(lx, "do") < 0 || !(node->body[0] = parseList(lx)) || expectKeyword(lx, "done") < 0) {
+		parseError(lx);
+		goto error;
+	}
+
+	return node;
+
+error:
+	freeNode(node);
+	return 0;
+}
+
+struct NODE* parseCase(struct LEXER* lx) {
+	struct NODE* node;
+	struct NODE* item;
+	struct NODE** tail;
+	char* word;
+
+	if (!(node = newNode(N_CASE))) {
+		lx->error = PARSE_ERR;
+		return 0;
+	}
+	tail = &node->body[0];
+
+	if (lexNext(lx) != T_WORD) {
+		parseError(lx);
+		goto error;
+	}
+	if (!(node->name = strdup(lx->word))) {
+		lx->error = PARSE_ERR;
+		goto error;
+	}
+
+	do lexNext(lx); while (lx->tok == T_NEWLINE);
+	if (expectKeyword(lx, "in") < 0) goto error;
+
+	for (;;) {
+		while (lx->tok == T_NEWLINE) lexNext(lx);
+		if (isKeyword(lx, "esac")) break;
+
+		if (!(item = newNode(N_CASEITEM))) {
+			lx->error = PARSE_ERR;
+			goto error;
+		}
+		*tail = item;
+		tail = &item->next;
+
+		if (lx->tok == T_LPAREN) lexNext(lx);
+		for (;;) {
+			if (lx->tok != T_WORD) {
+				parseError(lx);
+				goto error;
+			}
+			if (!(word = strdup(lx->word)) || addWord(&item->words, &item->nwords, word) < 0) {
+				lx->error = PARSE_ERR;
+				goto error;
+			}
+			if (lexNext(lx) != T_PIPE) break;
+			lexNext(lx);
+		}
+		if (lx->tok != T_RPAREN) {
+			parseError(lx);
+			goto error;
+		}
+		lexNext(lx);
+
+		item->body[0] = parseList(lx);
+		if (lx->error) goto error;
+		if (lx->tok == T_DSEMI) lexNext(lx);
+		else if (!isKeyword(lx, "esac")) {
+			parseError(lx);
+			goto error;
+		}
+	}
+	lexNext(lx);
+
+	return node;
+
+error:
+	freeNode(node);
+	return 0;
+}
+
+struct NODE* parseFunction(struct LEXER* lx) {
+	struct NODE* node;
+
+	if (!(node = newNode(N_FUNC)) || !(node->name = strdup(lx->word))) {
+		lx->error = PARSE_ERR;
+		freeNode(node);
+		return 0;
+	}
+
+	lexNext(lx);
+	if (lexNext(lx) != T_RPAREN) {
+		parseError(lx);
+		freeNode(node);
+		return 0;
+	}
+	do lexNext(lx); while (lx->tok == T_NEWLINE);
+
+	if (!(node->body[0] = parseCommand(lx))) {
+		parseError(lx);
+		freeNode(node);
+		return 0;
+	}
+	if (node->body[0]->type == N_SIMPLE) {
+		fprintf(stderr, "mysh: syntax error: function body must be a compound command\n");
+		lx->error = PARSE_ERR;
+		freeNode(node);
+		return 0;
+	}
+
+	return node;
+}
+
+struct NODE* newNode(int type) {
+	struct NODE* node;
+
+	if (!(node = calloc(1, sizeof(struct NODE)))) {
+		perror("mysh: newNode()");
+		return 0;
+	}
+	node->type = type;
+	return node;
+}
+
+void freeNode(struct NODE* node) {
+	struct NODE* next;
+	int i;
+
+	while (node) {
+		next = node->next;
+		for (i = 0; i < 3; i++) freeNode(node->body[i]);
+		for (i = 0; i < node->nwords; i++) free(node->words[i]);
+		for (i = 0; i < node->nassigns; i++) free(node->assigns[i]);
+		for (i = 0; i < node->nredirs; i++) free(node->redirs[i].word);
+		free(node->words);
+		free(node->assigns);
+		free(node->redirs);
+		free(node->name);
+		free(node);
+		node = next;
+	}
+}
+
+int addWord(char*** pwords, int* pn, char* word) {
+	char** words;
+
+	if (!(words = realloc(*pwords, sizeof(char*) * (*pn + 2)))) {
+		perror("mysh: addWord()");
+		free(word);
+		return -1;
+	}
+	words[(*pn)++] = word;
+	words[*pn] = 0;
+	*pwords = words;
+	return 0;
+}
+
+int isAssignWord(const char* word) {
+	const char* pchar = strchr(word, '=');
+
+	return pchar && isAssignName(word, pchar - word);
+}
+
+////////////////////////////////////////
+//FUNCTION compileProgram
+//FUNCTION compileList
+//FUNCTION compileNode
+//FUNCTION emit
+//FUNCTION emitStr
+//FUNCTION releaseProgram
+////////////////////////////////////////
+
+struct PROGRAM* compileProgram(struct NODE* tree) {
+	struct PROGRAM* prog;
+
+	if (!(prog = calloc(1, sizeof(struct PROGRAM)))) {
+		perror("mysh: compileProgram()");
+		return 0;
+	}
+	prog->refs = 1;
+
+	compileList(prog, tree);
+	emit(prog, OP_END);
+
+	if (prog->error) {
+		if (prog->error == 1) perror("mysh: compileProgram()");
+		releaseProgram(prog);
+		return 0;
+	}
+	return prog;
+}
+
+void compileList(struct PROGRAM* prog, struct NODE* node) {
+	for (; node; node = node->next) compileNode(prog, node);
+}
+
+void compileNode(struct PROGRAM* prog, struct NODE* node) {
+	struct NODE* item;
+	int i, at, skip = -1, brk, start, end;
+
+	if (node->type != N_SIMPLE && node->nredirs > 0) {
+		emit(prog, OP_REDIR);
+		skip = emit(prog, 0);
+		emit(prog, node->nredirs);
+		for (i = 0; i < node->nredirs; i++) {
+			emit(prog, node->redirs[i].type);
+			emit(prog, node->redirs[i].fd);
+			emit(prog, emitWord(prog, node->redirs[i].word));
+		}
+	}
+
+	switch (node->type) {
+	case N_SIMPLE:
+		emit(prog, OP_SIMPLE);
+		emit(prog, node->nwords);
+		emit(prog, node->nassigns);
+		emit(prog, node->nredirs);
+		for (i = 0; i < node->nwords; i++) emit(prog, emitWord(prog, node->words[i]));
+		for (i = 0; i < node->nassigns; i++) emit(prog, emitWord(prog, node->assigns[i]));
+		for (i = 0; i < node->nredirs; i++) {
+			emit(prog, node->redirs[i].type);
+			emit(prog, node->redirs[i].fd);
+			emit(prog, emitWord(prog, node->redirs[i].word));
+		}
+		break;
+	case N_AND:
+	case N_OR:
+		compileNode(prog, node->body[0]);
+		emit(prog, node->type == N_AND ? OP_JNZ : OP_JZ);
+		at = emit(prog, 0);
+		compileNode(prog, node->body[1]);
+		prog->code[at] = prog->ncode;
+		break;
+	case N_NOT:
+		compileNode(prog, node->body[0]);
+		emit(prog, OP_NOT);
+		break;
+	case N_PIPE:
+		for (i = 0, item = node->body[0]; item; item = item->next) i++;
+		emit(prog, OP_PIPE);
+		emit(prog, i);
+		at = prog->ncode;
+		while (i-- >= 0) emit(prog, 0);
+		for (i = 0, item = node->body[0]; item; item = item->next, i++) {
+			prog->code[at + i] = prog->ncode;
+			compileNode(prog, item);
+			emit(prog, OP_EXIT);
+		}
+		prog->code[at + i] = prog->ncode;
+		break;
+	case N_BG:
+	case N_SUBSHELL:
+		emit(prog, node->type == N_BG ? OP_BG : OP_SUBSHELL);
+		at = emit(prog, 0);
+		compileList(prog, node->body[0]);
+		emit(prog, OP_EXIT);
+		prog->code[at] = prog->ncode;
+		break;
+	case N_GROUP:
+		compileList(prog, node->body[0]);
+		break;
+	case N_IF:
+		compileList(prog, node->body[0]);
+		emit(prog, OP_JNZ);
+		at = emit(prog, 0);
+		compileList(prog, node->body[1]);
+		emit(prog, OP_JMP);
+		end = emit(prog, 0);
+		prog->code[at] = prog->ncode;
+		if (node->body[2]) compileList(prog, node->body[2]);
+		else {
+			emit(prog, OP_STATUS);
+			emit(prog, 0);
+		}
+		prog->code[end] = prog->ncode;
+		break;
+	case N_WHILE:
+	case N_UNTIL:
+		emit(prog, OP_LOOP);
+		brk = emit(prog, 0);
+		start = prog->ncode;
+		compileList(prog, node->body[0]);
+		emit(prog, node->type == N_WHILE ? OP_JNZ : OP_JZ);
+		at = emit(prog, 0);
+		compileList(prog, node->body[1]);
+		emit(prog, OP_LOOPSAVE);
+		emit(prog, OP_JMP);
+		emit(prog, start);
+		prog->code[at] = prog->ncode;
+		emit(prog, OP_LOOPEND);
+		prog->code[brk] = prog->ncode;
+		break;
+	case N_FOR:
+		emit(prog, OP_FOR);
+		emit(prog, emitStr(prog, node->name));
+		emit(prog, node->nwords);
+		for (i = 0; i < node->nwords; i++) emit(prog, emitWord(prog, node->words[i]));
+		brk = emit(prog, 0);
+		start = prog->ncode;
+		emit(prog, OP_FORNEXT);
+		at = emit(prog, 0);
+		compileList(prog, node->body[0]);
+		emit(prog, OP_LOOPSAVE);
+		emit(prog, OP_JMP);
+		emit(prog, start);
+		prog->code[at] = prog->ncode;
+		emit(prog, OP_LOOPEND);
+		prog->code[brk] = prog->ncode;
+		break;
+	case N_CASE:
+		emit(prog, OP_CASE);
+		emit(prog, emitWord(prog, node->name));
+		end = -1;
+		for (item = node->body[0]; item; item = item->next) {
+			emit(prog, OP_MATCH);
+			emit(prog, item->nwords);
+			for (i = 0; i < item->nwords; i++) emit(prog, emitWord(prog, item->words[i]));
+			at = emit(prog, 0);
+			compileList(prog, item->body[0]);
+			emit(prog, OP_JMP);
+			end = emit(prog, end);
+			prog->code[at] = prog->ncode;
+		}
+		while (end >= 0) {
+			at = prog->code[end];
+			prog->code[end] = prog->ncode;
+			end = at;
+		}
+		emit(prog, OP_CASEEND);
+		break;
+	case N_FUNC:
+		emit(prog, OP_DEFUN);
+		emit(prog, emitStr(prog, node->name));
+		at = emit(prog, 0);
+		compileNode(prog, node->body[0]);
+		emit(prog, OP_END);
+		prog->code[at] = prog->ncode;
+		break;
+	}
+
+	if (skip >= 0) {
+		emit(prog, OP_UNREDIR);
+		prog->code[skip] = prog->ncode;
+	}
+}
+
+int emit(struct PROGRAM* prog, int value) {
+	int* code;
+
+	if (prog->ncode == prog->codesize) {
+		if (!(code = realloc(prog->code, sizeof(int) * (prog->codesize * 2 + 64)))) {
+			prog->error = 1;
+			return prog->ncode - 1;
+		}
+		prog->code = code;
+		prog->codesize = prog->codesize * 2 + 64;
+	}
+	prog->code[prog->ncode] = value;
+	return prog->ncode++;
+}
+
+int emitStr(struct PROGRAM* prog, const char* str) {
+	int len = strlen(str) + 1, offset;
+	char* strs;
+
+	if (prog->nstrs + len > prog->strsize) {
+		if (!(strs = realloc(prog->strs, prog->strsize * 2 + len + 256))) {
+			prog->error = 1;
+			return 0;
+		}
+		prog->strs = strs;
+		prog->strsize = prog->strsize * 2 + len + 256;
+	}
+	offset = prog->nstrs;
+	memcpy(prog->strs + offset, str, len);
+	prog->nstrs += len;
+	return offset;
+}
+
+void releaseProgram(struct PROGRAM* prog) {
+	if (!prog || --prog->refs > 0) return;
+	if (prog->map) munmap(prog->map, prog->maplen);
+	else {
+		free(prog->code);
+		free(prog->strs);
+		free(prog->expr);
+	}
+	free(prog);
+}
+
+////////////////////////////////////////
+//FUNCTION emitWord
+//FUNCTION emitExpr
+//FUNCTION compileArith
+//FUNCTION emitArith
+////////////////////////////////////////
+
+int emitWord(struct PROGRAM* prog, const char* word) {
+	const char* pchar;
+	char* out;
+	size_t len = 0;
+	int n = 0, offset;
+
+	for (pchar = word; *pchar; pchar++) {
+		if (*pchar == WC_ARITH) n++;
+	}
+	if (n == 0) return emitStr(prog, word);
+
+	if (!(out = malloc(strlen(word) + n * 16 + 1))) {
+		prog->error = 1;
+		return 0;
+	}
+
+	while (*word) {
+		if (*word == WC_ESC) {
+			out[len++] = *(word++);
+			out[len++] = *(word++);
+		}
+		else if (*word == WC_ARITH) {
+			out[len++] = *(word++);
+			out[len++] = *(word++);
+			pchar = strchr(word, WC_ENDVAR);
+			offset = compileArith(prog, word, pchar - word);
+			len += sprintf(out + len, "%d", offset);
+			word = pchar;
+		}
+		else out[len++] = *(word++);
+	}
+	out[len] = 0;
+
+	offset = emitStr(prog, out);
+	free(out);
+	return offset;
+}
+
+int emitExpr(struct PROGRAM* prog, intmax_t value) {
+	intmax_t* expr;
+
+	if (prog->nexpr == prog->exprsize) {
+		if (!(expr = realloc(prog->expr, sizeof(intmax_t) * (prog->exprsize * 2 + 32)))) {
+			prog->error = 1;
+			return prog->nexpr - 1;
+		}
+		prog->expr = expr;
+		prog->exprsize = prog->exprsize * 2 + 32;
+	}
+	prog->expr[prog->nexpr] = value;
+	return prog->nexpr++;
+}
+
+int compileArith(struct PROGRAM* prog, const char* text, int len) {
+	struct ARITH ax;
+	struct ANODE* tree;
+	int offset = prog->nexpr;
+
+	memset(&ax, 0, sizeof(ax));
+	if (!(ax.text = strndup(text, len))) {
+		prog->error = 1;
+		return 0;
+	}
+	ax.pchar = ax.text;
+
+	tree = parseArithComma(&ax);
+	arithSkip(&ax);
+	if (!ax.error && (!tree || *ax.pchar)) {
+		fprintf(stderr, "mysh: arithmetic syntax error: %s\n", *ax.pchar ? ax.pchar : ax.text);
+		ax.error = 2;
+	}
+
+	if (!ax.error && emitArith(prog, tree) > MAX_ARITHSTACK) {
+		fprintf(stderr, "mysh: arithmetic expression too complex: %s\n", ax.text);
+		ax.error = 2;
+	}
+	emitExpr(prog, AX_END);
+
+	if (ax.error && !prog->error) prog->error = ax.error;
+	freeArith(tree);
+	free(ax.text);
+	return offset;
+}
+
+int emitArith(struct PROGRAM* prog, struct ANODE* node) {
+	int depth, depth2, at, end;
+
+	switch (node->op) {
+	case AX_NUM:
+		emitExpr(prog, AX_NUM);
+		emitExpr(prog, node->value);
+		return 1;
+	case AX_VAR:
+		emitExpr(prog, node->op);
+		emitExpr(prog, emitStr(prog, node->name));
+		return 1;
+	case AX_ASSIGN:
+		depth = emitArith(prog, node->kid[0]);
+		emitExpr(prog, AX_ASSIGN);
+		emitExpr(prog, node->value);
+		emitExpr(prog, emitStr(prog, node->name));
+		return depth + 1;
+	case AX_PREINC:
+	case AX_POSTINC:
+		emitExpr(prog, node->op);
+		emitExpr(prog, node->value);
+		emitExpr(prog, emitStr(prog, node->name));
+		return 1;
+	case AX_AND:
+	case AX_OR:
+		depth = emitArith(prog, node->kid[0]);
+		emitExpr(prog, node->op == AX_AND ? AX_JZ : AX_JNZ);
+		at = emitExpr(prog, 0);
+		depth2 = emitArith(prog, node->kid[1]);
+		emitExpr(prog, AX_BOOL);
+		emitExpr(prog, AX_JMP);
+		end = emitExpr(prog, 0);
+		prog->expr[at] = prog->nexpr;
+		emitExpr(prog, AX_NUM);
+		emitExpr(prog, node->op == AX_OR);
+		prog->expr[end] = prog->nexpr;
+		return depth > depth2 ? depth : depth2;
+	case AX_COND:
+		depth = emitArith(prog, node->kid[0]);
+		emitExpr(prog, AX_JZ);
+		at = emitExpr(prog, 0);
+		depth2 = emitArith(prog, node->kid[1]);
+		if (depth2 > depth) depth = depth2;
+		emitExpr(prog, AX_JMP);
+		end = emitExpr(prog, 0);
+		prog->expr[at] = prog->nexpr;
+		depth2 = emitArith(prog, node->kid[2]);
+		prog->expr[end] = prog->nexpr;
+		return depth > depth2 ? depth : depth2;
+	case AX_COMMA:
+		depth = emitArith(prog, node->kid[0]);
+		emitExpr(prog, AX_POP);
+		depth2 = emitArith(prog, node->kid[1]);
+		return depth > depth2 ? depth : depth2;
+	}
+
+	depth = emitArith(prog, node->kid[0]);
+	if (node->kid[1]) {
+		depth2 = emitArith(prog, node->kid[1]) + 1;
+		if (depth2 > depth) depth = depth2;
+	}
+	emitExpr(prog, node->op);
+	return depth;
+}
+
+////////////////////////////////////////
+//FUNCTION parseArithComma
+//FUNCTION parseArithAssign
+//FUNCTION parseArithCond
+//FUNCTION parseArithBinary
+//FUNCTION parseArithUnary
+//FUNCTION parseArithPrimary
+//FUNCTION arithSkip
+//FUNCTION arithOperator
+//FUNCTION arithName
+//FUNCTION newArith
+//FUNCTION freeArith
+////////////////////////////////////////
+
+struct ANODE* parseArithComma(struct ARITH* ax) {
+	struct ANODE* node;
+
+	node = parseArithAssign(ax);
+	while (node && arithOperator(ax, ",", 1)) {
+		node = newArith(ax, AX_COMMA, node, parseArithAssign(ax), 0);
+	}
+	return node;
+}
+
+struct ANODE* parseArithAssign(struct ARITH* ax) {
+	static const char* ops[] = { "=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|=" };
+	static const int opcodes[] = { 0, AX_MUL, AX_DIV, AX_MOD, AX_ADD, AX_SUB, AX_SHL, AX_SHR, AX_BAND, AX_BXOR, AX_BOR };
+	const char* start;
+	struct ANODE* node;
+	char* name;
+	int i;
+
+	arithSkip(ax);
+	start = ax->pchar;
+	if ((name = arithName(ax))) {
+		arithSkip(ax);
+		for (i = 0; i < sizeof(ops) / sizeof(char*); i++) {
+			if (strncmp(ax->pchar, ops[i], strlen(ops[i])) == 0 && ax->pchar[strlen(ops[i])] != '=') break;
+		}
+		if (i < sizeof(ops) / sizeof(char*)) {
+			ax->pchar += strlen(ops[i]);
+			if (++ax->depth > MAX_ARITHSTACK) {
+				ax->error = 2;
+				fprintf(stderr, "mysh: arithmetic expression too complex: %s\n", ax->text);
+			}
+			if (!(node = newArith(ax, AX_ASSIGN, parseArithAssign(ax), 0, 0))) {
+				free(name);
+				return 0;
+			}
+			ax->depth--;
+			node->value = opcodes[i];
+			node->name = name;
+			return node;
+		}
+		free(name);
+		ax->pchar = start;
+	}
+
+	return parseArithCond(ax);
+}
+
+struct ANODE* parseArithCond(struct ARITH* ax) {
+	struct ANODE* node;
+	struct ANODE* first;
+
+	if (!(node = parseArithBinary(ax, 1)) || !arithOperator(ax, "?", 1)) return node;
+
+	first = parseArithComma(ax);
+	if (first && !arithOperator(ax, ":", 1)) {
+		freeArith(node);
+		freeArith(first);
+		if (!ax->error) fprintf(stderr, "mysh: arithmetic syntax error: expected ':'\n");
+		ax->error = 2;
+		return 0;
+	}
+	return newArith(ax, AX_COND, node, first, parseArithCond(ax));
+}
+
+struct ANODE* parseArithBinary(struct ARITH* ax, int minprec) {
+	static const char* ops[] = {
+		"||", "&&", "|", "^", "&", "==", "!=", "<=", ">=", "<<", ">>", "<", ">", "+", "-", "*", "/", "%"
+	};
+	static const int precs[] = { 1, 2, 3, 4, 5, 6, 6, 7, 7, 8, 8, 7, 7, 9, 9, 10, 10, 10 };
+	static const int opcodes[] = {
+		AX_OR, AX_AND, AX_BOR, AX_BXOR, AX_BAND, AX_EQ, AX_NE, AX_LE, AX_GE, AX_SHL, AX_SHR,
+		AX_LT, AX_GT, AX_ADD, AX_SUB, AX_MUL, AX_DIV, AX_MOD
+	};
+	struct ANODE* node;
+	int i, len;
+
+	if (!(node = parseArithUnary(ax))) return 0;
+
+	for (;;) {
+		arithSkip(ax);
+		for (i = 0; i < sizeof(ops) / sizeof(char*); i++) {
+			len = strlen(ops[i]);
+			if (strncmp(ax->pchar, ops[i], len) != 0) continue;
+			//a following '=' makes it an assignment operator, except for == != <= >=
+			if (ax->pchar[len] == '=' && ops[i][len - 1] != '=') continue;
+			if (len == 1 && ax->pchar[1] == ops[i][0] && strchr("|&<>", ops[i][0])) continue;
+			break;
+		}
+		if (i == sizeof(ops) / sizeof(char*) || precs[i] < minprec) return node;
+
+		ax->pchar += len;
+		node = newArith(ax, opcodes[i], node, parseArithBinary(ax, precs[i] + 1), 0);
+		if (!node) return 0;
+	}
+}
+
+struct ANODE* parseArithUnary(struct ARITH* ax) {
+	struct ANODE* node;
+	char* name;
+	int op;
+
+	if (++ax->depth > MAX_ARITHSTACK) {
+		if (!ax->error) fprintf(stderr, "mysh: arithmetic expression too complex: %s\n", ax->text);
+		ax->error = 2;
+		return 0;
+	}
+
+	arithSkip(ax);
+	if (strncmp(ax->pchar, "++", 2) == 0 || strncmp(ax->pchar, "--", 2) == 0) {
+		op = *ax->pchar == '+' ? 1 : -1;
+		ax->pchar += 2;
+		arithSkip(ax);
+		if (!(name = arithName(ax))) {
+			if (!ax->error) fprintf(stderr, "mysh: arithmetic syntax error: %s\n", ax->pchar);
+			ax->error = 2;
+			return 0;
+		}
+		if ((node = newArith(ax, AX_PREINC, 0, 0, 0))) {
+			node->value = op;
+			node->name = name;
+		}
+		else free(name);
+	}
+	else if (*ax->pchar && strchr("+-!~", *ax->pchar)) {
+		switch (*(ax->pchar++)) {
+		case '+': op = AX_POS; break;
+		case '-': op = AX_NEG; break;
+		case '!': op = AX_NOT; break;
+		default: op = AX_BNOT; break;
+		}
+		node = newArith(ax, op, parseArithUnary(ax), 0, 0);
+	}
+	else node = parseArithPrimary(ax);
+
+	ax->depth--;
+	return node;
+}
+
+struct ANODE* parseArithPrimary(struct ARITH* ax) {
+	struct ANODE* node;
+	char* name;
+	char* end;
+	intmax_t value;
+
+	arithSkip(ax);
+	if (*ax->pchar == '(') {
+		ax->pchar++;
+		node = parseArithComma(ax);
+		if (node && !arithOperator(ax, ")", 1)) {
+			freeArith(node);
+			if (!ax->error) fprintf(stderr, "mysh: arithmetic syntax error: missing ')'\n");
+			ax->error = 2;
+			return 0;
+		}
+		return node;
+	}
+
+	if (isdigit((unsigned char)*ax->pchar)) {
+		errno = 0;
+		value = strtoimax(ax->pchar, &end, 0);
+		if (errno || isalnum((unsigned char)*end) || *end == '_') {
+			if (!ax->error) fprintf(stderr, "mysh: arithmetic: bad number: %s\n", ax->pchar);
+			ax->error = 2;
+			return 0;
+		}
+		ax->pchar = end;
+		if ((node = newArith(ax, AX_NUM, 0, 0, 0))) node->value = value;
+		return node;
+	}
+
+	if (*ax->pchar == '$') {
+		ax->pchar++;
+		if (*ax->pchar == '{') {
+			ax->pchar++;
+			if (!(name = arithName(ax)) && isdigit((unsigned char)*ax->pchar)) {
+				value = strspn(ax->pchar, "0123456789");
+				name = strndup(ax->pchar, value);
+				ax->pchar += value;
+			}
+			if (name && *ax->pchar != '}') {
+				free(name);
+				name = 0;
+			}
+			ax->pchar++;
+		}
+		else if (*ax->pchar && strchr("?#$!0123456789", *ax->pchar)) name = strndup(ax->pchar++, 1);
+		else name = arithName(ax);
+
+		if (!name) {
+			if (!ax->error) fprintf(stderr, "mysh: arithmetic syntax error: %s\n", ax->text);
+			ax->error = 2;
+			return 0;
+		}
+		if (!(node = newArith(ax, AX_VAR, 0, 0, 0))) free(name);
+		else node->name = name;
+		return node;
+	}
+
+	if ((name = arithName(ax))) {
+		arithSkip(ax);
+		if (strncmp(ax->pchar, "++", 2) == 0 || strncmp(ax->pchar, "--", 2) == 0) {
+			if ((node = newArith(ax, AX_POSTINC, 0, 0, 0))) node->value = *ax->pchar == '+' ? 1 : -1;
+			ax->pchar += 2;
+		}
+		else node = newArith(ax, AX_VAR, 0, 0, 0);
+
+		if (node) node->name = name;
+		else free(name);
+		return node;
+	}
+
+	if (!ax->error) fprintf(stderr, "mysh: arithmetic syntax error: %s\n", *ax->pchar ? ax->pchar : ax->text);
+	ax->error = 2;
+	return 0;
+}
+
+void arithSkip(struct ARITH* ax) {
+	while (*ax->pchar == ' ' || *ax->pchar == '\t' || *ax->pchar == '\n') ax->pchar++;
+}
+
+int arithOperator(struct ARITH* ax, const char* op, int len) {
+	arithSkip(ax);
+	if (strncmp(ax->pchar, op, len) != 0) return 0;
+	ax->pchar += len;
+	return 1;
+}
+
+char* arithName(struct ARITH* ax) {
+	const char* start = ax->pchar;
+	char* name;
+
+	if (!isalpha((unsigned char)*start) && *start != '_') return 0;
+	while (isalnum((unsigned char)*ax->pchar) || *ax->pchar == '_') ax->pchar++;
+
+	if (!(name = strndup(start, ax->pchar - start))) {
+		perror("mysh: arithName()");
+		ax->error = 1;
+	}
+	return name;
+}
+
+struct ANODE* newArith(struct ARITH* ax, int op, struct ANODE* a, struct ANODE* b, struct ANODE* c) {
+	struct ANODE* node;
+	intmax_t value;
+
+	if (ax->error || !a != (op == AX_NUM || op == AX_VAR || op == AX_PREINC || op == AX_POSTINC) ||
+		(op >= AX_MUL && op <= AX_COMMA && !b) || (op == AX_COND && !c)) {
+		freeArith(a);
+		freeArith(b);
+		freeArith(c);
+		if (!ax->error) {
+			fprintf(stderr, "mysh: arithmetic syntax error: %s\n", *ax->pchar ? ax->pchar : ax->text);
+			ax->error = 2;
+		}
+		return 0;
+	}
+
+	//fold constant subexpressions
+	if (a && a->op == AX_NUM) {
+		node = 0;
+		if (op == AX_COND) {
+			node = a->value ? b : c;
+			freeArith(a->value ? c : b);
+		}
+		else if ((op == AX_AND && !a->value) || (op == AX_OR && a->value)) {
+			a->value = op == AX_OR;
+			freeArith(b);
+			return a;
+		}
+		else if ((op == AX_AND || op == AX_OR) && b->op == AX_NUM) {
+			a->value = b->value != 0;
+			freeArith(b);
+			return a;
+		}
+		else if (op >= AX_POS && op <= AX_BNOT) {
+			a->value = arithUnary(op, a->value);
+			return a;
+		}
+		else if (op >= AX_MUL && op <= AX_BOR && b->op == AX_NUM && arithBinary(op, a->value, b->value, &value) == 0) {
+			a->value = value;
+			freeArith(b);
+			return a;
+		}
+		if (node) {
+			freeArith(a);
+			return node;
+		}
+	}
+
+	if (!(node = calloc(1, sizeof(struct ANODE)))) {
+		perror("mysh: newArith()");
+		ax->error = 1;
+		freeArith(a);
+		freeArith(b);
+		freeArith(c);
+		return 0;
+	}
+	node->op = op;
+	node->kid[0] = a;
+	node->kid[1] = b;
+	node->kid[2] = c;
+	return node;
+}
+
+void freeArith(struct ANODE* node) {
+	if (!node) return;
+	freeArith(node->kid[0]);
+	freeArith(node->kid[1]);
+	freeArith(node->kid[2]);
+	free(node->name);
+	free(node);
+}
+
+////////////////////////////////////////
+//FUNCTION evalArith
+//FUNCTION arithUnary
+//FUNCTION arithBinary
+//FUNCTION arithValue
+////////////////////////////////////////
+
+int evalArith(struct PROGRAM* prog, int pc, intmax_t* presult) {
+	intmax_t stack[MAX_ARITHSTACK + 1];
+	intmax_t* expr = prog->expr;
+	char number[24];
+	char* name;
+	int sp = 0;
+
+	for (;;) {
+		switch (expr[pc]) {
+		case AX_END:
+			*presult = sp > 0 ? stack[sp - 1] : 0;
+			return 0;
+		case AX_NUM:
+			stack[sp++] = expr[pc + 1];
+			pc += 2;
+			break;
+		case AX_VAR:
+			name = prog->strs + expr[pc + 1];
+			if (arithValue(lookupParam(name, strlen(name), number), &stack[sp++]) < 0) return -1;
+			pc += 2;
+			break;
+		case AX_ASSIGN:
+			name = prog->strs + expr[pc + 2];
+			if (expr[pc + 1]) {
+				if (arithValue(getVar(name, strlen(name)), &stack[sp]) < 0) return -1;
+				if (arithBinary(expr[pc + 1], stack[sp], stack[sp - 1], &stack[sp - 1]) < 0) goto divzero;
+			}
+			sprintf(number, "%jd", stack[sp - 1]);
+			if (setVar(name, number) < 0) return -1;
+			pc += 3;
+			break;
+		case AX_PREINC:
+		case AX_POSTINC:
+			name = prog->strs + expr[pc + 2];
+			if (arithValue(getVar(name, strlen(name)), &stack[sp]) < 0) return -1;
+			sprintf(number, "%jd", (intmax_t)((uintmax_t)stack[sp] + expr[pc + 1]));
+			if (setVar(name, number) < 0) return -1;
+			if (expr[pc] == AX_PREINC) stack[sp] = (uintmax_t)stack[sp] + expr[pc + 1];
+			sp++;
+			pc += 3;
+			break;
+		case AX_JZ:
+			pc = stack[--sp] == 0 ? expr[pc + 1] : pc + 2;
+			break;
+		case AX_JNZ:
+			pc = stack[--sp] != 0 ? expr[pc + 1] : pc + 2;
+			break;
+		case AX_JMP:
+			pc = expr[pc + 1];
+			break;
+		case AX_BOOL:
+			stack[sp - 1] = stack[sp - 1] != 0;
+			pc++;
+			break;
+		case AX_POP:
+			sp--;
+			pc++;
+			break;
+		default:
+			if (expr[pc] >= AX_POS && expr[pc] <= AX_BNOT) stack[sp - 1] = arithUnary(expr[pc], stack[sp - 1]);
+			else {
+				sp--;
+				if (arithBinary(expr[pc], stack[sp - 1], stack[sp], &stack[sp - 1]) < 0) goto divzero;
+			}
+			pc++;
+			break;
+		}
+	}
+
+divzero:
+	fprintf(stderr, "mysh: arithmetic: division by zero\n");
+	return -1;
+}
+
+intmax_t arithUnary(int op, intmax_t a) {
+	switch (op) {
+	case AX_NEG: return -(uintmax_t)a;
+	case AX_NOT: return !a;
+	case AX_BNOT: return ~a;
+	}
+	return a;
+}
+
+int arithBinary(int op, intmax_t a, intmax_t b, intmax_t* presult) {
+	switch (op) {
+	case AX_MUL: *presult = (uintmax_t)a * b; break;
+	case AX_DIV:
+	case AX_MOD:
+		if (b == 0) return -1;
+		if (b == -1) *presult = op == AX_DIV ? -(uintmax_t)a : 0;
+		else *presult = op == AX_DIV ? a / b : a % b;
+		break;
+	case AX_ADD: *presult = (uintmax_t)a + b; break;
+	case AX_SUB: *presult = (uintmax_t)a - b; break;
+	case AX_SHL: *presult = (uintmax_t)a << (b & 63); break;
+	case AX_SHR: *presult = a >> (b & 63); break;
+	case AX_LT: *presult = a < b; break;
+	case AX_GT: *presult = a > b; break;
+	case AX_LE: *presult = a <= b; break;
+	case AX_GE: *presult = a >= b; break;
+	case AX_EQ: *presult = a == b; break;
+	case AX_NE: *presult = a != b; break;
+	case AX_BAND: *presult = a & b; break;
+	case AX_BXOR: *presult = a ^ b; break;
+	case AX_BOR: *presult = a | b; break;
+	default: return -1;
+	}
+	return 0;
+}
+
+int arithValue(const char* value, intmax_t* presult) {
+	char* end;
+
+	if (!value) value = "";
+	while (*value == ' ' || *value == '\t' || *value == '\n') value++;
+	if (*value == 0) {
+		*presult = 0;
+		return 0;
+	}
+
+	errno = 0;
+	*presult = strtoimax(value, &end, 0);
+	while (*end == ' ' || *end == '\t' || *end == '\n') end++;
+	if (errno || *end) {
+		fprintf(stderr, "mysh: arithmetic: bad number: %s\n", value);
+		return -1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+//FUNCTION vmRun
+//FUNCTION vmUnwind
+//FUNCTION pushFrame
+//FUNCTION popFrame
+////////////////////////////////////////
+
+int vmRun(struct PROGRAM* prog, int pc) {
+	int* code = prog->code;
+	char* subject;
+	char* pattern;
+	struct PROGRAM* outerProg = vmProg;
+	int i, n, base = nFrames, outer = vmBase;
+	pid_t child;
+
+	vmBase = base;
+	vmProg = prog;
+
+	for (;;) {
+		switch (code[pc]) {
+		case OP_END:
+			goto vm_end;
+		case OP_EXIT:
+			fflush(stdout);
+			_exit(lastStatus);
+		case OP_SIMPLE:
+			n = 4 + code[pc + 1] + code[pc + 2] + 3 * code[pc + 3];
+			lastStatus = runSimple(prog, pc, vmForked && code[pc + n] == OP_EXIT);
+			pc += n;
+			if (vmReturn) goto vm_end;
+			if (vmBreak || vmContinue) pc = vmUnwind(pc);
+			break;
+		case OP_JMP:
+			pc = code[pc + 1];
+			break;
+		case OP_JZ:
+			pc = lastStatus == 0 ? code[pc + 1] : pc + 2;
+			break;
+		case OP_JNZ:
+			pc = lastStatus != 0 ? code[pc + 1] : pc + 2;
+			break;
+		case OP_NOT:
+			lastStatus = !lastStatus;
+			pc++;
+			break;
+		case OP_STATUS:
+			lastStatus = code[pc + 1];
+			pc += 2;
+			break;
+		case OP_PIPE:
+			rcPure = 0;
+			lastStatus = runPipeline(prog, pc);
+			pc = code[pc + 2 + code[pc + 1]];
+			break;
+		case OP_BG:
+			rcPure = 0;
+			fflush(stdout);
+			if ((child = fork()) == 0) {
+				vmBackground = 1;
+				termRaw = 0;
+				if (applyLimits(&bgLimits) < 0) _exit(126);
+				if ((i = open("/dev/null", O_RDONLY)) >= 0 && i != 0) {
+					dup2(i, 0);
+					close(i);
+				}
+				runChild(prog, pc + 2);
+			}
+			else if (child < 0) {
+				perror("mysh: fork()");
+				lastStatus = 1;
+			}
+			else {
+				lastBgPid = child;
+				lastStatus = 0;
+				if (myshOntty && !vmForked) addJob(child);
+			}
+			pc = code[pc + 1];
+			break;
+		case OP_SUBSHELL:
+			rcPure = 0;
+			if (termRaw) resetTerm();
+			fflush(stdout);
+			if ((child = fork()) == 0) runChild(prog, pc + 2);
+			else if (child < 0) {
+				perror("mysh: fork()");
+				lastStatus = 1;
+			}
+			else lastStatus = waitChild(child);
+			pc = code[pc + 1];
+			break;
+		case OP_REDIR:
+			rcPure = 0;
+			fflush(stdout);
+			i = pushFrame(FR_REDIR);
+			if (i < 0 || applyRedirs(prog, code + pc + 3, code[pc + 2], i) < 0) {
+				if (i >= 0) popFrame();
+				lastStatus = 1;
+				pc = code[pc + 1];
+			}
+			else pc += 3 + 3 * code[pc + 2];
+			break;
+		case OP_UNREDIR:
+			popFrame();
+			pc++;
+			break;
+		case OP_LOOP:
+			if ((i = pushFrame(FR_LOOP)) < 0) goto vm_end;
+			frames[i].brk = code[pc + 1];
+			pc += 2;
+			frames[i].cont = pc;
+			break;
+		case OP_FOR:
+			if ((i = pushFrame(FR_LOOP)) < 0) goto vm_end;
+			n = code[pc + 2];
+			frames[i].var = prog->strs + code[pc + 1];
+			if (expandList(prog, code + pc + 3, n, i) < 0) lastStatus = 1;
+			if (n < 0) n = 0;
+			frames[i].brk = code[pc + 3 + n];
+			pc += 4 + n;
+			frames[i].cont = pc;
+			break;
+		case OP_FORNEXT:
+			i = nFrames - 1;
+			if (frames[i].item < frames[i].nitems) {
+				setVar(frames[i].var, frames[i].items[frames[i].item++]);
+				pc += 2;
+			}
+			else pc = code[pc + 1];
+			break;
+		case OP_LOOPSAVE:
+			frames[nFrames - 1].saved = lastStatus;
+			pc++;
+			break;
+		case OP_LOOPEND:
+			lastStatus = frames[nFrames - 1].saved;
+			popFrame();
+			pc++;
+			break;
+		case OP_CASE:
+			if ((i = pushFrame(FR_CASE)) < 0) goto vm_end;
+			frames[i].subject = expandString(prog->strs + code[pc + 1]);
+			lastStatus = 0;
+			pc += 2;
+			break;
+		case OP_MATCH:
+			n = code[pc + 1];
+			subject = frames[nFrames - 1].subject;
+			for (i = 0; subject && i < n; i++) {
+				if (!(pattern = expandPattern(prog->strs + code[pc + 2 + i]))) continue;
+				if (fnmatch(pattern, subject, 0) == 0) n = -1;
+			}
+			if (n < 0) pc += 3 + code[pc + 1];
+			else pc = code[pc + 2 + n];
+			break;
+		case OP_CASEEND:
+			popFrame();
+			pc++;
+			break;
+		case OP_DEFUN:
+			defineFunction(prog->strs + code[pc + 1], prog, pc + 3);
+			lastStatus = 0;
+			pc = code[pc + 2];
+			break;
+		default:
+			fprintf(stderr, "mysh: vmRun(): invalid instruction %d\n", code[pc]);
+			lastStatus = 2;
+			goto vm_end;
+		}
+	}
+
+vm_end:
+	while (nFrames > base) popFrame();
+	vmBase = outer;
+	vmProg = outerProg;
+	return lastStatus;
+}
+
+int vmUnwind(int pc) {
+	int i, target = -1, n = vmBreak ? vmBreak : vmContinue;
+
+	for (i = nFrames - 1; i >= vmBase && n > 0; i--) {
+		if (frames[i].type == FR_LOOP) {
+			target = i;
+			n--;
+		}
+	}
+
+	if (target >= 0) {
+		while (nFrames > target + 1) popFrame();
+		if (vmBreak) {
+			pc = frames[target].brk;
+			popFrame();
+			lastStatus = 0;
+		}
+		else pc = frames[target].cont;
+	}
+
+	vmBreak = vmContinue = 0;
+	return pc;
+}
+
+int pushFrame(int type) {
+	struct FRAME* pframe;
+
+	if (nFrames == sizeFrames) {
+		if (!(pframe = realloc(frames, sizeof(struct FRAME) * (sizeFrames * 2 + 16)))) {
+			perror("mysh: pushFrame()");
+			return -1;
+		}
+		frames = pframe;
+		sizeFrames = sizeFrames * 2 + 16;
+	}
+
+	memset(&frames[nFrames], 0, sizeof(struct FRAME));
+	frames[nFrames].type = type;
+	arenaMark(&frames[nFrames].mark);
+	return nFrames++;
+}
+
+void popFrame(void) {
+	struct FRAME* frame = &frames[--nFrames];
+	int i;
+
+	if (frame->type == FR_REDIR) {
+		fflush(stdout);
+		for (i = frame->nfds - 2; i >= 0; i -= 2) {
+			if (frame->fds[i + 1] >= 0) {
+				dup2(frame->fds[i + 1], frame->fds[i]);
+				close(frame->fds[i + 1]);
+			}
+			else close(frame->fds[i]);
+		}
+		for (i = 0; i < frame->nfanouts; i++) waitChild(frame->fanouts[i]);
+	}
+
+	arenaRelease(&frame->mark);
+}
+
+////////////////////////////////////////
+//FUNCTION runSimple
+//FUNCTION runPipeline
+//FUNCTION runChild
+//FUNCTION runCommand
+//FUNCTION execCommand
+//FUNCTION exportAssigns
+//FUNCTION runBatches
+//FUNCTION argvSize
+//FUNCTION waitChild
+//FUNCTION applyRedirs
+//FUNCTION countOutputs
+//FUNCTION startFanout
+//FUNCTION runFanout
+//FUNCTION moveFanout
+//FUNCTION openHeredoc
+//FUNCTION putHeredoc
+//FUNCTION writeHeredoc
+//FUNCTION expandList
+////////////////////////////////////////
+
+int runSimple(struct PROGRAM* prog, int pc, int last) {
+	struct ARENAMARK mark;
+	struct ARGV av;
+	char** saved = 0;
+	char* value;
+	char* expanded;
+	int* code = prog->code;
+	int nwords = code[pc + 1], nassigns = code[pc + 2], nredirs = code[pc + 3];
+	int* assigns = code + pc + 4 + nwords;
+	int* redirs = assigns + nassigns;
+	int i, nargs, index = -1, frame = -1, ret = 0, procs = nProcSubsts;
+	struct FUNCTION* func = 0;
+
+	arenaMark(&mark);
+	nExecuted++;
+	nargs = expandArgs(prog, code + pc + 4, nwords, &av);
+	if (nargs < 0) {
+		ret = 1;
+		goto done;
+	}
+
+	if (nargs > 0 && !(func = findFunction(av.argv[0]))) index = checkInternal(av.argv[0]);
+	if (nredirs > 0 || (nargs > 0 && !func && (index < 0 || !(commands[index].flags & CF_STATE)))) rcPure = 0;
+
+	if (nargs == 0) {
+		for (i = 0; i < nassigns && ret == 0; i++) {
+			value = strchr(prog->strs + assigns[i], '=');
+			*value = 0;
+			if (!(expanded = expandString(value + 1)) || setVar(prog->strs + assigns[i], expanded) < 0) ret = 1;
+			*value = '=';
+		}
+		if (ret == 0 && nredirs > 0) {
+			fflush(stdout);
+			if ((frame = pushFrame(FR_REDIR)) < 0) ret = 1;
+			else {
+				if (applyRedirs(prog, redirs, nredirs, frame) < 0) ret = 1;
+				popFrame();
+			}
+		}
+		goto done;
+	}
+
+	if (!func && index == -1) {
+		if (termRaw && resetTerm() < 0) {
+			perror("mysh: resetTerm()");
+			exitShell(1);
+		}
+		if ((ret = runBatches(prog, pc, &av)) >= 0) goto done;
+		if (last) execCommand(prog, pc, av.argv);
+
+		ret = externalCommands(nargs, av.argv, prog, pc);
+		if (ret < 0) {
+			perror("mysh: externalCommands()");
+			ret = 1;
+		}
+		goto done;
+	}
+
+	if (nassigns > 0 && !(saved = arenaAlloc(sizeof(char*) * nassigns))) {
+		perror("mysh: runSimple()");
+		ret = 1;
+		goto done;
+	}
+	for (i = 0; i < nassigns; i++) {
+		value = strchr(prog->strs + assigns[i], '=');
+		*value = 0;
+		saved[i] = getVar(prog->strs + assigns[i], value - (prog->strs + assigns[i]));
+		if (saved[i]) saved[i] = arenaStrndup(saved[i], strlen(saved[i]));
+		if ((expanded = expandString(value + 1))) setVar(prog->strs + assigns[i], expanded);
+		*value = '=';
+	}
+
+	if (nredirs > 0) {
+		fflush(stdout);
+		if ((frame = pushFrame(FR_REDIR)) < 0 || applyRedirs(prog, redirs, nredirs, frame) < 0) ret = -2;
+	}
+
+	if (ret == 0) {
+		if (func) ret = callFunction(func, nargs, av.argv);
+		else {
+			if (termRaw && (commands[index].flags & CF_TTY) && resetTerm() < 0) {
+				perror("mysh: resetTerm()");
+				exitShell(1);
+			}
+			ret = internalCommands(index, nargs, av.argv);
+			if (ret < 0) {
+				perror("mysh: internalCommands()");
+				ret = 1;
+			}
+		}
+	}
+	else ret = 1;
+
+	if (frame >= 0) {
+		if (index >= 0 && commands[index].func == mysh_exec) {
+			for (i = 1; i < frames[frame].nfds; i += 2) {
+				if (frames[frame].fds[i] >= 0) close(frames[frame].fds[i]);
+			}
+			frames[frame].nfds = 0;
+			frames[frame].nfanouts = 0;
+		}
+		popFrame();
+	}
+
+	for (i = 0; i < nassigns; i++) {
+		value = strchr(prog->strs + assigns[i], '=');
+		*value = 0;
+		if (saved[i]) setVar(prog->strs + assigns[i], saved[i]);
+		else unsetVar(prog->strs + assigns[i]);
+		*value = '=';
+	}
+
+done:
+	if (nProcSubsts > 0) closeProcesses(procs);
+	arenaRelease(&mark);
+	return ret;
+}
+
+int runPipeline(struct PROGRAM* prog, int pc) {
+	int n = prog->code[pc + 1], i, fds[2], prev = -1, ret = 0;
+	pid_t* pids;
+
+	if (!(pids = malloc(sizeof(pid_t) * n))) {
+		perror("mysh: runPipeline()");
+		return 1;
+	}
+
+	if (termRaw) resetTerm();
+	fflush(stdout);
+
+	for (i = 0; i < n; i++) {
+		if (i < n - 1 && pipe(fds) < 0) {
+			perror("mysh: pipe()");
+			ret = 1;
+			break;
+		}
+
+		if ((pids[i] = fork()) == 0) {
+			if (prev != -1) {
+				dup2(prev, 0);
+				close(prev);
+			}
+			if (i < n - 1) {
+				close(fds[0]);
+				dup2(fds[1], 1);
+				close(fds[1]);
+				n = prog->code[prog->code[pc + 2 + i]];
+				vmPipeOut = n == OP_SIMPLE || n == OP_REDIR;
+			}
+			runChild(prog, prog->code[pc + 2 + i]);
+		}
+		else if (pids[i] < 0) {
+			perror("mysh: fork()");
+			if (i < n - 1) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			ret = 1;
+			break;
+		}
+
+		if (prev != -1) close(prev);
+		if (i < n - 1) {
+			close(fds[1]);
+			prev = fds[0];
+		}
+	}
+	if (prev != -1 && i < n) close(prev);
+
+	n = i;
+	for (i = 0; i < n; i++) ret = waitChild(pids[i]);
+	free(pids);
+
+	return ret;
+}
+
+void runChild(struct PROGRAM* prog, int pc) {
+	vmForked = 1;
+	vmBase = nFrames;
+	if (myshOntty && !vmBackground) resetSignal();
+
+	lastStatus = vmRun(prog, pc);
+	fflush(stdout);
+	_exit(lastStatus);
+}
+
+void runCommand(int argc, char* argv[]) {
+	struct FUNCTION* func;
+	int index, ret;
+
+	vmForked = 1;
+	if ((func = findFunction(argv[0]))) ret = callFunction(func, argc, argv);
+	else if ((index = checkInternal(argv[0])) >= 0) ret = internalCommands(index, argc, argv);
+	else execCommand(0, 0, argv);
+
+	fflush(stdout);
+	_exit(ret < 0 ? 1 : ret);
+}
+
+void execCommand(struct PROGRAM* prog, int pc, char* command_args[]) {
+	char* errstr;
+	int* code;
+
+	if (prog) {
+		code = prog->code + pc;
+		exportAssigns(prog, pc);
+		if (applyRedirs(prog, code + 4 + code[1] + code[2], code[3], -1) < 0) _exit(1);
+	}
+	if (myshOntty && !vmBackground) resetSignal();
+	if (loopFd >= 0) sigprocmask(SIG_SETMASK, &loopMask, 0);
+
+	execvp(command_args[0], command_args);
+	errstr = strerror(errno);
+	fprintf(stderr, "mysh: %s: %s\n", command_args[0], errstr);
+	_exit(errno == ENOENT ? 127 : 126);
+}
+
+void exportAssigns(struct PROGRAM* prog, int pc) {
+	int* code = prog->code + pc;
+	char* value;
+	char* expanded;
+	int i;
+
+	for (i = 0; i < code[2]; i++) {
+		value = strchr(prog->strs + code[4 + code[1] + i], '=');
+		*value = 0;
+		if ((expanded = expandString(value + 1))) setenv(prog->strs + code[4 + code[1] + i], expanded, 1);
+		*value = '=';
+	}
+}
+
+int runBatches(struct PROGRAM* prog, int pc, struct ARGV* av) {
+	extern char** environ;
+	char** argv;
+	char* mode = getVar("MYSH_ARGBATCH", 13);
+	size_t limit, fixed, size;
+	int* code = prog->code + pc;
+	int i, n, next, end, frame = -1, ret = 0;
+	pid_t child;
+
+	if (!mode || !*mode || av->nbatch < 2) return -1;
+
+	for (n = 0; environ[n]; n++);
+	limit = sysconf(_SC_ARG_MAX) - argvSize(environ, n) - 4096;
+	if (argvSize(av->argv, av->argc) <= limit) return -1;
+
+	end = av->batch + av->nbatch;
+	fixed = argvSize(av->argv, av->argc) - argvSize(av->argv + av->batch, av->nbatch);
+	if (fixed >= limit || !(argv = malloc(sizeof(char*) * (av->argc + 1)))) {
+		fprintf(stderr, "mysh: %s: argument list too long\n", av->argv[0]);
+		return 126;
+	}
+	memcpy(argv, av->argv, sizeof(char*) * av->batch);
+
+	fflush(stdout);
+	if (code[3] > 0) {
+		if ((frame = pushFrame(FR_REDIR)) < 0 || applyRedirs(prog, code + 4 + code[1] + code[2], code[3], frame) < 0) {
+			if (frame >= 0) popFrame();
+			free(argv);
+			return 1;
+		}
+	}
+
+	for (next = av->batch; next < end;) {
+		n = av->batch;
+		for (size = fixed; next < end && size + argvSize(av->argv + next, 1) <= limit; next++) {
+			size += argvSize(av->argv + next, 1);
+			argv[n++] = av->argv[next];
+		}
+		if (n == av->batch) {
+			fprintf(stderr, "mysh: %s: argument too long\n", av->argv[0]);
+			ret = 126;
+			break;
+		}
+		for (i = end; i < av->argc; i++) argv[n++] = av->argv[i];
+		argv[n] = 0;
+
+		if ((child = fork()) == 0) {
+			exportAssigns(prog, pc);
+			execCommand(0, 0, argv);
+		}
+		else if (child < 0) {
+			perror("mysh: fork()");
+			ret = 1;
+			break;
+		}
+		if ((i = waitChild(child)) != 0) ret = i;
+	}
+
+	if (frame >= 0) popFrame();
+	free(argv);
+	return ret;
+}
+
+size_t argvSize(char** argv, int argc) {
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < argc; i++) size += strlen(argv[i]) + 1 + sizeof(char*);
+	return size;
+}
+
+int waitChild(pid_t child) {
+	int stat;
+
+	while (waitpid(child, &stat, 0) < 0) {
+		if (errno != EINTR) return 1;
+	}
+	if (WIFSIGNALED(stat)) return 128 + WTERMSIG(stat);
+	return WEXITSTATUS(stat);
+}
+
+int applyRedirs(struct PROGRAM* prog, int* redirs, int nredirs, int frame) {
+	int targets[MAX_REDIRS + 1];
+	int owners[MAX_REDIRS + 1];
+	int fanned[MAX_REDIRS + 1];
+	int* first = redirs;
+	char* target;
+	char* errstr;
+	char* end;
+	int i, j, k, n = 0, fd, newfd = -1, flags, outputs, piped = vmPipeOut, ntargets = 0, procs = nProcSubsts;
+
+	vmPipeOut = 0;
+
+	for (i = 0; i < nredirs; i++, redirs += 3) {
+		fd = redirs[1];
+		if (redirs[0] == R_HEREDOC) target = prog->strs + redirs[2];
+		else if (!(target = expandString(prog->strs + redirs[2]))) goto error;
+
+		if (frame >= 0) {
+			if (frames[frame].nfds >= MAX_REDIRS * 2) {
+				fprintf(stderr, "mysh: too many redirections\n");
+				goto error;
+			}
+			frames[frame].fds[frames[frame].nfds++] = fd;
+			frames[frame].fds[frames[frame].nfds++] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+		}
+
+		outputs = 0;
+		if (redirs[0] == R_OUT || redirs[0] == R_APPEND || (redirs[0] == R_DUPOUT && strcmp(target, "-") != 0)) {
+			outputs = countOutputs(prog, first, nredirs, fd) + (piped && fd == 1);
+		}
+		if (outputs > 1) {
+			for (n = 0, j = 0; j < ntargets; j++) n += owners[j] == fd;
+			if (n == 0 && piped && fd == 1) {
+				owners[ntargets] = fd;
+				if ((targets[ntargets++] = fcntl(fd, F_DUPFD_CLOEXEC, 10)) < 0) goto syscall_error;
+				n++;
+			}
+		}
+
+		if (redirs[0] == R_DUPIN || redirs[0] == R_DUPOUT) {
+			if (strcmp(target, "-") == 0) close(fd);
+			else {
+				newfd = strtol(target, &end, 10);
+				if (end == target || *end || (outputs > 1 && (newfd = fcntl(newfd, F_DUPFD_CLOEXEC, 10)) < 0) || (outputs < 2 && newfd != fd && dup2(newfd, fd) < 0)) {
+					fprintf(stderr, "mysh: %s: bad file descriptor\n", target);
+					goto error;
+				}
+			}
+		}
+		else if (redirs[0] == R_HEREDOC || redirs[0] == R_HERESTR) {
+			if ((newfd = openHeredoc(redirs[0], target)) < 0) goto error;
+			if (newfd != fd) {
+				dup2(newfd, fd);
+				close(newfd);
+			}
+		}
+		else {
+			switch (redirs[0]) {
+			case R_IN: flags = O_RDONLY; break;
+			case R_OUT: flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+			case R_APPEND: flags = O_WRONLY | O_CREAT | O_APPEND; break;
+			default: flags = O_RDWR | O_CREAT; break;
+			}
+			if (outputs > 1) flags |= O_CLOEXEC;
+			if ((newfd = open(target, flags, 0666)) < 0) {
+				errstr = strerror(errno);
+				fprintf(stderr, "mysh: %s: %s\n", target, errstr);
+				goto error;
+			}
+			if (outputs < 2 && newfd != fd) {
+				dup2(newfd, fd);
+				close(newfd);
+			}
+		}
+
+		if (outputs > 1) {
+			owners[ntargets] = fd;
+			targets[ntargets++] = newfd;
+			if (++n < outputs) continue;
+
+			for (n = 0, k = 0, j = 0; j < ntargets; j++) {
+				if (owners[j] == fd) fanned[n++] = targets[j];
+				else {
+					owners[k] = owners[j];
+					targets[k++] = targets[j];
+				}
+			}
+			ntargets = k;
+			if (startFanout(fd, fanned, n, frame) < 0) goto error;
+		}
+	}
+
+	if (nProcSubsts > procs) closeProcesses(procs);
+	return 0;
+
+syscall_error:
+	perror("mysh: applyRedirs()");
+error:
+	for (j = 0; j < ntargets; j++) close(targets[j]);
+	if (nProcSubsts > procs) closeProcesses(procs);
+	return -1;
+}
+
+int countOutputs(struct PROGRAM* prog, int* redirs, int nredirs, int fd) {
+	int i, n = 0;
+
+	for (i = 0; i < nredirs; i++, redirs += 3) {
+		if (redirs[1] != fd) continue;
+		if (redirs[0] == R_OUT || redirs[0] == R_APPEND) n++;
+		else if (redirs[0] == R_DUPOUT && strcmp(prog->strs + redirs[2], "-") != 0) n++;
+	}
+	return n;
+}
+
+int startFanout(int fd, int* targets, int ntargets, int frame) {
+	int src[2], i;
+	pid_t child;
+
+	if (frame >= 0 && frames[frame].nfanouts >= MAX_REDIRS) {
+		fprintf(stderr, "mysh: too many redirections\n");
+		goto error;
+	}
+	if (pipe2(src, O_CLOEXEC) < 0) goto syscall_error;
+	fcntl(src[0], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+
+	fflush(stdout);
+	if ((child = fork()) < 0) {
+		close(src[0]);
+		close(src[1]);
+		goto syscall_error;
+	}
+
+	if ((child == 0) == (frame >= 0)) {
+		close(src[1]);
+		signal(SIGPIPE, SIG_IGN);
+		runFanout(src[0], targets, ntargets);
+		if (child == 0) _exit(0);
+		_exit(waitChild(child));
+	}
+
+	close(src[0]);
+	for (i = 0; i < ntargets; i++) close(targets[i]);
+	if (frame >= 0) frames[frame].fanouts[frames[frame].nfanouts++] = child;
+	dup2(src[1], fd);
+	close(src[1]);
+	return 0;
+
+syscall_error:
+	perror("mysh: startFanout()");
+error:
+	for (i = 0; i < ntargets; i++) close(targets[i]);
+	return -1;
+}
+
+void runFanout(int src, int* targets, int ntargets) {
+	int pipes[MAX_REDIRS + 1][2];
+	int i, last, nullfd;
+	ssize_t n, got;
+	size_t size, len;
+
+	size = fcntl(src, F_GETPIPE_SZ);
+	nullfd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	for (i = 0; i < ntargets; i++) {
+		if (pipe2(pipes[i], O_CLOEXEC) < 0) goto syscall_error;
+		fcntl(pipes[i][0], F_SETPIPE_SZ, size);
+	}
+
+	for (;;) {
+		for (last = ntargets - 1; last >= 0 && targets[last] < 0; last--);
+		if (last < 0) break;
+
+		n = 0;
+		for (i = 0; i < last; i++) {
+			if (targets[i] < 0) continue;
+			while ((got = tee(src, pipes[i][1], n ? (size_t)n : size, 0)) < 0 && errno == EINTR);
+			if (got < 0) goto syscall_error;
+			if (got == 0) return;
+			if (n && got != n) {
+				fprintf(stderr, "mysh: fanout: short tee\n");
+				return;
+			}
+			n = got;
+		}
+		if (n == 0) {
+			while ((n = splice(src, 0, pipes[last][1], 0, size, 0)) < 0 && errno == EINTR);
+			if (n <= 0) break;
+		}
+		else {
+			len = n;
+			if (moveFanout(src, pipes[last][1], &len) < 0) goto syscall_error;
+		}
+
+		for (i = 0; i <= last; i++) {
+			if (targets[i] < 0) continue;
+			len = n;
+			if (moveFanout(pipes[i][0], targets[i], &len) == 0) continue;
+			close(targets[i]);
+			targets[i] = -1;
+			if (nullfd < 0 || moveFanout(pipes[i][0], nullfd, &len) < 0) goto syscall_error;
+		}
+	}
+	return;
+
+syscall_error:
+	perror("mysh: runFanout()");
+}
+
+int moveFanout(int from, int to, size_t* plen) {
+	char buf[READ_BLOCK];
+	ssize_t n, i, got;
+
+	while (*plen > 0) {
+		n = splice(from, 0, to, 0, *plen, 0);
+		if (n < 0 && errno == EINVAL) {
+			if ((n = read(from, buf, *plen < sizeof(buf) ? *plen : sizeof(buf))) <= 0) return -1;
+			*plen -= n;
+			for (i = 0; i < n; i += got) {
+				if ((got = write(to, buf + i, n - i)) < 0) {
+					if (errno != EINTR) return -1;
+					got = 0;
+				}
+			}
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		*plen -= n;
+	}
+	return 0;
+}
+
+int openHeredoc(int type, const char* word) {
+	struct HEREBUF hb;
+	const char* pchar;
+	const char* name;
+	const char* value;
+	char number[24];
+	char* end;
+	intmax_t result;
+	int i, fds[2], namelen;
+
+	hb.len = 0;
+	hb.fd = hb.rfd = -1;
+	if (strlen(word) < HEREDOC_PIPE) {
+		if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) goto syscall_error;
+		hb.rfd = fds[0];
+		hb.fd = fds[1];
+	}
+	else if ((hb.fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) goto syscall_error;
+
+	if (type == R_HERESTR) {
+		if (putHeredoc(&hb, word, strlen(word)) < 0 || putHeredoc(&hb, "\n", 1) < 0) goto syscall_error;
+	}
+	else while (*word) {
+		for (pchar = word; (unsigned char)*pchar > WC_LAST; pchar++);
+		if (pchar > word && putHeredoc(&hb, word, pchar - word) < 0) goto syscall_error;
+		word = pchar;
+
+		switch (*word) {
+		case 0:
+			break;
+		case WC_ESC:
+			if (putHeredoc(&hb, word + 1, 1) < 0) goto syscall_error;
+			word += 2;
+			break;
+		case WC_VAR:
+			name = word + 2;
+			for (namelen = 0; name[namelen] != WC_ENDVAR; namelen++);
+			word = name + namelen + 1;
+
+			if (namelen == 1 && (*name == '@' || *name == '*')) {
+				for (i = 0; i < nPosArgs; i++) {
+					if ((i > 0 && putHeredoc(&hb, " ", 1) < 0) || putHeredoc(&hb, posArgs[i], strlen(posArgs[i])) < 0) goto syscall_error;
+				}
+			}
+			else if ((value = lookupParam(name, namelen, number)) && putHeredoc(&hb, value, strlen(value)) < 0) goto syscall_error;
+			break;
+		case WC_ARITH:
+			i = strtol(word + 2, &end, 10);
+			word = end + 1;
+			if (evalArith(vmProg, i, &result) < 0) goto error;
+			sprintf(number, "%jd", result);
+			if (putHeredoc(&hb, number, strlen(number)) < 0) goto syscall_error;
+			break;
+		default:
+			word++;
+			break;
+		}
+	}
+	if (writeHeredoc(&hb, hb.buf, hb.len) < 0) goto syscall_error;
+
+	if (hb.rfd >= 0) {
+		close(hb.fd);
+		fcntl(hb.rfd, F_SETFL, fcntl(hb.rfd, F_GETFL) & ~O_NONBLOCK);
+		return hb.rfd;
+	}
+	fcntl(hb.fd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+	if (lseek(hb.fd, 0, SEEK_SET) < 0) goto syscall_error;
+	return hb.fd;
+
+syscall_error:
+	perror("mysh: here-document");
+error:
+	if (hb.rfd >= 0) close(hb.rfd);
+	if (hb.fd >= 0) close(hb.fd);
+	return -1;
+}
+
+int putHeredoc(struct HEREBUF* hb, const char* data, size_t len) {
+	if (hb->len + len <= sizeof(hb->buf)) {
+		memcpy(hb->buf + hb->len, data, len);
+		hb->len += len;
+		return 0;
+	}
+	if (writeHeredoc(hb, hb->buf, hb->len) < 0) return -1;
+	hb->len = 0;
+	if (len >= sizeof(hb->buf)) return writeHeredoc(hb, data, len);
+
+	memcpy(hb->buf, data, len);
+	hb->len = len;
+	return 0;
+}
+
+int writeHeredoc(struct HEREBUF* hb, const char* data, size_t len) {
+	ssize_t n;
+	int fd;
+
+	while (len > 0) {
+		if ((n = write(hb->fd, data, len)) >= 0) {
+			data += n;
+			len -= n;
+			continue;
+		}
+		if (errno == EINTR) continue;
+		if (errno != EAGAIN || hb->rfd < 0) return -1;
+
+		if ((fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) return -1;
+		while ((n = splice(hb->rfd, 0, fd, 0, HEREDOC_PIPE, SPLICE_F_NONBLOCK)) > 0);
+		if (n < 0 && errno != EAGAIN) {
+			close(fd);
+			return -1;
+		}
+		close(hb->rfd);
+		close(hb->fd);
+		hb->rfd = -1;
+		hb->fd = fd;
+	}
+	return 0;
+}
+
+int expandList(struct PROGRAM* prog, int* words, int nwords, int frame) {
+	struct ARGV av;
+	int n;
+
+	if (nwords < 0) {
+		if (nPosArgs == 0) return 0;
+		if (!(av.argv = arenaAlloc(sizeof(char*) * nPosArgs))) {
+			perror("mysh: expandList()");
+			return -1;
+		}
+		for (n = 0; n < nPosArgs; n++) av.argv[n] = posArgs[n];
+		av.argc = n;
+	}
+	else if (expandArgs(prog, words, nwords, &av) < 0) return -1;
+
+	frames[frame].items = av.argv;
+	frames[frame].nitems = av.argc;
+	return 0;
+}
+
+////////////////////////////////////////
+//FUNCTION findFunction
+//FUNCTION defineFunction
+//FUNCTION callFunction
+//FUNCTION freeFunctions
+////////////////////////////////////////
+
+struct FUNCTION* findFunction(const char* name) {
+	struct FUNCTION* func;
+
+	if (nFunctions == 0) return 0;
+
+	for (func = funcTable[hashName(name, strlen(name))]; func; func = func->next) {
+		if (strcmp(func->name, name) == 0) return func;
+	}
+	return 0;
+}
+
+int defineFunction(const char* name, struct PROGRAM* prog, int pc) {
+	struct FUNCTION* func;
+
+	if ((func = findFunction(name))) releaseProgram(func->prog);
+	else {
+		if (!(func = malloc(sizeof(struct FUNCTION))) || !(func->name = strdup(name))) {
+			perror("mysh: defineFunction()");
+			free(func);
+			return -1;
+		}
+		func->next = funcTable[hashName(name, strlen(name))];
+		funcTable[hashName(name, strlen(name))] = func;
+		nFunctions++;
+	}
+
+	func->prog = prog;
+	func->pc = pc;
+	prog->refs++;
+	return 0;
+}
+
+int callFunction(struct FUNCTION* func, int argc, char* argv[]) {
+	struct PROGRAM* prog = func->prog;
+	char** savedArgs = posArgs;
+	int savedN = nPosArgs;
+
+	prog->refs++;
+	posArgs = argv + 1;
+	nPosArgs = argc - 1;
+
+	vmRun(prog, func->pc);
+
+	vmReturn = vmBreak = vmContinue = 0;
+	posArgs = savedArgs;
+	nPosArgs = savedN;
+	releaseProgram(prog);
+
+	return lastStatus;
+}
+
+void freeFunctions(void) {
+	struct FUNCTION* func;
+	struct FUNCTION* next;
+	int i;
+
+	for (i = 0; i < VAR_BUCKETS; i++) {
+		for (func = funcTable[i]; func; func = next) {
+			next = func->next;
+			releaseProgram(func->prog);
+			free(func->name);
+			free(func);
+		}
+		funcTable[i] = 0;
+	}
+	nFunctions = 0;
+}
+
+////////////////////////////////////////
+//FUNCTION expandArgs
+//FUNCTION braceExpand
+//FUNCTION braceFind
+//FUNCTION braceSequence
+//FUNCTION braceWord
+//FUNCTION expandWord
+//FUNCTION expandString
+//FUNCTION expandPattern
+//FUNCTION lookupParam
+//FUNCTION startProcess
+//FUNCTION closeProcesses
+//FUNCTION splitFields
+//FUNCTION globField
+//FUNCTION addArg
+//FUNCTION xbufPut
+//FUNCTION compareArgs
+////////////////////////////////////////
+
+int expandArgs(struct PROGRAM* prog, int* words, int nwords, struct ARGV* av) {
+	struct XBUF xb = { 0 };
+	char* word;
+	char* pchar;
+	int i, argc;
+
+	memset(av, 0, sizeof(struct ARGV));
+
+	for (i = 0; i < nwords; i++) {
+		word = prog->strs + words[i];
+		for (pchar = word; *pchar; pchar++) {
+			if ((unsigned char)*pchar <= WC_LAST || strchr("*?[~{", *pchar)) break;
+		}
+
+		argc = av->argc;
+		if (*pchar == 0) {
+			if (!(pchar = arenaStrndup(word, pchar - word))) {
+				perror("mysh: expandArgs()");
+				return -1;
+			}
+			if (addArg(av, pchar) < 0) return -1;
+		}
+		else if (braceExpand(word, av, &xb) < 0) return -1;
+
+		if (av->argc - argc > av->nbatch) {
+			av->batch = argc;
+			av->nbatch = av->argc - argc;
+		}
+	}
+	if (!av->argv && addArg(av, 0) < 0) return -1;
+	av->argv[av->argc] = 0;
+
+	return av->argc;
+}
+
+int braceExpand(const char* word, struct ARGV* av, struct XBUF* xb) {
+	const char* open;
+	const char* close;
+	const char* start;
+	const char* pchar;
+	int seq, depth = 0;
+
+	if (!(open = braceFind(word, &close, &seq))) {
+		xb->len = 0;
+		expandWord(word, xb);
+		if (xb->err > 0) perror("mysh: expandArgs()");
+		if (xb->err) return -1;
+		return splitFields(xb, av);
+	}
+	if (seq) return braceSequence(word, open, close, av, xb);
+
+	for (start = pchar = open + 1; pchar <= close; pchar++) {
+		if (*pchar == WC_ESC) pchar++;
+		else if (*pchar == WC_VAR || *pchar == WC_ARITH || *pchar == WC_PROC) pchar = strchr(pchar, WC_ENDVAR);
+		else if (*pchar == '{') depth++;
+		else if (*pchar == '}' && depth > 0) depth--;
+		else if ((*pchar == ',' && depth == 0) || pchar == close) {
+			if (braceWord(word, open - word, start, pchar - start, close + 1, av, xb) < 0) return -1;
+			start = pchar + 1;
+		}
+	}
+
+	return 0;
+}
+
+const char* braceFind(const char* word, const char** pend, int* pseq) {
+	const char* open;
+	const char* pchar;
+	int depth, comma;
+
+	for (open = word; *open; open++) {
+		if (*open == WC_ESC) open++;
+		else if (*open == WC_VAR || *open == WC_ARITH || *open == WC_PROC) open = strchr(open, WC_ENDVAR);
+		else if (*open == '{') {
+			depth = comma = 0;
+			for (pchar = open + 1; *pchar; pchar++) {
+				if (*pchar == WC_ESC) pchar++;
+				else if (*pchar == WC_VAR || *pchar == WC_ARITH || *pchar == WC_PROC) pchar = strchr(pchar, WC_ENDVAR);
+				else if (*pchar == '{') depth++;
+				else if (*pchar == '}' && depth > 0) depth--;
+				else if (*pchar == '}') break;
+				else if (*pchar == ',' && depth == 0) comma = 1;
+			}
+			if (*pchar == 0) return 0;
+
+			*pend = pchar;
+			*pseq = 0;
+			if (comma) return open;
+			if (braceSequence(0, open, pchar, 0, 0) == 0) {
+				*pseq = 1;
+				return open;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int braceSequence(const char* word, const char* open, const char* close, struct ARGV* av, struct XBUF* xb) {
+	char number[48];
+	char* end;
+	intmax_t first, last, step = 1, i;
+	int width = 0, alpha;
+	size_t len;
+
+	alpha = isalpha((unsigned char)open[1]) && open[2] == '.';
+	if (alpha) {
+		first = (unsigned char)open[1];
+		end = (char*)open + 2;
+	}
+	else {
+		if (!isdigit((unsigned char)open[1]) && !(open[1] == '-' && isdigit((unsigned char)open[2]))) return -1;
+		first = strtoimax(open + 1, &end, 10);
+		if ((open[1] == '0' || (open[1] == '-' && open[2] == '0')) && end - open - 1 > 1) width = end - open - 1;
+	}
+	if (strncmp(end, "..", 2) != 0) return -1;
+
+	if (alpha) {
+		if (!isalpha((unsigned char)end[2])) return -1;
+		last = (unsigned char)end[2];
+		end += 3;
+	}
+	else {
+		len = end[2] == '-' ? 3 : 2;
+		if (!isdigit((unsigned char)end[len])) return -1;
+		if ((end[2] == '0' || (end[2] == '-' && end[3] == '0')) && strspn(end + len, "0123456789") + len - 2 > 1) {
+			if (strspn(end + len, "0123456789") + len - 2 > width) width = strspn(end + len, "0123456789") + len - 2;
+		}
+		last = strtoimax(end + 2, &end, 10);
+	}
+
+	if (strncmp(end, "..", 2) == 0) {
+		if (!isdigit((unsigned char)end[2]) && !(end[2] == '-' && isdigit((unsigned char)end[3]))) return -1;
+		step = strtoimax(end + 2, &end, 10);
+		if (step < 0) step = -step;
+		if (step == 0) step = 1;
+	}
+	if (end != close) return -1;
+	if (!word) return 0;
+
+	if (first > last) step = -step;
+	for (i = first; step > 0 ? i <= last : i >= last; i += step) {
+		if (alpha) {
+			number[0] = i;
+			number[1] = 0;
+		}
+		else sprintf(number, "%0*jd", width, i);
+		if (braceWord(word, open - word, number, strlen(number), close + 1, av, xb) < 0) return -1;
+		if ((step > 0 && i > INTMAX_MAX - step) || (step < 0 && i < INTMAX_MIN - step)) break;
+	}
+
+	return 0;
+}
+
+int braceWord(const char* word, size_t prefix, const char* middle, size_t len, const char* rest, struct ARGV* av, struct XBUF* xb) {
+	char* next;
+
+	if (!(next = arenaAlloc(prefix + len + strlen(rest) + 1))) {
+		perror("mysh: expandArgs()");
+		return -1;
+	}
+	memcpy(next, word, prefix);
+	memcpy(next + prefix, middle, len);
+	strcpy(next + prefix + len, rest);
+
+	return braceExpand(next, av, xb);
+}
+
+void expandWord(const char* word, struct XBUF* xb) {
+	char number[24];
+	const char* name;
+	const char* value;
+	const char* ifs;
+	char* end;
+	intmax_t result;
+	int i, namelen, flags, empty = 0;
+
+	xb->mark = 0;
+
+	if (*word == '~' && (word[1] == 0 || word[1] == '/') && (value = getenv("HOME"))) {
+		while (*value) xbufPut(xb, *(value++), F_QUOTED);
+		word++;
+	}
+
+	while (*word) {
+		switch (*word) {
+		case WC_ESC:
+			xbufPut(xb, word[1], F_QUOTED);
+			word += 2;
+			break;
+		case WC_QUOTE:
+			xb->mark = 1;
+			word++;
+			break;
+		case WC_VAR:
+			flags = word[1] & VF_QUOTED ? F_QUOTED : F_SPLIT;
+			name = word + 2;
+			for (namelen = 0; name[namelen] != WC_ENDVAR; namelen++);
+			word = name + namelen + 1;
+
+			if (namelen == 1 && (*name == '@' || *name == '*')) {
+				ifs = getVar("IFS", 3);
+				if (nPosArgs == 0 && *name == '@' && flags == F_QUOTED) empty = 1;
+				for (i = 0; i < nPosArgs; i++) {
+					if (i > 0) {
+						if (*name == '*' && flags == F_QUOTED) {
+							if (!ifs) xbufPut(xb, ' ', F_QUOTED);
+							else if (*ifs) xbufPut(xb, *ifs, F_QUOTED);
+						}
+						else xbufPut(xb, ' ', F_BREAK | flags);
+					}
+					for (value = posArgs[i]; *value; value++) xbufPut(xb, *value, flags);
+				}
+				break;
+			}
+
+			if ((value = lookupParam(name, namelen, number))) {
+				while (*value) xbufPut(xb, *(value++), flags);
+			}
+			break;
+		case WC_ARITH:
+			flags = word[1] & VF_QUOTED ? F_QUOTED : F_SPLIT;
+			i = strtol(word + 2, &end, 10);
+			word = end + 1;
+
+			if (evalArith(vmProg, i, &result) < 0) xb->err = -1;
+			else {
+				sprintf(number, "%jd", result);
+				for (value = number; *value; value++) xbufPut(xb, *value, flags);
+			}
+			break;
+		case WC_PROC:
+			flags = word[1] & VF_OUTPUT;
+			name = word + 2;
+			for (namelen = 0; name[namelen] != WC_ENDVAR; namelen++);
+			word = name + namelen + 1;
+
+			if ((i = startProcess(name, namelen, flags)) < 0) xb->err = -1;
+			else {
+				sprintf(number, "/dev/fd/%d", i);
+				for (value = number; *value; value++) xbufPut(xb, *value, F_QUOTED);
+			}
+			break;
+		default:
+			xbufPut(xb, *(word++), 0);
+			break;
+		}
+	}
+
+	if (empty && xb->len == 0) xb->mark = 0;
+}
+
+char* expandString(const char* word) {
+	struct XBUF xb = { 0 };
+
+	expandWord(word, &xb);
+	xbufPut(&xb, 0, 0);
+
+	if (xb.err) {
+		if (xb.err > 0) perror("mysh: expandString()");
+		return 0;
+	}
+	return xb.str;
+}
+
+char* expandPattern(const char* word) {
+	struct XBUF xb = { 0 };
+	char* pattern;
+	size_t i, len = 0;
+
+	expandWord(word, &xb);
+	if (xb.err || !(pattern = arenaAlloc(xb.len * 2 + 1))) {
+		if (xb.err >= 0) perror("mysh: expandPattern()");
+		return 0;
+	}
+
+	for (i = 0; i < xb.len; i++) {
+		if ((xb.flags[i] & F_QUOTED) && strchr("*?[]\\", xb.str[i])) pattern[len++] = '\\';
+		pattern[len++] = xb.str[i];
+	}
+	pattern[len] = 0;
+
+	return pattern;
+}
+
+const char* lookupParam(const char* name, int namelen, char* buf) {
+	int n;
+
+	if (isdigit((unsigned char)*name)) {
+		n = atoi(name);
+		if (n == 0) return scriptName;
+		return n <= nPosArgs ? posArgs[n - 1] : 0;
+	}
+
+	if (namelen == 1) {
+		switch (*name) {
+		case '?':
+			sprintf(buf, "%d", lastStatus);
+			return buf;
+		case '#':
+			sprintf(buf, "%d", nPosArgs);
+			return buf;
+		case '$':
+			rcPure = 0;
+			sprintf(buf, "%d", (int)shellPid);
+			return buf;
+		case '!':
+			rcPure = 0;
+			if (lastBgPid == 0) return 0;
+			sprintf(buf, "%d", (int)lastBgPid);
+			return buf;
+		case '-':
+			return myshOntty ? "i" : "";
+		}
+	}
+
+	return getVar(name, namelen);
+}
+
+int startProcess(const char* source, int len, int output) {
+	struct PROCSUBST* psub;
+	char* text;
+	int fds[2], fd, i;
+	pid_t child;
+
+	if (nProcSubsts == sizeProcSubsts) {
+		if (!(psub = realloc(procSubsts, sizeof(struct PROCSUBST) * (sizeProcSubsts * 2 + 8)))) goto syscall_error;
+		procSubsts = psub;
+		sizeProcSubsts = sizeProcSubsts * 2 + 8;
+	}
+	if (!(text = arenaStrndup(source, len))) goto syscall_error;
+	if (pipe2(fds, O_CLOEXEC) < 0) goto syscall_error;
+	rcPure = 0;
+
+	fflush(stdout);
+	if ((child = fork()) == 0) {
+		for (i = 0; i < nProcSubsts; i++) {
+			if (procSubsts[i].fd >= 0) close(procSubsts[i].fd);
+		}
+		dup2(fds[output ? 0 : 1], output ? 0 : 1);
+		close(fds[0]);
+		close(fds[1]);
+		vmForked = 1;
+		vmBase = nFrames;
+		vmPipeOut = 0;
+		termRaw = 0;
+		if (myshOntty && !vmBackground) resetSignal();
+
+		lastStatus = runScript(text);
+		fflush(stdout);
+		_exit(lastStatus);
+	}
+	else if (child < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		goto syscall_error;
+	}
+
+	close(fds[output ? 0 : 1]);
+	fd = fcntl(fds[output ? 1 : 0], F_DUPFD, 10);
+	close(fds[output ? 1 : 0]);
+	if (fd < 0) goto syscall_error;
+
+	procSubsts[nProcSubsts].fd = fd;
+	procSubsts[nProcSubsts++].pid = child;
+	return fd;
+
+syscall_error:
+	perror("mysh: startProcess()");
+	return -1;
+}
+
+void closeProcesses(int keep) {
+	int i, n;
+
+	for (i = n = 0; i < nProcSubsts; i++) {
+		if (i >= keep && procSubsts[i].fd >= 0) {
+			close(procSubsts[i].fd);
+			procSubsts[i].fd = -1;
+		}
+		if (procSubsts[i].fd >= 0 || waitpid(procSubsts[i].pid, 0, WNOHANG) == 0) procSubsts[n++] = procSubsts[i];
+	}
+	nProcSubsts = n;
+}
+
+int splitFields(struct XBUF* xb, struct ARGV* av) {
+	const char* ifs = getVar("IFS", 3);
+	size_t i, start = 0;
+	int keep = xb->mark, fields = 0;
+	char ch = 0;
+
+	if (!ifs) ifs = " \t\n";
+
+	for (i = 0; i <= xb->len; i++) {
+		if (i < xb->len && (xb->flags[i] & F_BREAK)) {
+			if (globField(xb, start, i, av) < 0) return -1;
+			fields++;
+			start = i + 1;
+			keep = xb->flags[i] & F_QUOTED;
+			continue;
+		}
+		if (i < xb->len) {
+			ch = xb->str[i];
+			if (!(xb->flags[i] & F_SPLIT) || !strchr(ifs, ch) || ch == 0) continue;
+		}
+
+		if (i > start || keep || (i < xb->len && !isIfsSpace(ch, ifs))) {
+			if (globField(xb, start, i, av) < 0) return -1;
+			fields++;
+		}
+		else if (i == xb->len && fields == 0 && xb->mark) {
+			if (globField(xb, start, i, av) < 0) return -1;
+		}
+		if (i == xb->len) break;
+
+		if (isIfsSpace(ch, ifs)) {
+			while (i + 1 < xb->len && (xb->flags[i + 1] & F_SPLIT) && isIfsSpace(xb->str[i + 1], ifs)) i++;
+			if (i + 1 < xb->len && (xb->flags[i + 1] & F_SPLIT) && strchr(ifs, xb->str[i + 1])) i++;
+		}
+		start = i + 1;
+		keep = 0;
+	}
+
+	return 0;
+}
+
+int globField(struct XBUF* xb, size_t start, size_t end, struct ARGV* av) {
+	char* pattern;
+	char* dirname;
+	char* pchar;
+	size_t i, dir, len = 0;
+	int fd, glob = 0, nested = 0, first = av->argc, count = 0;
+	DIR* pd;
+	struct dirent* files;
+
+	for (i = dir = start; i < end; i++) {
+		if (xb->str[i] == '/') dir = i + 1;
+	}
+	if (!(pattern = arenaAlloc((end - dir) * 2 + 1))) goto syscall_error;
+
+	for (i = start; i < end; i++) {
+		if (xb->flags[i] & F_QUOTED) {
+			if (i >= dir && strchr("*?[]\\", xb->str[i])) pattern[len++] = '\\';
+		}
+		else if (xb->str[i] == '*' || xb->str[i] == '?' || (xb->str[i] == '[' && memchr(xb->str + i, ']', end - i))) {
+			if (i < dir) nested = 1;
+			else glob = 1;
+		}
+		if (i >= dir) pattern[len++] = xb->str[i];
+	}
+	pattern[len] = 0;
+
+	if (glob && !nested) {
+		if (!(dirname = arenaStrndup(xb->str + start, dir - start))) goto syscall_error;
+		if ((fd = openat(cwdFd, dir > start ? dirname : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+			if (!(pd = fdopendir(fd))) {
+				close(fd);
+				goto syscall_error;
+			}
+			while ((files = readdir(pd))) {
+				if (fnmatch(pattern, files->d_name, FNM_PERIOD) != 0) continue;
+				if (!(pchar = arenaAlloc(dir - start + strlen(files->d_name) + 1))) {
+					closedir(pd);
+					goto syscall_error;
+				}
+				memcpy(pchar, dirname, dir - start);
+				strcpy(pchar + (dir - start), files->d_name);
+				if (addArg(av, pchar) < 0) {
+					closedir(pd);
+					return -1;
+				}
+				count++;
+			}
+			closedir(pd);
+		}
+
+		if (count > 0) {
+			qsort(av->argv + first, count, sizeof(char*), compareArgs);
+			return 0;
+		}
+	}
+
+	if (!(pchar = arenaStrndup(xb->str + start, end - start))) goto syscall_error;
+	return addArg(av, pchar);
+
+syscall_error:
+	perror("mysh: expandArgs()");
+	return -1;
+}
+
+int addArg(struct ARGV* av, char* arg) {
+	char** argv;
+
+	if (av->argc + 1 >= av->size) {
+		if (!(argv = arenaGrow(av->argv, sizeof(char*) * av->size, sizeof(char*) * (av->size * 2 + 8)))) {
+			perror("mysh: addArg()");
+			return -1;
+		}
+		av->argv = argv;
+		av->size = av->size * 2 + 8;
+	}
+	if (arg) av->argv[av->argc++] = arg;
+	return 0;
+}
+
+void xbufPut(struct XBUF* xb, int ch, int flags) {
+	char* pchar;
+
+	if (xb->len + 1 >= xb->size) {
+		if (!(pchar = arenaAlloc((xb->size * 2 + 64) * 2))) {
+			xb->err = 1;
+			return;
+		}
+		if (xb->len > 0) {
+			memcpy(pchar, xb->str, xb->len);
+			memcpy(pchar + xb->size * 2 + 64, xb->flags, xb->len);
+		}
+		xb->str = pchar;
+		xb->flags = pchar + xb->size * 2 + 64;
+		xb->size = xb->size * 2 + 64;
+	}
+	xb->str[xb->len] = ch;
+	xb->flags[xb->len++] = flags;
+}
+
+int compareArgs(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+////////////////////////////////////////
+//FUNCTION arenaAlloc
+//FUNCTION arenaGrow
+//FUNCTION arenaStrndup
+//FUNCTION arenaMark
+//FUNCTION arenaRelease
+//FUNCTION arenaReset
+//FUNCTION malloc
+//FUNCTION calloc
+//FUNCTION realloc
+//FUNCTION free
+////////////////////////////////////////
+
+void* arenaAlloc(size_t size) {
+	struct ARENABLOCK* block;
+
+	size = (size + 15) & ~(size_t)15;
+	if (!arenaBlock || arenaUsed + size > arenaBlock->size) {
+		block = arenaBlock ? arenaBlock->next : arenaHead;
+		if (!block || block->size < size) {
+			if (!(block = malloc(sizeof(struct ARENABLOCK) + (size > ARENA_BLOCK ? size : ARENA_BLOCK)))) return 0;
+			block->size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+			if (arenaBlock) {
+				block->next = arenaBlock->next;
+				arenaBlock->next = block;
+			}
+			else {
+				block->next = arenaHead;
+				arenaHead = block;
+			}
+		}
+		arenaBase += arenaUsed;
+		arenaBlock = block;
+		arenaUsed = 0;
+	}
+
+	arenaLast = arenaBlock->data + arenaUsed;
+	arenaUsed += size;
+	if (arenaBase + arenaUsed > arenaPeak) arenaPeak = arenaBase + arenaUsed;
+	return arenaLast;
+}
+
+void* arenaGrow(void* ptr, size_t oldsize, size_t size) {
+	void* pnew;
+	size_t offset;
+
+	if (ptr && ptr == arenaLast) {
+		offset = (char*)ptr - arenaBlock->data;
+		if (offset + size <= arenaBlock->size) {
+			arenaUsed = offset + ((size + 15) & ~(size_t)15);
+			if (arenaBase + arenaUsed > arenaPeak) arenaPeak = arenaBase + arenaUsed;
+			return ptr;
+		}
+	}
+
+	if (!(pnew = arenaAlloc(size))) return 0;
+	if (ptr) memcpy(pnew, ptr, oldsize);
+	return pnew;
+}
+
+char* arenaStrndup(const char* str, size_t len) {
+	char* pchar;
+
+	if (!(pchar = arenaAlloc(len + 1))) return 0;
+	memcpy(pchar, str, len);
+	pchar[len] = 0;
+	return pchar;
+}
+
+void arenaMark(struct ARENAMARK* mark) {
+	mark->block = arenaBlock;
+	mark->used = arenaUsed;
+	mark->base = arenaBase;
+}
+
+void arenaRelease(const struct ARENAMARK* mark) {
+	if (!mark->block) {
+		arenaReset();
+		return;
+	}
+	arenaBlock = mark->block;
+	arenaUsed = mark->used;
+	arenaBase = mark->base;
+	arenaLast = 0;
+}
+
+void arenaReset(void) {
+	struct ARENABLOCK* block;
+	struct ARENABLOCK* next;
+
+	for (block = arenaHead; block; block = next) {
+		next = block->next;
+		if (block == arenaHead && block->size == ARENA_BLOCK) block->next = 0;
+		else free(block);
+	}
+	if (arenaHead && arenaHead->size != ARENA_BLOCK) arenaHead = 0;
+	arenaBlock = 0;
+	arenaLast = 0;
+	arenaUsed = arenaBase = 0;
+}
+
+//glibc-only allocator counters for allocstats, enabled with -DMYSH_ALLOCSTATS
+#if defined(MYSH_ALLOCSTATS) && !defined(__SANITIZE_ADDRESS__)
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+	__atomic_fetch_add(&nMallocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+	__atomic_fetch_add(&nMallocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	__atomic_fetch_add(&nReallocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+	if (ptr) __atomic_fetch_add(&nFrees, 1, __ATOMIC_RELAXED);
+	__libc_free(ptr);
+}
+#endif
+
+////////////////////////////////////////
+//FUNCTION checkInternal
+////////////////////////////////////////
+
+int checkInternal(char* name) {
+	int index;
+	for (index = 0; index < nCommands; index++) {
+		if (strcmp(commands[index].name, name) == 0) return index;
+	}
+	return -1;
+}
+
+////////////////////////////////////////
+//FUNCTION internalCommands
+//FUNCTION externalCommands
+////////////////////////////////////////
+
+int internalCommands(int index, int argc, char* command_args[]) {
+	int ret;
+
+	fflush(stdout);
+	ret = commands[index].func(argc, command_args);
+	fflush(stdout);
+	return ret;
+}
+
+int externalCommands(int argc, char* command_args[], struct PROGRAM* prog, int pc) {
+	pid_t child;
+
+	fflush(stdout);
+	child = fork();
+	if (child == -1) return -1;
+	else if (child == 0) execCommand(prog, pc, command_args);
+
+	return waitChild(child);
+}
+
+////////////////////////////////////////
+//FUNCTION initHistoryQueue
+//FUNCTION queueHistoryQueue
+//FUNCTION checkHistoryQueue
+//FUNCTION saveHistoryQueue
+////////////////////////////////////////
+
+void initHistoryQueue(void) {
+	FILE* hf;
+	char command[MAX_COMLEN];
+	char* homedir;
+	int ch, pcommand;
+
+	homedir = getenv("HOME");
+	if (!homedir) return;
+
+	if (snprintf(command, MAX_COMLEN, "%s/.mysh_history", homedir) < 0) return;
+	if ((hf = fopen(command, "r")) == NULL) return;
+
+	pcommand = 0;
+	while ((ch = fgetc(hf)) != EOF && pcommand < MAX_COMLEN) {
+		if (ch == '\n') {
+			if (pcommand == 0) continue;
+			command[pcommand] = 0;
+			queueHistoryQueue(command);
+			pcommand = 0;
+		}
+		else command[pcommand++] = ch;
+	}
+
+	fclose(hf);
+}
+
+void queueHistoryQueue(char* command) {
+	char* pchar;
+	int num;
+
+	if ((pchar = strdup(command)) == NULL) {
+		perror("mysh: queueHistoryQueue()");
+		return;
+	}
+
+	if (nHistoryQueue == 0) num = 1;
+	else num = historyQueue[(startHistoryQueue + nHistoryQueue - 1) % MAX_HISTORIES].num + 1;
+
+	if (nHistoryQueue < MAX_HISTORIES) {
+		historyQueue[(startHistoryQueue + nHistoryQueue) % MAX_HISTORIES].command = pchar;
+		historyQueue[(startHistoryQueue + nHistoryQueue) % MAX_HISTORIES].num = num;
+		nHistoryQueue++;
+	}
+	else {
+		free(historyQueue[startHistoryQueue].command);
+		historyQueue[startHistoryQueue].command = pchar;
+		historyQueue[startHistoryQueue].num = num;
+		startHistoryQueue = (startHistoryQueue + 1) == MAX_HISTORIES ? 0 : (startHistoryQueue + 1);
+	}
+}
+
+int checkHistoryQueue(int num, char* string, int len) {
+	if (nHistoryQueue == 0) return -1;
+
+	if (num > 0) {
+		int startnum;
+
+		startnum = historyQueue[startHistoryQueue].num;
+		if (num >= startnum && num < startnum + nHistoryQueue) {
+			return (startHistoryQueue + (num - startnum)) % MAX_HISTORIES;
+		}
+	}
+	else if (num < 0) {
+		if (nHistoryQueue + num >= 0) {
+			return (startHistoryQueue + nHistoryQueue + num) % MAX_HISTORIES;
+		}
+	}
+	else if (string && len>0) {
+		int i;
+
+		for (i = nHistoryQueue - 1; i >= 0; i--) {
+			if (strncmp(historyQueue[(startHistoryQueue + i) % MAX_HISTORIES].command, string, len) == 0) {
+				return (startHistoryQueue + i) % MAX_HISTORIES;
+			}
+		}
+	}
+
+	return -1;
+}
+
+void saveHistoryQueue(void) {
+	FILE* hf;
+	char command[MAX_COMLEN];
+	char* homedir;
+	int i;
+
+	homedir = getenv("HOME");
+	if (!homedir) return;
+
+	if (snprintf(command, MAX_COMLEN, "%s/.mysh_history", homedir) < 0) return;
+	if ((hf = fopen(command, "w")) == NULL) return;
+
+	for (i = 0; i < nHistoryQueue; i++) {
+		fprintf(hf, "%s\n", historyQueue[(startHistoryQueue + i) % MAX_HISTORIES].command);
+		free(historyQueue[(startHistoryQueue + i) % MAX_HISTORIES].command);
+	}
+
+	fclose(hf);
+}
+
+////////////////////////////////////////
+//FUNCTION freeAliasList
+////////////////////////////////////////
+
+void freeAliasList(void) {
+	struct ALIAS* alias = aliasList;
+	struct ALIAS* next;
+	while (alias) {
+		next = alias->next;
+		free(alias->alias);
+		free(alias->command);
+		free(alias);
+		alias = next;
+	}
+}
+
+////////////////////////////////////////
+//FUNCTION hashName
+//FUNCTION findVar
+//FUNCTION getVar
+//FUNCTION setVar
+//FUNCTION unsetVar
+//FUNCTION freeVarTable
+//FUNCTION isAssignName
+////////////////////////////////////////
+
+unsigned int hashName(const char* name, int len) {
+	unsigned int hash = 5381;
+
+	while (len-- > 0) hash = hash * 33 + (unsigned char)*(name++);
+	return hash % VAR_BUCKETS;
+}
+
+struct VARIABLE* findVar(const char* name, int len) {
+	struct VARIABLE* var;
+
+	for (var = varTable[hashName(name, len)]; var; var = var->next) {
+		if (strncmp(var->name, name, len) == 0 && var->name[len] == 0) return var;
+	}
+	return 0;
+}
+
+char* getVar(const char* name, int len) {
+	struct VARIABLE* var;
+	char envname[MAX_VARNAME];
+	char* value;
+
+	if ((var = findVar(name, len))) return var->value;
+	if (len >= MAX_VARNAME) return 0;
+
+	memcpy(envname, name, len);
+	envname[len] = 0;
+	if (!rcLoading) return getenv(envname);
+
+	//inherited values the rc depends on are checked before a snapshot is reused
+	if ((value = getenv(envname))) addRecord('d', envname, value);
+	else addRecord('n', envname, "");
+	return value;
+}
+
+int setVar(const char* name, const char* value) {
+	struct VARIABLE* var;
+	char* pchar;
+	char* env;
+	int len = strlen(name);
+
+	if (!(pchar = strdup(value))) {
+		perror("mysh: setVar()");
+		return -1;
+	}
+
+	if ((var = findVar(name, len))) {
+		free(var->value);
+		var->value = pchar;
+	}
+	else {
+		//whether a new variable is exported depends on what was inherited, so the snapshot does too
+		if (rcLoading) {
+			if ((env = getenv(name))) addRecord('d', name, env);
+			else addRecord('n', name, "");
+		}
+		if (!(var = malloc(sizeof(struct VARIABLE))) || !(var->name = strdup(name))) {
+			perror("mysh: setVar()");
+			free(var);
+			free(pchar);
+			return -1;
+		}
+		var->value = pchar;
+		var->next = varTable[hashName(name, len)];
+		varTable[hashName(name, len)] = var;
+	}
+
+	if (getenv(name)) setenv(name, pchar, 1);
+	return 0;
+}
+
+void unsetVar(const char* name) {
+	struct VARIABLE* var;
+	struct VARIABLE** pvar;
+	int len = strlen(name);
+
+	for (pvar = &varTable[hashName(name, len)]; (var = *pvar); pvar = &var->next) {
+		if (strcmp(var->name, name) == 0) {
+			*pvar = var->next;
+			free(var->name);
+			free(var->value);
+			free(var);
+			break;
+		}
+	}
+	unsetenv(name);
+}
+
+void freeVarTable(void) {
+	struct VARIABLE* var;
+	struct VARIABLE* next;
+	int i;
+
+	for (i = 0; i < VAR_BUCKETS; i++) {
+		for (var = varTable[i]; var; var = next) {
+			next = var->next;
+			free(var->name);
+			free(var->value);
+			free(var);
+		}
+		varTable[i] = 0;
+	}
+}
+
+int isAssignName(const char* name, int len) {
+	int i;
+
+	if (len <= 0 || !(isalpha((unsigned char)*name) || *name == '_')) return 0;
+	for (i = 1; i < len; i++) {
+		if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) return 0;
+	}
+	return 1;
+}
+
+////////////////////////////////////////
+//FUNCTION readLine
+//FUNCTION isIfsSpace
+////////////////////////////////////////
+
+int readLine(int fd, int delim, size_t start, size_t* plen) {
+	static int peekPipe[2] = { -1, -1 };
+	struct stat st;
+	int fds[2];
+	ssize_t n, i, got;
+	size_t len = start;
+	char* pchar;
+	char* found;
+	int mode;
+
+	if (fstat(fd, &st) < 0) return -1;
+	if (S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) != -1) mode = RL_SEEK;
+	else if (S_ISFIFO(st.st_mode)) mode = RL_TEE;
+	else if (S_ISSOCK(st.st_mode)) mode = RL_PEEK;
+	else mode = RL_BYTE;
+
+	for (;;) {
+		if (readBufSize - len < READ_BLOCK + 1) {
+			if (!(pchar = realloc(readBuf, readBufSize * 2 + READ_BLOCK + 1))) return -1;
+			readBuf = pchar;
+			readBufSize = readBufSize * 2 + READ_BLOCK + 1;
+		}
+		pchar = readBuf + len;
+
+		switch (mode) {
+		case RL_SEEK:
+			n = read(fd, pchar, READ_BLOCK);
+			if (n > 0 && (found = memchr(pchar, delim, n))) {
+				i = found - pchar;
+				if (lseek(fd, i + 1 - n, SEEK_CUR) == -1) return -1;
+				*plen = len + i;
+				return 1;
+			}
+			break;
+		case RL_TEE:
+			if (peekPipe[0] == -1) {
+				if (pipe2(fds, O_CLOEXEC) < 0) {
+					mode = RL_BYTE;
+					continue;
+				}
+				peekPipe[0] = fcntl(fds[0], F_DUPFD_CLOEXEC, 10);
+				peekPipe[1] = fcntl(fds[1], F_DUPFD_CLOEXEC, 10);
+				close(fds[0]);
+				close(fds[1]);
+			}
+			n = tee(fd, peekPipe[1], READ_BLOCK, 0);
+			if (n < 0 && errno == EINVAL) {
+				mode = RL_BYTE;
+				continue;
+			}
+			for (got = 0; n > 0 && got < n; got += i) {
+				if ((i = read(peekPipe[0], pchar + got, n - got)) <= 0) return -1;
+			}
+			if (n > 0 && memchr(pchar, delim, n)) n = (char*)memchr(pchar, delim, n) - pchar + 1;
+			for (got = 0; n > 0 && got < n; got += i) {
+				if ((i = read(fd, pchar + got, n - got)) <= 0) return -1;
+			}
+			if (n > 0 && pchar[n - 1] == delim) {
+				*plen = len + n - 1;
+				return 1;
+			}
+			break;
+		case RL_PEEK:
+			n = recv(fd, pchar, READ_BLOCK, MSG_PEEK);
+			if (n > 0 && memchr(pchar, delim, n)) n = (char*)memchr(pchar, delim, n) - pchar + 1;
+			for (got = 0; n > 0 && got < n; got += i) {
+				if ((i = read(fd, pchar + got, n - got)) <= 0) return -1;
+			}
+			if (n > 0 && pchar[n - 1] == delim) {
+				*plen = len + n - 1;
+				return 1;
+			}
+			break;
+		default:
+			n = read(fd, pchar, 1);
+			if (n > 0 && *pchar == delim) {
+				*plen = len;
+				return 1;
+			}
+			break;
+		}
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		else if (n == 0) {
+			*plen = len;
+			return 0;
+		}
+		len += n;
+	}
+}
+
+int isIfsSpace(int ch, const char* ifs) {
+	return (ch == ' ' || ch == '\t' || ch == '\n') && strchr(ifs, ch);
+}
+
+////////////////////////////////////////
+//FUNCTION runScript
+//FUNCTION readScript
+////////////////////////////////////////
+
+int runScript(const char* source) {
+	struct PROGRAM* prog;
+
+	if (parseSource(source, 1, &prog) != PARSE_OK) return 2;
+	if (!prog) return 0;
+
+	vmRun(prog, 0);
+	vmBreak = vmContinue = vmReturn = 0;
+	releaseProgram(prog);
+	return lastStatus;
+}
+
+int runFile(const char* path) {
+	struct PROGRAM* prog;
+	struct stat st;
+	char* source;
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return 127;
+	}
+
+	if (!(prog = loadCache(&st))) {
+		source = readScript(fd, path, st.st_size);
+		close(fd);
+		if (!source) return 127;
+
+		ret = parseSource(source, 1, &prog);
+		free(source);
+		if (ret != PARSE_OK) return 2;
+		if (!prog) return 0;
+		saveCache(prog, &st);
+	}
+	else close(fd);
+
+	vmRun(prog, 0);
+	vmBreak = vmContinue = vmReturn = 0;
+	releaseProgram(prog);
+	return lastStatus;
+}
+
+char* readScript(int fd, const char* path, size_t size) {
+	char* source;
+	ssize_t n;
+	size_t len = 0;
+
+	if (!(source = malloc(size + 1))) goto error;
+
+	while (len < size && (n = read(fd, source + len, size - len)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			goto error;
+		}
+		len += n;
+	}
+	source[len] = 0;
+
+	return source;
+
+error:
+	fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+	free(source);
+	return 0;
+}
+
+////////////////////////////////////////
+//FUNCTION runServer
+//FUNCTION serveClient
+//FUNCTION serveCommand
+//FUNCTION runClient
+//FUNCTION sendFrame
+//FUNCTION recvFrame
+//FUNCTION readFull
+////////////////////////////////////////
+
+int runServer(const char* path) {
+	struct sockaddr_un addr;
+	struct stat st;
+	pid_t child;
+	int sock, conn;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "mysh: %s: socket path too long\n", path);
+		return 2;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) goto syscall_error;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, SRV_BACKLOG) < 0) goto syscall_error;
+
+	//workers are never waited for; each one reaps its own commands
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if ((conn = accept4(sock, 0, 0, SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			goto syscall_error;
+		}
+		if ((child = fork()) == 0) {
+			close(sock);
+			signal(SIGCHLD, SIG_DFL);
+			_exit(serveClient(conn));
+		}
+		else if (child < 0) perror("mysh: fork()");
+		close(conn);
+	}
+
+syscall_error:
+	fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+	return 1;
+}
+
+int serveClient(int conn) {
+	struct SRVHDR hdr;
+	char* command = 0;
+	char* pchar;
+	int32_t status;
+	int fds[4], nfds, i, ret;
+
+	while ((ret = recvFrame(conn, &hdr, fds, &nfds)) > 0) {
+		if (hdr.type != SRV_COMMAND || (nfds > 0 && nfds < 3) || hdr.len > SRV_MAXCOMMAND ||
+			!(pchar = realloc(command, (size_t)hdr.len + 1)) || readFull(conn, (command = pchar), hdr.len) < 0) {
+			for (i = 0; i < nfds; i++) close(fds[i]);
+			break;
+		}
+		command[hdr.len] = 0;
+
+		status = serveCommand(conn, command, fds, nfds);
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		if (sendFrame(conn, SRV_STATUS, &status, sizeof(status), 0, 0) < 0) break;
+	}
+
+	free(command);
+	return ret < 0;
+}
+
+int serveCommand(int conn, const char* command, int* fds, int nfds) {
+	char buf[READ_BLOCK];
+	struct pollfd pfd[2];
+	int out[2] = { -1, -1 }, err[2] = { -1, -1 };
+	int i, left, null;
+	ssize_t n;
+	pid_t child;
+
+	if (nfds == 0 && (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0)) goto syscall_error;
+
+	if ((child = fork()) == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		if (nfds >= 3) {
+			for (i = 0; i < 3; i++) dup2(fds[i], i);
+		}
+		else {
+			if ((null = open("/dev/null", O_RDONLY)) >= 0 && null != 0) {
+				dup2(null, 0);
+				close(null);
+			}
+			dup2(out[1], 1);
+			dup2(err[1], 2);
+			for (i = 0; i < 2; i++) {
+				close(out[i]);
+				close(err[i]);
+			}
+		}
+		close(conn);
+		//the optional fourth fd is the client's working directory
+		if (nfds == 4 && fchdir(fds[3]) == 0) {
+			free(logicalPwd);
+			if (cwdFd >= 0) close(cwdFd);
+			initPwd();
+		}
+		vmForked = 1;
+		lastStatus = runScript(command);
+		fflush(stdout);
+		_exit(lastStatus);
+	}
+	else if (child < 0) goto syscall_error;
+	if (nfds >= 3) return waitChild(child);
+
+	close(out[1]);
+	close(err[1]);
+	pfd[0].fd = out[0];
+	pfd[1].fd = err[0];
+	pfd[0].events = pfd[1].events = POLLIN;
+	for (left = 2; left > 0;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (i = 0; i < 2; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents) continue;
+			if ((n = read(pfd[i].fd, buf, sizeof(buf))) > 0) {
+				//a vanished client closes both pipes so the command sees SIGPIPE
+				if (sendFrame(conn, i == 0 ? SRV_STDOUT : SRV_STDERR, buf, n, 0, 0) < 0) left = 1;
+				else continue;
+			}
+			else if (n < 0 && errno == EINTR) continue;
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			left--;
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		if (pfd[i].fd >= 0) close(pfd[i].fd);
+	}
+	return waitChild(child);
+
+syscall_error:
+	perror("mysh: serveCommand()");
+	for (i = 0; i < 2; i++) {
+		if (out[i] >= 0) close(out[i]);
+		if (err[i] >= 0) close(err[i]);
+	}
+	return 126;
+}
+
+int runClient(const char* path, const char* command) {
+	struct sockaddr_un addr;
+	struct SRVHDR hdr;
+	char buf[READ_BLOCK];
+	int32_t status;
+	int sock = -1, fds[4] = { 0, 1, 2, -1 }, nfds;
+	size_t len;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "mysh: %s: socket path too long\n", path);
+		return 2;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) goto syscall_error;
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) goto syscall_error;
+	fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (sendFrame(sock, SRV_COMMAND, command, strlen(command), fds, fds[3] < 0 ? 3 : 4) < 0) goto syscall_error;
+	if (fds[3] >= 0) close(fds[3]);
+
+	while (recvFrame(sock, &hdr, 0, &nfds) > 0) {
+		if (hdr.type == SRV_STATUS && hdr.len == sizeof(status)) {
+			if (readFull(sock, &status, sizeof(status)) < 0) break;
+			close(sock);
+			return status;
+		}
+		for (; hdr.len > 0; hdr.len -= len) {
+			len = hdr.len < sizeof(buf) ? hdr.len : sizeof(buf);
+			if (readFull(sock, buf, len) < 0) goto lost;
+			if (hdr.type == SRV_STDOUT || hdr.type == SRV_STDERR) write(hdr.type, buf, len);
+		}
+	}
+
+lost:
+	fprintf(stderr, "mysh: %s: connection lost\n", path);
+	close(sock);
+	return 1;
+
+syscall_error:
+	fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+	if (sock >= 0) close(sock);
+	return 1;
+}
+
+int sendFrame(int sock, int type, const void* data, size_t len, int* fds, int nfds) {
+	char control[CMSG_SPACE(sizeof(int) * 4)];
+	struct SRVHDR hdr;
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct iovec iov[2];
+	ssize_t n;
+
+	hdr.type = type;
+	hdr.len = len;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	while (msg.msg_iovlen > 0) {
+		if ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		msg.msg_control = 0;
+		msg.msg_controllen = 0;
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+int recvFrame(int sock, struct SRVHDR* hdr, int* fds, int* pnfds) {
+	char control[CMSG_SPACE(sizeof(int) * 4)];
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct iovec iov;
+	ssize_t n;
+	int i;
+
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(struct SRVHDR);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	while ((n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	*pnfds = 0;
+	for (cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : 0; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		*pnfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (fds) memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *pnfds);
+		else {
+			for (i = 0; i < *pnfds; i++) close(((int*)CMSG_DATA(cmsg))[i]);
+			*pnfds = 0;
+		}
+	}
+	if (n < 0) return -1;
+	if (n == 0) return 0;
+	if (n < (ssize_t)sizeof(struct SRVHDR)) return readFull(sock, (char*)hdr + n, sizeof(struct SRVHDR) - n) < 0 ? -1 : 1;
+	return 1;
+}
+
+int readFull(int fd, void* buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, buf, len)) <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		buf = (char*)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+//FUNCTION cachePath
+//FUNCTION loadCache
+//FUNCTION saveCache
+//FUNCTION cacheSum
+////////////////////////////////////////
+
+int cachePath(char* path, const struct stat* st) {
+	char* homedir;
+	int len;
+
+	if (!(homedir = getenv("HOME"))) return -1;
+
+	len = snprintf(path, MAX_COMLEN, "%s/.mysh_cache/%jx-%jx", homedir, (uintmax_t)st->st_dev, (uintmax_t)st->st_ino);
+	if (len < 0 || len >= MAX_COMLEN - 16) return -1;
+	return len;
+}
+
+struct PROGRAM* loadCache(const struct stat* st) {
+	char path[MAX_COMLEN];
+	struct CACHEHDR* hdr;
+	struct PROGRAM* prog;
+	struct stat cst;
+	void* map;
+	int fd;
+
+	//parsed aliases are baked into the bytecode
+	if (aliasList || cachePath(path, st) < 0) return 0;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return 0;
+	if (fstat(fd, &cst) < 0 || cst.st_size < sizeof(struct CACHEHDR)) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+	hdr = map;
+
+	if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+		hdr->dev != st->st_dev || hdr->ino != st->st_ino || hdr->size != st->st_size ||
+		hdr->mtime != st->st_mtim.tv_sec || hdr->mtimensec != st->st_mtim.tv_nsec ||
+		hdr->ncode <= 0 || hdr->nstrs < 0 || hdr->nexpr < 0 ||
+		sizeof(struct CACHEHDR) + sizeof(intmax_t) * (size_t)hdr->nexpr + sizeof(int) * (size_t)hdr->ncode +
+		hdr->nstrs != cst.st_size) {
+		goto invalid;
+	}
+
+	if (!(prog = calloc(1, sizeof(struct PROGRAM)))) goto invalid;
+	prog->expr = (intmax_t*)(hdr + 1);
+	prog->nexpr = prog->exprsize = hdr->nexpr;
+	prog->code = (int*)(prog->expr + hdr->nexpr);
+	prog->ncode = prog->codesize = hdr->ncode;
+	prog->strs = (char*)(prog->code + hdr->ncode);
+	prog->nstrs = prog->strsize = hdr->nstrs;
+	prog->refs = 1;
+	prog->map = map;
+	prog->maplen = cst.st_size;
+
+	if (prog->code[prog->ncode - 1] != OP_END || (prog->nstrs > 0 && prog->strs[prog->nstrs - 1] != 0) ||
+		cacheSum(prog) != hdr->sum) {
+		free(prog);
+		goto invalid;
+	}
+
+	return prog;
+
+invalid:
+	munmap(map, cst.st_size);
+	unlink(path);
+	return 0;
+}
+
+void saveCache(struct PROGRAM* prog, const struct stat* st) {
+	char path[MAX_COMLEN];
+	char tmp[MAX_COMLEN];
+	struct CACHEHDR hdr;
+	struct iovec iov[4];
+	ssize_t total;
+	int fd, len;
+
+	if (aliasList || prog->map || (len = cachePath(path, st)) < 0) return;
+
+	memcpy(tmp, path, len);
+	tmp[len] = 0;
+	*strrchr(tmp, '/') = 0;
+	if (mkdir(tmp, 0700) < 0 && errno != EEXIST) return;
+	if (snprintf(tmp, MAX_COMLEN, "%s.%d", path, (int)getpid()) >= MAX_COMLEN) return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.dev = st->st_dev;
+	hdr.ino = st->st_ino;
+	hdr.mtime = st->st_mtim.tv_sec;
+	hdr.mtimensec = st->st_mtim.tv_nsec;
+	hdr.size = st->st_size;
+	hdr.ncode = prog->ncode;
+	hdr.nstrs = prog->nstrs;
+	hdr.nexpr = prog->nexpr;
+	hdr.sum = cacheSum(prog);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = prog->expr;
+	iov[1].iov_len = sizeof(intmax_t) * prog->nexpr;
+	iov[2].iov_base = prog->code;
+	iov[2].iov_len = sizeof(int) * prog->ncode;
+	iov[3].iov_base = prog->strs;
+	iov[3].iov_len = prog->nstrs;
+	total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) return;
+	if (writev(fd, iov, 4) != total) total = -1;
+	if (close(fd) < 0 || total < 0 || rename(tmp, path) < 0) unlink(tmp);
+}
+
+uint32_t cacheSum(const struct PROGRAM* prog) {
+	const unsigned char* pchar = (const unsigned char*)prog->code;
+	uint32_t sum = 2166136261u;
+	size_t i, len = sizeof(int) * prog->ncode;
+
+	for (i = 0; i < len; i++) sum = (sum ^ pchar[i]) * 16777619u;
+	pchar = (const unsigned char*)prog->expr;
+	len = sizeof(intmax_t) * prog->nexpr;
+	for (i = 0; i < len; i++) sum = (sum ^ pchar[i]) * 16777619u;
+	for (i = 0; i < prog->nstrs; i++) sum = (sum ^ (unsigned char)prog->strs[i]) * 16777619u;
+	return sum;
+}
+
+////////////////////////////////////////
+//FUNCTION loadRc
+//FUNCTION mapRc
+//FUNCTION saveRc
+//FUNCTION addRecord
+//FUNCTION snapshotSum
+////////////////////////////////////////
+
+void loadRc(void) {
+	char path[MAX_COMLEN];
+	char snap[MAX_COMLEN];
+	struct PROGRAM* prog;
+	struct stat st;
+	char* homedir;
+	char* source;
+	int fd, ret;
+
+	if (!(homedir = getenv("HOME"))) return;
+	if (snprintf(path, MAX_COMLEN, "%s/.myshrc", homedir) >= MAX_COMLEN) return;
+	if (snprintf(snap, MAX_COMLEN, "%s/.mysh_cache/myshrc", homedir) >= MAX_COMLEN - 16) return;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return;
+	}
+	if (mapRc(&st, snap) == 0) {
+		close(fd);
+		return;
+	}
+
+	source = readScript(fd, path, st.st_size);
+	close(fd);
+	if (!source) return;
+	ret = parseSource(source, 1, &prog);
+	free(source);
+	if (ret != PARSE_OK || !prog) return;
+
+	//anything beyond aliases, variables, functions and the prompt keeps the rc from being snapshotted
+	rcLoading = 1;
+	rcPure = 1;
+	rcRecordLen = 0;
+	vmRun(prog, 0);
+	vmBreak = vmContinue = vmReturn = 0;
+	rcLoading = 0;
+
+	initHighlight();
+	if (rcPure) saveRc(prog, &st, snap);
+	else unlink(snap);
+	releaseProgram(prog);
+
+	free(rcRecords);
+	rcRecords = 0;
+	rcRecordLen = rcRecordSize = 0;
+}
+
+int mapRc(const struct stat* st, const char* path) {
+	struct RCHDR* hdr;
+	struct PROGRAM* prog = 0;
+	struct ALIAS* alias;
+	struct ALIAS* next;
+	struct stat sst;
+	char* argv[4];
+	char* records;
+	char* end;
+	char* name;
+	char* value;
+	int* table;
+	char* pool;
+	void* map;
+	size_t i;
+	int fd, pass;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+	if (fstat(fd, &sst) < 0 || sst.st_size < sizeof(struct RCHDR)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+	hdr = map;
+
+	if (hdr->magic != RC_MAGIC || hdr->version != RC_VERSION ||
+		hdr->dev != st->st_dev || hdr->ino != st->st_ino || hdr->size != st->st_size ||
+		hdr->mtime != st->st_mtim.tv_sec || hdr->mtimensec != st->st_mtim.tv_nsec ||
+		hdr->ncode < 0 || hdr->nstrs < 0 || hdr->nexpr < 0 || hdr->ntable < 0 || (hdr->ntable & (hdr->ntable - 1)) ||
+		hdr->npool > (size_t)sst.st_size || hdr->nrecords > (size_t)sst.st_size ||
+		sizeof(struct RCHDR) + sizeof(intmax_t) * (size_t)hdr->nexpr + sizeof(int) * ((size_t)hdr->ncode + hdr->ntable) +
+		hdr->nstrs + hdr->npool + hdr->nrecords != sst.st_size ||
+		snapshotSum(2166136261u, hdr + 1, sst.st_size - sizeof(struct RCHDR)) != hdr->sum) {
+		goto invalid;
+	}
+
+	table = (int*)((intmax_t*)(hdr + 1) + hdr->nexpr) + hdr->ncode;
+	pool = (char*)(table + hdr->ntable) + hdr->nstrs;
+	records = pool + hdr->npool;
+	end = records + hdr->nrecords;
+	if ((hdr->ncode > 0 && ((int*)((intmax_t*)(hdr + 1) + hdr->nexpr))[hdr->ncode - 1] != OP_END) ||
+		(hdr->nstrs > 0 && pool[-1] != 0) || (hdr->npool > 0 && pool[hdr->npool - 1] != 0) ||
+		(hdr->nrecords > 0 && end[-1] != 0)) {
+		goto invalid;
+	}
+
+	//the first pass only checks that the inherited environment still matches
+	for (pass = 0; pass < 2; pass++) {
+		for (name = records; name < end; name = value + strlen(value) + 1) {
+			value = name + strlen(name) + 1;
+			if (value >= end) goto invalid;
+
+			switch (*(name++)) {
+			case 'd':
+				if (pass == 0 && (!getenv(name) || strcmp(getenv(name), value) != 0)) goto stale;
+				break;
+			case 'n':
+				if (pass == 0 && getenv(name)) goto stale;
+				break;
+			case 'f':
+				if (atoi(value) >= hdr->ncode) goto invalid;
+				if (pass == 0) break;
+				if (!prog) {
+					if (!(prog = calloc(1, sizeof(struct PROGRAM)))) goto invalid;
+					prog->expr = (intmax_t*)(hdr + 1);
+					prog->nexpr = prog->exprsize = hdr->nexpr;
+					prog->code = (int*)(prog->expr + hdr->nexpr);
+					prog->ncode = prog->codesize = hdr->ncode;
+					prog->strs = (char*)(table + hdr->ntable);
+					prog->nstrs = prog->strsize = hdr->nstrs;
+					prog->refs = 1;
+					prog->map = map;
+					prog->maplen = sst.st_size;
+				}
+				defineFunction(name, prog, atoi(value));
+				break;
+			case 'a':
+				argv[0] = "alias";
+				argv[1] = name;
+				argv[2] = value;
+				argv[3] = 0;
+				if (pass == 1) mysh_alias(3, argv);
+				break;
+			case 'p':
+				argv[0] = "prompt";
+				argv[1] = value;
+				argv[2] = 0;
+				if (pass == 1) mysh_prompt(2, argv);
+				break;
+			case 'e':
+				if (pass == 1) setenv(name, value, 1);
+				//fall through
+			case 'v':
+				if (pass == 1) setVar(name, value);
+				break;
+			default:
+				goto invalid;
+			}
+		}
+	}
+
+	//aliases were saved head first, so reverse them back into definition order
+	for (alias = aliasList, aliasList = 0; alias; alias = next) {
+		next = alias->next;
+		alias->next = aliasList;
+		aliasList = alias;
+	}
+
+	if (hdr->ntable > 0 && (table = malloc(sizeof(int) * hdr->ntable)) && (pool = malloc(hdr->npool))) {
+		memcpy(table, (int*)((intmax_t*)(hdr + 1) + hdr->nexpr) + hdr->ncode, sizeof(int) * hdr->ntable);
+		memcpy(pool, records - hdr->npool, hdr->npool);
+		for (i = 0; i < hdr->ntable && (table[i] < 0 || table[i] < hdr->npool); i++);
+		if (i == hdr->ntable) {
+			free(cmdTable);
+			free(cmdPool);
+			cmdTable = table;
+			cmdTableSize = hdr->ntable;
+			cmdPool = pool;
+			cmdPoolLen = cmdPoolSize = hdr->npool;
+			nCmdIndex = hdr->nindex;
+			cmdIndexKey = hdr->cmdkey;
+		}
+		else {
+			free(table);
+			free(pool);
+		}
+	}
+	else if (hdr->ntable > 0) free(table);
+
+	if (prog) releaseProgram(prog);
+	else munmap(map, sst.st_size);
+	return 0;
+
+invalid:
+	unlink(path);
+stale:
+	munmap(map, sst.st_size);
+	return -1;
+}
+
+void saveRc(struct PROGRAM* prog, const struct stat* st, const char* path) {
+	char tmp[MAX_COMLEN];
+	char number[24];
+	struct RCHDR hdr;
+	struct ALIAS* alias;
+	struct FUNCTION* func;
+	struct VARIABLE* var;
+	struct iovec iov[7];
+	ssize_t total;
+	int i, fd, functions = 0;
+
+	strcpy(tmp, path);
+	*strrchr(tmp, '/') = 0;
+	if (mkdir(tmp, 0700) < 0 && errno != EEXIST) return;
+	if (snprintf(tmp, MAX_COMLEN, "%s.%d", path, (int)getpid()) >= MAX_COMLEN) return;
+
+	for (i = 0; i < VAR_BUCKETS; i++) {
+		for (func = funcTable[i]; func; func = func->next) {
+			if (func->prog != prog) return;
+			sprintf(number, "%d", func->pc);
+			if (addRecord('f', func->name, number) < 0) return;
+			functions = 1;
+		}
+		for (var = varTable[i]; var; var = var->next) {
+			if (strcmp(var->name, "PWD") == 0) continue;
+			if (addRecord(getenv(var->name) ? 'e' : 'v', var->name, var->value) < 0) return;
+		}
+	}
+	for (alias = aliasList; alias; alias = alias->next) {
+		if (addRecord('a', alias->alias, alias->command) < 0) return;
+	}
+	if (addRecord('p', "", prompt) < 0) return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RC_MAGIC;
+	hdr.version = RC_VERSION;
+	hdr.dev = st->st_dev;
+	hdr.ino = st->st_ino;
+	hdr.mtime = st->st_mtim.tv_sec;
+	hdr.mtimensec = st->st_mtim.tv_nsec;
+	hdr.size = st->st_size;
+	hdr.cmdkey = cmdIndexKey;
+	hdr.ncode = functions ? prog->ncode : 0;
+	hdr.nstrs = functions ? prog->nstrs : 0;
+	hdr.nexpr = functions ? prog->nexpr : 0;
+	hdr.ntable = cmdTableSize;
+	hdr.npool = cmdPoolLen;
+	hdr.nindex = nCmdIndex;
+	hdr.nrecords = rcRecordLen;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = prog->expr;
+	iov[1].iov_len = sizeof(intmax_t) * hdr.nexpr;
+	iov[2].iov_base = prog->code;
+	iov[2].iov_len = sizeof(int) * hdr.ncode;
+	iov[3].iov_base = cmdTable;
+	iov[3].iov_len = sizeof(int) * hdr.ntable;
+	iov[4].iov_base = prog->strs;
+	iov[4].iov_len = hdr.nstrs;
+	iov[5].iov_base = cmdPool;
+	iov[5].iov_len = hdr.npool;
+	iov[6].iov_base = rcRecords;
+	iov[6].iov_len = hdr.nrecords;
+	hdr.sum = 2166136261u;
+	for (i = 1, total = sizeof(hdr); i < 7; i++) {
+		hdr.sum = snapshotSum(hdr.sum, iov[i].iov_base, iov[i].iov_len);
+		total += iov[i].iov_len;
+	}
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) return;
+	if (writev(fd, iov, 7) != total) total = -1;
+	if (close(fd) < 0 || total < 0 || rename(tmp, path) < 0) unlink(tmp);
+}
+
+int addRecord(int type, const char* name, const char* value) {
+	size_t namelen = strlen(name), valuelen = strlen(value);
+	size_t len = namelen + valuelen + 3;
+	char* pchar;
+
+	if (rcRecordLen + len > rcRecordSize) {
+		if (!(pchar = realloc(rcRecords, rcRecordSize * 2 + len + 1024))) {
+			rcPure = 0;
+			return -1;
+		}
+		rcRecords = pchar;
+		rcRecordSize = rcRecordSize * 2 + len + 1024;
+	}
+	pchar = rcRecords + rcRecordLen;
+	*(pchar++) = type;
+	memcpy(pchar, name, namelen + 1);
+	memcpy(pchar + namelen + 1, value, valuelen + 1);
+	rcRecordLen += len;
+	return 0;
+}
+
+uint32_t snapshotSum(uint32_t sum, const void* data, size_t len) {
+	const unsigned char* pchar = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) sum = (sum ^ pchar[i]) * 16777619u;
+	return sum;
+}
+
+////////////////////////////////////////
+//FUNCTION initPwd
+//FUNCTION changeDir
+//FUNCTION logicalPath
+////////////////////////////////////////
+
+void initPwd(void) {
+	struct stat pst, dst;
+	char* pwd = getenv("PWD");
+
+	if (pwd && *pwd == '/' && stat(pwd, &pst) == 0 && stat(".", &dst) == 0
+		&& pst.st_dev == dst.st_dev && pst.st_ino == dst.st_ino) logicalPwd = strdup(pwd);
+	else logicalPwd = getcwd(NULL, 0);
+
+	if (logicalPwd && (setenv("PWD", logicalPwd, 1) < 0 || setVar("PWD", logicalPwd) < 0)) perror("mysh: initPwd()");
+	if ((cwdFd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) cwdFd = AT_FDCWD;
+}
+
+int changeDir(const char* path, int physical) {
+	char* target = 0;
+	char* pwd;
+	int fd;
+
+	if (!physical && logicalPwd && (target = logicalPath(path)) && chdir(target) == 0) pwd = target;
+	else {
+		free(target);
+		if (chdir(path) != 0) return -1;
+		if (!(pwd = getcwd(NULL, 0))) return -1;
+	}
+
+	fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwdFd >= 0) close(cwdFd);
+	cwdFd = fd >= 0 ? fd : AT_FDCWD;
+
+	if (logicalPwd) {
+		setenv("OLDPWD", logicalPwd, 1);
+		setVar("OLDPWD", logicalPwd);
+		free(logicalPwd);
+	}
+	logicalPwd = pwd;
+	setenv("PWD", logicalPwd, 1);
+	setVar("PWD", logicalPwd);
+	if (myshOntty) recordDir(logicalPwd);
+	return 0;
+}
+
+char* logicalPath(const char* path) {
+	char* joined;
+	char* result;
+	char* comp;
+	char* save;
+	size_t len = 0;
+
+	if (!(joined = malloc(strlen(logicalPwd) + strlen(path) + 2))) return 0;
+	if (*path == '/') strcpy(joined, path);
+	else sprintf(joined, "%s/%s", logicalPwd, path);
+	if (!(result = malloc(strlen(joined) + 2))) {
+		free(joined);
+		return 0;
+	}
+
+	for (comp = strtok_r(joined, "/", &save); comp; comp = strtok_r(0, "/", &save)) {
+		if (strcmp(comp, ".") == 0) continue;
+		if (strcmp(comp, "..") == 0) {
+			while (len > 0 && result[--len] != '/');
+			continue;
+		}
+		result[len++] = '/';
+		strcpy(result + len, comp);
+		len += strlen(comp);
+	}
+	if (len == 0) result[len++] = '/';
+	result[len] = 0;
+
+	free(joined);
+	return result;
+}
+
+////////////////////////////////////////
+//FUNCTION openDirs
+//FUNCTION initDirs
+//FUNCTION checkDirs
+//FUNCTION lockDirs
+//FUNCTION lookupDir
+//FUNCTION recordDir
+//FUNCTION forgetDir
+//FUNCTION growDirs
+//FUNCTION findDir
+//FUNCTION dirScore
+//FUNCTION dirMask
+//FUNCTION dirRecs
+//FUNCTION dirPool
+////////////////////////////////////////
+
+int openDirs(void) {
+	struct DIRDBHDR* hdr;
+	struct stat st;
+	char* homedir;
+	void* map;
+	int fd;
+
+	if (dirDb) {
+		//another shell may have rebuilt the database under a new inode
+		if (stat(dirDbPath, &st) == 0 && st.st_ino == dirDbIno) return 0;
+		munmap(dirDb, dirDbLen);
+		close(dirDbFd);
+		dirDb = 0;
+		dirDbFd = -1;
+	}
+	else {
+		if (!(homedir = getenv("HOME"))) return -1;
+		if (snprintf(dirDbPath, MAX_COMLEN, "%s/.mysh_cache", homedir) >= MAX_COMLEN - 16) return -1;
+		if (mkdir(dirDbPath, 0700) < 0 && errno != EEXIST) return -1;
+		strcat(dirDbPath, "/dirs");
+	}
+
+	if ((fd = open(dirDbPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) return -1;
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) < 0) goto error;
+	if (st.st_size < sizeof(struct DIRDBHDR)) {
+		if (initDirs(fd, DIRDB_ENTRIES, DIRDB_POOL) < 0 || fstat(fd, &st) < 0) goto error;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) goto error;
+	hdr = map;
+	if (checkDirs(hdr, st.st_size) < 0) {
+		//start over rather than trust a damaged database
+		munmap(map, st.st_size);
+		if (ftruncate(fd, 0) < 0 || initDirs(fd, DIRDB_ENTRIES, DIRDB_POOL) < 0 || fstat(fd, &st) < 0) goto error;
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) goto error;
+	}
+	flock(fd, LOCK_UN);
+
+	dirDb = map;
+	dirDbLen = st.st_size;
+	dirDbIno = st.st_ino;
+	dirDbFd = fd;
+	return 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+int initDirs(int fd, uint32_t capacity, uint64_t poolsize) {
+	struct DIRDBHDR hdr;
+	uint32_t nslots = 1;
+
+	while (nslots < capacity * 2) nslots *= 2;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DIRDB_MAGIC;
+	hdr.version = DIRDB_VERSION;
+	hdr.capacity = capacity;
+	hdr.nslots = nslots;
+	hdr.poolsize = poolsize;
+
+	if (ftruncate(fd, sizeof(hdr) + sizeof(uint32_t) * (size_t)nslots + sizeof(struct DIRREC) * (size_t)capacity + poolsize * 2) < 0) return -1;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) return -1;
+	return 0;
+}
+
+int checkDirs(const struct DIRDBHDR* hdr, size_t size) {
+	const uint32_t* slots = (const uint32_t*)(hdr + 1);
+	const struct DIRREC* recs;
+	const char* pool;
+	uint32_t i, used = 0;
+
+	if (hdr->magic != DIRDB_MAGIC || hdr->version != DIRDB_VERSION || hdr->nslots < (uint64_t)hdr->capacity * 2 ||
+		(hdr->nslots & (hdr->nslots - 1)) || hdr->nentries > hdr->capacity ||
+		hdr->poollen > hdr->poolsize || hdr->nameslen > hdr->poolsize || hdr->poolsize > UINT32_MAX ||
+		sizeof(struct DIRDBHDR) + sizeof(uint32_t) * (size_t)hdr->nslots + sizeof(struct DIRREC) * (size_t)hdr->capacity +
+		hdr->poolsize * 2 != size) {
+		return -1;
+	}
+
+	//every slot and record is dereferenced without further checks, so each one is bounded here
+	recs = (const struct DIRREC*)(slots + hdr->nslots);
+	pool = (const char*)(recs + hdr->capacity);
+	for (i = 0; i < hdr->nslots; i++) {
+		if (slots[i] > hdr->nentries) return -1;
+		if (slots[i]) used++;
+	}
+	if (used != hdr->nentries || (hdr->nameslen > 0 && pool[hdr->poolsize + hdr->nameslen - 1] != 0)) return -1;
+	for (i = 0; i < hdr->nentries; i++) {
+		if ((uint64_t)recs[i].offset + recs[i].len >= hdr->poollen || pool[recs[i].offset + recs[i].len] != 0 ||
+			recs[i].name >= hdr->nameslen) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int lockDirs(void) {
+	struct stat st;
+
+	//the lock is only good once the locked inode is still the one on disk
+	for (;;) {
+		if (openDirs() < 0) return -1;
+		flock(dirDbFd, LOCK_EX);
+		if (stat(dirDbPath, &st) == 0 && st.st_ino == dirDbIno) return 0;
+		flock(dirDbFd, LOCK_UN);
+	}
+}
+
+uint32_t lookupDir(const char* path, size_t len) {
+	uint32_t* slots = (uint32_t*)(dirDb + 1);
+	struct DIRREC* rec;
+	uint32_t hash, i;
+	size_t j;
+
+	for (j = 0, hash = 2166136261u; j < len; j++) hash = (hash ^ (unsigned char)path[j]) * 16777619u;
+	for (i = hash & (dirDb->nslots - 1); slots[i]; i = (i + 1) & (dirDb->nslots - 1)) {
+		rec = dirRecs() + slots[i] - 1;
+		if (rec->len == len && memcmp(dirPool() + rec->offset, path, len) == 0) break;
+	}
+	return i;
+}
+
+void recordDir(const char* path) {
+	struct DIRREC* recs;
+	struct DIRREC* rec;
+	uint32_t* slots;
+	uint32_t i, n;
+	const char* name;
+	char* names;
+	size_t len = strlen(path), namelen;
+
+	if (lockDirs() < 0) return;
+
+	name = len > 1 ? strrchr(path, '/') + 1 : path;
+	namelen = len - (name - path);
+
+lookup:
+	slots = (uint32_t*)(dirDb + 1);
+	recs = dirRecs();
+	i = lookupDir(path, len);
+	if ((n = slots[i])) rec = recs + n - 1;
+	else {
+		if (dirDb->nentries == dirDb->capacity || dirDb->poollen + len + 1 > dirDb->poolsize ||
+			dirDb->nameslen + namelen + 1 > dirDb->poolsize) {
+			if (growDirs(len + 1) < 0) goto done;
+			goto lookup;
+		}
+		rec = recs + dirDb->nentries;
+		rec->offset = dirDb->poollen;
+		rec->name = dirDb->nameslen;
+		rec->len = len;
+		rec->rank = 0;
+		memcpy(dirPool() + rec->offset, path, len + 1);
+
+		//names are kept lowercased so that j matches without regard to case
+		names = dirPool() + dirDb->poolsize + rec->name;
+		for (n = 0; n < namelen; n++) names[n] = tolower((unsigned char)name[n]);
+		names[namelen] = 0;
+		rec->mask = dirMask(names);
+
+		dirDb->poollen += len + 1;
+		dirDb->nameslen += namelen + 1;
+		slots[i] = ++dirDb->nentries;
+	}
+
+	rec->rank++;
+	rec->atime = time(0);
+	if (++dirDb->total > DIRDB_MAXRANK) {
+		dirDb->total = 0;
+		for (i = 0; i < dirDb->nentries; i++) {
+			recs[i].rank = recs[i].rank * 3 / 4;
+			dirDb->total += recs[i].rank;
+		}
+	}
+
+done:
+	flock(dirDbFd, LOCK_UN);
+}
+
+int forgetDir(const char* path) {
+	struct DIRREC* recs;
+	uint32_t i;
+
+	//scan rather than probe, so that j always gets past the entry it was handed
+	if (lockDirs() < 0) return -1;
+	recs = dirRecs();
+	for (i = 0; i < dirDb->nentries; i++) {
+		if (recs[i].rank == 0 || strcmp(dirPool() + recs[i].offset, path) != 0) continue;
+		dirDb->total -= recs[i].rank;
+		recs[i].rank = 0;
+	}
+	flock(dirDbFd, LOCK_UN);
+	return 0;
+}
+
+int growDirs(uint64_t extra) {
+	struct DIRDBHDR* hdr;
+	struct DIRREC* recs = dirRecs();
+	struct DIRREC* rec;
+	struct stat st;
+	char tmp[MAX_COMLEN];
+	uint32_t* slots;
+	uint32_t i, j, hash, live = 0;
+	uint64_t pool = 0;
+	char* pchar;
+	void* map;
+	int fd;
+
+	//entries aged down to zero are dropped while copying
+	for (i = 0; i < dirDb->nentries; i++) {
+		if (recs[i].rank == 0) continue;
+		live++;
+		pool += recs[i].len + 1;
+	}
+
+	if (snprintf(tmp, MAX_COMLEN, "%s.%d", dirDbPath, (int)getpid()) >= MAX_COMLEN) return -1;
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) return -1;
+	flock(fd, LOCK_EX);
+	if (initDirs(fd, live * 2 > DIRDB_ENTRIES ? live * 2 : DIRDB_ENTRIES, pool * 2 + extra > DIRDB_POOL ? pool * 2 + extra : DIRDB_POOL) < 0 ||
+		fstat(fd, &st) < 0) {
+		goto error;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) goto error;
+	hdr = map;
+	slots = (uint32_t*)(hdr + 1);
+	rec = (struct DIRREC*)(slots + hdr->nslots);
+	pchar = (char*)(rec + hdr->capacity);
+
+	for (i = 0; i < dirDb->nentries; i++) {
+		if (recs[i].rank == 0) continue;
+		*rec = recs[i];
+		rec->offset = hdr->poollen;
+		rec->name = hdr->nameslen;
+		memcpy(pchar + rec->offset, dirPool() + recs[i].offset, recs[i].len + 1);
+		strcpy(pchar + hdr->poolsize + rec->name, dirPool() + dirDb->poolsize + recs[i].name);
+		hdr->poollen += rec->len + 1;
+		hdr->nameslen += strlen(pchar + hdr->poolsize + rec->name) + 1;
+		hdr->total += rec->rank;
+
+		for (j = 0, hash = 2166136261u; j < rec->len; j++) hash = (hash ^ (unsigned char)pchar[rec->offset + j]) * 16777619u;
+		for (j = hash & (hdr->nslots - 1); slots[j]; j = (j + 1) & (hdr->nslots - 1));
+		slots[j] = ++hdr->nentries;
+		rec++;
+	}
+
+	if (rename(tmp, dirDbPath) < 0) {
+		munmap(map, st.st_size);
+		goto error;
+	}
+	munmap(dirDb, dirDbLen);
+	close(dirDbFd);
+	dirDb = map;
+	dirDbLen = st.st_size;
+	dirDbIno = st.st_ino;
+	dirDbFd = fd;
+	return 0;
+
+error:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+struct DIRREC* findDir(const char* fragment) {
+	struct DIRREC* recs = dirRecs();
+	struct DIRREC* best = 0;
+	char lower[MAX_COMLEN];
+	char* names = dirPool() + dirDb->poolsize;
+	double score, bestScore = 0;
+	time_t now = time(0);
+	uint32_t i, mask, n = dirDb->nentries;
+	size_t len = strlen(fragment);
+
+	if (len >= MAX_COMLEN) return 0;
+	for (i = 0; i <= len; i++) lower[i] = tolower((unsigned char)fragment[i]);
+	mask = dirMask(lower);
+
+	//the score and character mask are cheap, so the name itself is only searched for a possible winner
+	for (i = 0; i < n; i++) {
+		if (recs[i].rank == 0 || (score = dirScore(recs + i, now)) <= bestScore) continue;
+		if ((recs[i].mask & mask) != mask || !strstr(names + recs[i].name, lower)) continue;
+		if (logicalPwd && strcmp(dirPool() + recs[i].offset, logicalPwd) == 0) continue;
+		bestScore = score;
+		best = recs + i;
+	}
+
+	return best;
+}
+
+double dirScore(const struct DIRREC* rec, time_t now) {
+	time_t age = now - rec->atime;
+
+	if (age < 3600) return rec->rank * 4.0;
+	if (age < 86400) return rec->rank * 2.0;
+	if (age < 604800) return rec->rank * 0.5;
+	return rec->rank * 0.25;
+}
+
+uint32_t dirMask(const char* name) {
+	uint32_t mask = 0;
+
+	for (; *name; name++) {
+		if (*name >= 'a' && *name <= 'z') mask |= 1u << (*name - 'a');
+		else mask |= 1u << (26 + (unsigned char)*name % 6);
+	}
+	return mask;
+}
+
+struct DIRREC* dirRecs(void) {
+	return (struct DIRREC*)((uint32_t*)(dirDb + 1) + dirDb->nslots);
+}
+
+char* dirPool(void) {
+	return (char*)(dirRecs() + dirDb->capacity);
+}
+
+////////////////////////////////////////
+//FUNCTION requestSegments
+//FUNCTION segmentWorker
+//FUNCTION gitSegment
+//FUNCTION gitDirty
+//FUNCTION renderPrompt
+//FUNCTION readKey
+//FUNCTION openKeyLog
+//FUNCTION readByte
+//FUNCTION recordLatency
+//FUNCTION printKeyHistogram
+////////////////////////////////////////
+
+void requestSegments(void) {
+	extern char** environ;
+	struct SEGREQUEST* req;
+	struct itimerspec refresh;
+	char git[PATH_MAX];
+	const char* path;
+	const char* next;
+	pthread_t thread;
+	char* pchar;
+	size_t size;
+	int i, n, len;
+
+	if (!strstr(prompt, "\\g") && !strstr(prompt, "\\l")) return;
+	if (!logicalPwd) return;
+
+	//the worker must not touch environ or PATH while the shell may setenv, so both are resolved here
+	git[0] = 0;
+	for (path = getenv("PATH"); path && *path; path = *next ? next + 1 : next) {
+		if (!(next = strchr(path, ':'))) next = path + strlen(path);
+		if ((len = next - path) == 0 || len + 5 >= sizeof(git)) continue;
+		memcpy(git, path, len);
+		strcpy(git + len, "/git");
+		if (access(git, X_OK) == 0) break;
+		git[0] = 0;
+	}
+
+	size = sizeof(struct SEGREQUEST) + strlen(logicalPwd) + strlen(git) + sizeof("GIT_OPTIONAL_LOCKS=0") + 2;
+	for (n = 0; environ[n]; n++) size += sizeof(char*) + strlen(environ[n]) + 1;
+	size += sizeof(char*) * 2;
+	if (!(req = malloc(size))) return;
+
+	req->env = (char**)(req + 1);
+	pchar = (char*)(req->env + n + 2);
+	for (i = 0; i < n; i++) {
+		req->env[i] = pchar;
+		pchar = stpcpy(pchar, environ[i]) + 1;
+	}
+	req->env[n] = pchar;
+	pchar = stpcpy(pchar, "GIT_OPTIONAL_LOCKS=0") + 1;
+	req->env[n + 1] = 0;
+	req->pwd = pchar;
+	pchar = stpcpy(pchar, logicalPwd) + 1;
+	req->git = pchar;
+	strcpy(pchar, git);
+
+	if (!segStarted) {
+		if (pipe2(segPipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+			perror("mysh: requestSegments()");
+			free(req);
+			return;
+		}
+		if ((errno = pthread_create(&thread, NULL, segmentWorker, NULL)) != 0) {
+			perror("mysh: requestSegments()");
+			close(segPipe[0]);
+			close(segPipe[1]);
+			segPipe[0] = segPipe[1] = -1;
+			free(req);
+			return;
+		}
+		pthread_detach(thread);
+		segStarted = 1;
+		loopWatch(segPipe[0], handleSegment);
+	}
+
+	pthread_mutex_lock(&segLock);
+	free(segRequest);
+	segRequest = req;
+	pthread_cond_signal(&segCond);
+	pthread_mutex_unlock(&segLock);
+
+	if (timerFd >= 0) {
+		refresh.it_interval.tv_sec = refresh.it_interval.tv_nsec = 0;
+		refresh.it_value.tv_sec = SEGMENT_REFRESH;
+		refresh.it_value.tv_nsec = 0;
+		timerfd_settime(timerFd, 0, &refresh, 0);
+	}
+}
+
+void* segmentWorker(void* arg) {
+	struct SEGMENTS seg;
+	struct SEGREQUEST* req;
+	char* pchar;
+	ssize_t n;
+	int fd;
+
+	for (;;) {
+		pthread_mutex_lock(&segLock);
+		while (!segRequest) pthread_cond_wait(&segCond, &segLock);
+		req = segRequest;
+		segRequest = 0;
+		seg = segments;
+		pthread_mutex_unlock(&segLock);
+
+		gitSegment(&seg, req);
+		free(req);
+
+		if ((fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC)) >= 0) {
+			n = read(fd, seg.load, sizeof(seg.load) - 1);
+			close(fd);
+			seg.load[n > 0 ? n : 0] = 0;
+			if ((pchar = strchr(seg.load, ' '))) *pchar = 0;
+		}
+
+		pthread_mutex_lock(&segLock);
+		segments = seg;
+		pthread_mutex_unlock(&segLock);
+		n = write(segPipe[1], "", 1);
+	}
+
+	return arg;
+}
+
+void gitSegment(struct SEGMENTS* seg, const struct SEGREQUEST* req) {
+	char root[PATH_MAX];
+	char gitdir[PATH_MAX + 16];
+	char path[PATH_MAX + 32];
+	char head[256];
+	char* pchar;
+	struct stat st, ist, hst;
+	ssize_t n;
+	int fd;
+
+	if (snprintf(root, sizeof(root), "%s", req->pwd) >= sizeof(root)) return;
+	for (;;) {
+		snprintf(gitdir, sizeof(gitdir), "%s/.git", strcmp(root, "/") == 0 ? "" : root);
+		if (stat(gitdir, &st) == 0) break;
+		if (!(pchar = strrchr(root, '/')) || strcmp(root, "/") == 0) {
+			seg->repo[0] = seg->branch[0] = 0;
+			seg->dirty = 0;
+			return;
+		}
+		if (pchar == root) pchar++;
+		*pchar = 0;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		if ((fd = open(gitdir, O_RDONLY | O_CLOEXEC)) < 0) return;
+		n = read(fd, head, sizeof(head) - 1);
+		close(fd);
+		head[n > 0 ? n : 0] = 0;
+		if (strncmp(head, "gitdir: ", 8) != 0) return;
+		head[strcspn(head, "\n")] = 0;
+		if (head[8] == '/') snprintf(gitdir, sizeof(gitdir), "%s", head + 8);
+		else if (snprintf(gitdir, sizeof(gitdir), "%s/%s", root, head + 8) >= sizeof(gitdir)) return;
+	}
+
+	snprintf(path, sizeof(path), "%s/index", gitdir);
+	if (stat(path, &ist) != 0) memset(&ist, 0, sizeof(ist));
+	snprintf(path, sizeof(path), "%s/HEAD", gitdir);
+	if (stat(path, &hst) != 0) return;
+
+	if (strcmp(seg->repo, root) == 0
+		&& seg->index.tv_sec == ist.st_mtim.tv_sec && seg->index.tv_nsec == ist.st_mtim.tv_nsec
+		&& seg->head.tv_sec == hst.st_mtim.tv_sec && seg->head.tv_nsec == hst.st_mtim.tv_nsec) return;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return;
+	n = read(fd, head, sizeof(head) - 1);
+	close(fd);
+	head[n > 0 ? n : 0] = 0;
+	head[strcspn(head, "\n")] = 0;
+
+	if (strncmp(head, "ref: refs/heads/", 16) == 0) snprintf(seg->branch, sizeof(seg->branch), "%.*s", MAX_SEGMENT - 1, head + 16);
+	else snprintf(seg->branch, sizeof(seg->branch), "%.7s", head);
+
+	seg->dirty = gitDirty(root, req);
+	strcpy(seg->repo, root);
+	seg->index = ist.st_mtim;
+	seg->head = hst.st_mtim;
+}
+
+int gitDirty(const char* root, const struct SEGREQUEST* req) {
+	char* args[] = { "git", "-C", (char*)root, "status", "--porcelain", "--untracked-files=no", 0 };
+	char ch;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	pid_t child;
+	int i, n, pfd[2], ret;
+
+	if (!*req->git || pipe2(pfd, O_CLOEXEC) < 0) return 0;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pfd[1], 1);
+	posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGQUIT);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+	i = posix_spawn(&child, req->git, &actions, &attr, args, req->env);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(pfd[1]);
+
+	ret = 0;
+	if (i == 0) {
+		while ((n = read(pfd[0], &ch, 1)) < 0 && errno == EINTR);
+		ret = n > 0;
+		close(pfd[0]);
+		waitpid(child, NULL, 0);
+	}
+	else close(pfd[0]);
+
+	return ret;
+}
+
+int renderPrompt(char* buf, int size) {
+	char seg[PATH_MAX + 16];
+	const char* pchar;
+	const char* home = getenv("HOME");
+	size_t n;
+	int len = 0;
+
+	for (pchar = prompt; *pchar && len < size - 1; pchar++) {
+		if (*pchar != '\\' || !*(pchar + 1)) {
+			buf[len++] = *pchar;
+			continue;
+		}
+
+		*seg = 0;
+		switch (*(++pchar)) {
+		case 'w':
+			if (!logicalPwd) break;
+			n = home ? strlen(home) : 0;
+			if (n > 1 && strncmp(logicalPwd, home, n) == 0 && (logicalPwd[n] == 0 || logicalPwd[n] == '/')) {
+				snprintf(seg, sizeof(seg), "~%s", logicalPwd + n);
+			}
+			else snprintf(seg, sizeof(seg), "%s", logicalPwd);
+			break;
+		case 'W':
+			if (logicalPwd) snprintf(seg, sizeof(seg), "%s", logicalPwd[1] ? strrchr(logicalPwd, '/') + 1 : logicalPwd);
+			break;
+		case '?':
+			sprintf(seg, "%d", lastStatus);
+			break;
+		case 'd':
+			if (lastDuration >= 1000) sprintf(seg, "%lld.%llds", lastDuration / 1000, lastDuration % 1000 / 100);
+			else if (lastDuration >= 0) sprintf(seg, "%lldms", lastDuration);
+			break;
+		case 'g':
+			pthread_mutex_lock(&segLock);
+			if (*segments.branch) snprintf(seg, sizeof(seg), "(%s%s)", segments.branch, segments.dirty ? "*" : "");
+			pthread_mutex_unlock(&segLock);
+			break;
+		case 'l':
+			pthread_mutex_lock(&segLock);
+			strcpy(seg, segments.load);
+			pthread_mutex_unlock(&segLock);
+			break;
+		case '\\':
+			strcpy(seg, "\\");
+			break;
+		default:
+			seg[0] = '\\';
+			seg[1] = *pchar;
+			seg[2] = 0;
+			break;
+		}
+		for (n = 0; seg[n] && len < size - 1; n++) buf[len++] = seg[n];
+	}
+
+	buf[len] = 0;
+	return len;
+}
+
+int readKey(void) {
+	struct epoll_event ev[MAX_LOOPFDS];
+	struct LOOPFD* watch;
+	int i, n, ch, input = 0, repaint = 0;
+
+	fflush(stdout);
+	if (keyUnread >= 0) {
+		ch = keyUnread;
+		keyUnread = -1;
+		goto got_key;
+	}
+	if (loopFd < 0 || replayFile) {
+		ch = readByte();
+		goto got_key;
+	}
+
+	while (!input && !repaint) {
+		n = epoll_wait(loopFd, ev, MAX_LOOPFDS, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			watch = &loopFds[ev[i].data.u32];
+			if (!watch->func) input = 1;
+			else if (watch->func(watch->fd) > 0) repaint = 1;
+		}
+	}
+	if (repaint) return KEY_REPAINT;
+	ch = readByte();
+
+got_key:
+	clock_gettime(CLOCK_MONOTONIC, &keyStart);
+	keyPending = 1;
+	return ch;
+}
+
+int openKeyLog(const char* mode, const char* path) {
+	struct winsize wsz;
+	char line[64];
+
+	if (strcmp(mode, "record") == 0) {
+		if (!(recordFile = fopen(path, "we"))) goto syscall_error;
+		setvbuf(recordFile, NULL, _IOLBF, 0);
+		if (ioctl(0, TIOCGWINSZ, &wsz) < 0 || wsz.ws_col == 0) wsz.ws_col = 80;
+		fprintf(recordFile, "# mysh keys cols=%d\n", wsz.ws_col);
+		clock_gettime(CLOCK_MONOTONIC, &recordStart);
+		return 0;
+	}
+
+	if (!(replayFile = fopen(path, "re"))) goto syscall_error;
+	if (fgets(line, sizeof(line), replayFile) && sscanf(line, "# mysh keys cols=%d", &replayCols) == 1) return 0;
+	fprintf(stderr, "mysh: %s: not a key recording\n", path);
+	fclose(replayFile);
+	replayFile = 0;
+	return -1;
+
+syscall_error:
+	fprintf(stderr, "mysh: %s: %s\n", path, strerror(errno));
+	return -1;
+}
+
+int readByte(void) {
+	struct timespec now;
+	long long usec;
+	int ch;
+
+	if (replayFile) {
+		if (fscanf(replayFile, "%lld %d", &usec, &ch) != 2) return EOF;
+		return ch;
+	}
+
+	ch = getchar();
+	if (recordFile && ch != EOF) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usec = (now.tv_sec - recordStart.tv_sec) * 1000000LL + (now.tv_nsec - recordStart.tv_nsec) / 1000;
+		fprintf(recordFile, "%lld %d\n", usec, ch);
+	}
+	return ch;
+}
+
+void recordLatency(void) {
+	struct timespec now;
+	long long usec;
+	int i;
 
-	return count;
-}
+	if (!keyPending || !replayFile) return;
+	keyPending = 0;
 
-int checkAlias(char* command) {
-	char* pchar;
-	char* aliasCommand;
-	char* tmp;
-	struct ALIAS* alias;
-	int len, aliaslen;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - keyStart.tv_sec) * 1000000LL + (now.tv_nsec - keyStart.tv_nsec) / 1000;
+	for (i = 0; i < KEYHIST_BUCKETS - 1 && usec >= (2LL << i); i++);
 
-	pchar = command;
-	while (*pchar == ' ' || *pchar == '\t') pchar++;
-	strcpy(command, pchar);
+	keyHist[i]++;
+	keyCount++;
+	keyTotal += usec;
+	if (usec > keyMax) keyMax = usec;
+}
 
-	pchar = command;
-	while (*pchar != ' '&& *pchar != '\t' && *pchar != 0) pchar++;
-	len = pchar - command;
+void printKeyHistogram(void) {
+	unsigned long peak = 1, seen = 0;
+	int i, first = 0, last = 0, bar;
 
-	alias = aliasList;
-	while (alias) {
-		if (strlen(alias->alias) == len && strncmp(alias->alias, command, len) == 0) {
-			break;
-		}
-		alias = alias->next;
+	for (i = 0; i < KEYHIST_BUCKETS; i++) {
+		if (keyHist[i] == 0) continue;
+		if (seen == 0) first = i;
+		last = i;
+		seen += keyHist[i];
+		if (keyHist[i] > peak) peak = keyHist[i];
 	}
 
-	if (alias) {
-		aliasCommand = alias->command;
-		if ((aliaslen = strlen(aliasCommand)) + strlen(command) - len < MAX_COMLEN) {
-			tmp = strdup(pchar);
-			if (!tmp) {
-				perror("mysh: checkAlias()");
-				return -1;
-			}
-			strcpy(command, aliasCommand);
-			strcpy(command + aliaslen, tmp);
-			free(tmp);
-			return 1;
-		}
-		else {
-			fprintf(stderr, "mysh: command is too long\n");
-			return -1;
-		}
-	}
+	fprintf(stderr, "replay: %lu keys, mean %lld us, max %lld us\n", keyCount, keyCount ? keyTotal / (long long)keyCount : 0, keyMax);
+	if (seen == 0) return;
 
-	return 0;
+	for (i = first; i <= last; i++) {
+		fprintf(stderr, "%8lld us %8lu ", i == 0 ? 0 : 1LL << i, keyHist[i]);
+		for (bar = (keyHist[i] * 40 + peak - 1) / peak; bar > 0; bar--) fputc('#', stderr);
+		fputc('\n', stderr);
+	}
 }
 
 ////////////////////////////////////////
-//FUNCTION commandToArgs
-//FUNCTION expandArgs
+//FUNCTION initLoop
+//FUNCTION loopWatch
+//FUNCTION handleSignal
+//FUNCTION handleTimer
+//FUNCTION handleSegment
+//FUNCTION addJob
+//FUNCTION reapJobs
 ////////////////////////////////////////
 
-int commandToArgs(char* command, char* command_args[]) {
-	int pargs = 0;
-	char* pchar = command;
+void initLoop(void) {
+	sigset_t mask;
 
-	while (*pchar != 0) {
-		while (*pchar == ' ' || *pchar == '\t') *(pchar++) = 0;
-		if (*pchar == 0) break;
+	if ((loopFd = epoll_create1(EPOLL_CLOEXEC)) < 0) goto syscall_error;
 
-		if (pargs < MAX_ARGLEN - 1) command_args[pargs++] = pchar;
-		else return -1;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGWINCH);
+	if (sigprocmask(SIG_BLOCK, &mask, &loopMask) < 0) goto syscall_error;
+	if ((sigFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) goto syscall_error;
+	if ((timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) goto syscall_error;
 
-		while (*pchar != 0 && *pchar != ' ' && *pchar != '\t') pchar++;
-	}
-	command_args[pargs] = 0;
+	if (loopWatch(0, 0) < 0) goto syscall_error;
+	if (loopWatch(sigFd, handleSignal) < 0) goto syscall_error;
+	if (loopWatch(timerFd, handleTimer) < 0) goto syscall_error;
+	return;
 
-	return pargs;
+syscall_error:
+	perror("mysh: initLoop()");
+	if (loopFd >= 0) close(loopFd);
+	loopFd = -1;
 }
 
-int expandArgs(char* command_args[], char* expanded_args[]) {
-	int len = 0;
-	char* pchar;
+int loopWatch(int fd, loopfunc func) {
+	struct epoll_event ev;
 
-	foreground = 1;
+	if (loopFd < 0 || nLoopFds >= MAX_LOOPFDS) return -1;
 
-	while (*command_args) {
-		if ((haveChar(*command_args, '*') || haveChar(*command_args, '?')) && !haveChar(*command_args, '/')) {
-			DIR* pd;
-			struct dirent* files;
-			char* cwd;
-			int count = 0;
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.u32 = nLoopFds;
+	if (epoll_ctl(loopFd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
 
-			cwd = getcwd(NULL, 0);
-			if (!cwd) goto syscall_error;
-			pd = opendir(cwd);
-			if (!pd) {
-				free(cwd);
-				goto syscall_error;
-			}
+	loopFds[nLoopFds].fd = fd;
+	loopFds[nLoopFds++].func = func;
+	return 0;
+}
 
-			while ((files = readdir(pd))) {
-				if (fnmatch(*command_args, files->d_name, FNM_PERIOD) != 0) continue;
-				else count++;
+int handleSignal(int fd) {
+	struct signalfd_siginfo si;
+	int repaint = 0;
 
-				if (!(pchar = strdup(files->d_name))) {
-					closedir(pd);
-					free(cwd);
-					goto syscall_error;
-				}
-				if (len < MAX_ARGLEN - 1) expanded_args[len++] = pchar;
-				else {
-					free(pchar);
-					closedir(pd);
-					free(cwd);
-					fprintf(stderr, "mysh: too many argument\n");
-					goto error;
-				}
-			}
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGCHLD && reapJobs(1) > 0) repaint = 1;
+		else if (si.ssi_signo == SIGWINCH) repaint = 1;
+	}
 
-			closedir(pd);
-			free(cwd);
+	return repaint;
+}
 
-			if (count == 0) {
-				if (!(pchar = strdup(*command_args))) goto syscall_error;
-				if (len < MAX_ARGLEN - 1) expanded_args[len++] = pchar;
-				else {
-					free(pchar);
-					fprintf(stderr, "mysh: too many argument\n");
-					goto error;
-				}
-			}
-		} //if ((haveChar(*command_args, '*') || haveChar(*command_args, '?')) && !haveChar(*command_args, '/'))
-		else if (*(*command_args) == '~') {
-			char* homedir;
+int handleTimer(int fd) {
+	uint64_t expired;
 
-			if ((*(*command_args + 1) == 0 || *(*command_args + 1) == '/') && (homedir = getenv("HOME"))) {
-				if (!(pchar = malloc(strlen(homedir) + strlen(*command_args + 1) + 1))) {
-					fprintf(stderr, "mysh: expandArgs(): malloc failed\n");
-					goto error;
-				}
-				strcpy(pchar, homedir);
-				strcat(pchar, *command_args + 1);
-			}
-			else if (!(pchar = strdup(*command_args))) goto syscall_error;
+	if (read(fd, &expired, sizeof(expired)) == sizeof(expired)) requestSegments();
+	return 0;
+}
 
-			if (len < MAX_ARGLEN - 1) expanded_args[len++] = pchar;
-			else {
-				free(pchar);
-				fprintf(stderr, "mysh: too many argument\n");
-				goto error;
-			}
-		} //else if (*(*command_args) == '~')
-		else if (strcmp(*command_args, "&") == 0) {
-			if (len == 0 || *(command_args + 1) != 0) {
-				fprintf(stderr, "mysh: syntax error \'&\'\n");
-				goto error;
-			}
-			else foreground = 0;
-		} //else if (strcmp(*command_args, "&") == 0)
-		else {
-			if (!(pchar = strdup(*command_args))) goto syscall_error;
-			if (len < MAX_ARGLEN - 1) expanded_args[len++] = pchar;
-			else {
-				free(pchar);
-				fprintf(stderr, "mysh: too many argument\n");
-				goto error;
-			}
-		} //else
-		command_args++;
-	} //while (*command_args)
-	expanded_args[len] = 0;
+int handleSegment(int fd) {
+	char buf[64];
 
-	return len;
+	while (read(fd, buf, sizeof(buf)) > 0);
+	return 1;
+}
 
-syscall_error:
-	perror("mysh: expandArgs()");
-error:
-	while (len > 0) {
-		free(expanded_args[--len]);
+void addJob(pid_t pid) {
+	struct JOB** pjob;
+	struct JOB* job;
+	int id = 1;
+
+	for (pjob = &jobList; *pjob; pjob = &(*pjob)->next) {
+		if ((*pjob)->id >= id) id = (*pjob)->id + 1;
 	}
-	return -1;
+	if (!(job = malloc(sizeof(struct JOB)))) {
+		perror("mysh: addJob()");
+		return;
+	}
+	job->pid = pid;
+	job->id = id;
+	job->next = 0;
+	*pjob = job;
+
+	fprintf(stderr, "[%d] %d\n", id, (int)pid);
 }
 
-////////////////////////////////////////
-//FUNCTION checkInternal
-////////////////////////////////////////
+int reapJobs(int atPrompt) {
+	struct JOB** pjob;
+	struct JOB* job;
+	pid_t pid;
+	int stat, n = 0;
 
-int checkInternal(char* name) {
-	int index;
-	for (index = 0; index < nCommands; index++) {
-		if (strcmp(commands[index].name, name) == 0) return index;
+	while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+		for (pjob = &jobList; *pjob && (*pjob)->pid != pid; pjob = &(*pjob)->next);
+		if (!(job = *pjob)) continue;
+		*pjob = job->next;
+
+		if (atPrompt && n == 0) {
+			fflush(stdout);
+			fputs("\r\033[K", stderr);
+		}
+		if (WIFSIGNALED(stat)) fprintf(stderr, "[%d]  %s  %d\n", job->id, strsignal(WTERMSIG(stat)), (int)pid);
+		else if (WEXITSTATUS(stat) != 0) fprintf(stderr, "[%d]  Exit %d  %d\n", job->id, WEXITSTATUS(stat), (int)pid);
+		else fprintf(stderr, "[%d]  Done  %d\n", job->id, (int)pid);
+		free(job);
+		n++;
 	}
-	return -1;
+
+	return n;
 }
 
 ////////////////////////////////////////
-//FUNCTION internalCommands
-//FUNCTION externalCommands
+//FUNCTION initHighlight
+//FUNCTION buildCommandIndex
+//FUNCTION indexCommand
+//FUNCTION findCommand
+//FUNCTION commandClass
+//FUNCTION highlightLine
+//FUNCTION highlightWord
+//FUNCTION putHighlighted
 ////////////////////////////////////////
 
-int internalCommands(int index, int argc, char* command_args[]) {
-	if (!foreground) {
-		pid_t child;
+void initHighlight(void) {
+	struct stat st;
+	char dir[PATH_MAX];
+	const char* path = getenv("PATH");
+	const char* pchar;
+	const char* next;
+	unsigned long key = 5381;
+	int len;
+
+	hlCache[hlCur].len = 0;
+	if (!hlEnabled) return;
+
+	if (!path) path = "";
+	for (pchar = path; *pchar; pchar++) key = key * 33 + (unsigned char)*pchar;
+	for (pchar = path; *pchar; pchar = *next ? next + 1 : next) {
+		if (!(next = strchr(pchar, ':'))) next = pchar + strlen(pchar);
+		if ((len = next - pchar) == 0 || len >= sizeof(dir) || *pchar != '/') continue;
+		memcpy(dir, pchar, len);
+		dir[len] = 0;
+		if (stat(dir, &st) == 0) key = key * 33 + st.st_ino + st.st_mtim.tv_sec * 1000000007UL + st.st_mtim.tv_nsec;
+	}
 
-		child = fork();
-		if (child == -1) return -1;
-		else if (child == 0) {
-			if (myshOntty) resetSignal();
-			exit(commands[index].func(argc, command_args));
+	if (cmdTable && key == cmdIndexKey) return;
+	cmdIndexKey = key;
+	buildCommandIndex(path);
+}
+
+void buildCommandIndex(const char* path) {
+	struct stat st;
+	struct dirent* entry;
+	char dir[PATH_MAX];
+	const char* next;
+	DIR* pd;
+	int i, fd, len;
+
+	nCmdIndex = 0;
+	cmdPoolLen = 0;
+	for (i = 0; i < cmdTableSize; i++) cmdTable[i] = -1;
+
+	for (; *path; path = *next ? next + 1 : next) {
+		if (!(next = strchr(path, ':'))) next = path + strlen(path);
+		if ((len = next - path) == 0 || len >= sizeof(dir) || *path != '/') continue;
+		memcpy(dir, path, len);
+		dir[len] = 0;
+
+		if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) continue;
+		if (!(pd = fdopendir(fd))) {
+			close(fd);
+			continue;
 		}
+		while ((entry = readdir(pd))) {
+			if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+			if (entry->d_type != DT_REG && (fstatat(fd, entry->d_name, &st, 0) != 0 || S_ISDIR(st.st_mode))) continue;
+			if (faccessat(fd, entry->d_name, X_OK, AT_EACCESS) != 0) continue;
+			if (indexCommand(entry->d_name, strlen(entry->d_name)) < 0) break;
+		}
+		closedir(pd);
+	}
+}
 
-		return 0;
+int indexCommand(const char* name, int len) {
+	unsigned int hash = 5381;
+	int* table;
+	char* pool;
+	int i, size;
+
+	if (findCommand(name, len)) return 0;
+
+	if ((nCmdIndex + 1) * 2 > cmdTableSize) {
+		size = cmdTableSize ? cmdTableSize * 2 : 1024;
+		if (!(table = malloc(sizeof(int) * size))) return -1;
+		for (i = 0; i < size; i++) table[i] = -1;
+		for (i = 0; i < cmdTableSize; i++) {
+			if (cmdTable[i] < 0) continue;
+			for (pool = cmdPool + cmdTable[i], hash = 5381; *pool; pool++) hash = hash * 33 + (unsigned char)*pool;
+			while (table[hash & (size - 1)] >= 0) hash++;
+			table[hash & (size - 1)] = cmdTable[i];
+		}
+		free(cmdTable);
+		cmdTable = table;
+		cmdTableSize = size;
+		hash = 5381;
+	}
+	if (cmdPoolLen + len + 1 > cmdPoolSize) {
+		if (!(pool = realloc(cmdPool, cmdPoolSize * 2 + len + 4096))) return -1;
+		cmdPool = pool;
+		cmdPoolSize = cmdPoolSize * 2 + len + 4096;
 	}
-	else return commands[index].func(argc, command_args);
+
+	for (i = 0; i < len; i++) hash = hash * 33 + (unsigned char)name[i];
+	while (cmdTable[hash & (cmdTableSize - 1)] >= 0) hash++;
+	cmdTable[hash & (cmdTableSize - 1)] = cmdPoolLen;
+	memcpy(cmdPool + cmdPoolLen, name, len);
+	cmdPool[cmdPoolLen + len] = 0;
+	cmdPoolLen += len + 1;
+	nCmdIndex++;
+	return 0;
 }
 
-int externalCommands(int argc, char* command_args[]) {
-	pid_t child;
-	int stat;
-	char* errstr;
+int findCommand(const char* name, int len) {
+	unsigned int hash = 5381;
+	int i, off;
 
-	child = fork();
-	if (child == -1) return -1;
-	else if (child == 0) {
-		if (myshOntty) resetSignal();
-		execvp(command_args[0], command_args);
-		errstr = strerror(errno);
-		fprintf(stderr, "mysh: %s: %s\n", command_args[0], errstr);
-		exit(0);
+	if (cmdTableSize == 0) return 0;
+	for (i = 0; i < len; i++) hash = hash * 33 + (unsigned char)name[i];
+	while ((off = cmdTable[hash & (cmdTableSize - 1)]) >= 0) {
+		if (strncmp(cmdPool + off, name, len) == 0 && cmdPool[off + len] == 0) return 1;
+		hash++;
 	}
+	return 0;
+}
 
-	if (foreground) waitpid(child, &stat, 0);
+int commandClass(const char* word, int len) {
+	struct ALIAS* alias;
+	struct stat st;
+	char name[MAX_VARNAME];
 
-	return 0;
+	if (len >= MAX_VARNAME) return HL_UNKNOWN;
+	memcpy(name, word, len);
+	name[len] = 0;
+
+	if (memchr(name, '/', len)) {
+		if (fstatat(cwdFd, name, &st, 0) == 0 && !S_ISDIR(st.st_mode) && faccessat(cwdFd, name, X_OK, AT_EACCESS) == 0) return HL_COMMAND;
+		return HL_UNKNOWN;
+	}
+	for (alias = aliasList; alias; alias = alias->next) {
+		if (strcmp(alias->alias, name) == 0) return HL_ALIAS;
+	}
+	if (findFunction(name)) return HL_ALIAS;
+	if (checkInternal(name) >= 0) return HL_BUILTIN;
+	if (findCommand(name, len)) return HL_COMMAND;
+	return HL_UNKNOWN;
 }
 
-////////////////////////////////////////
-//FUNCTION initHistoryQueue
-//FUNCTION queueHistoryQueue
-//FUNCTION checkHistoryQueue
-//FUNCTION saveHistoryQueue
-////////////////////////////////////////
+const unsigned char* highlightLine(const char* text, int len) {
+	struct HIGHLIGHT* old = &hlCache[hlCur];
+	struct HIGHLIGHT* hl = &hlCache[!hlCur];
+	char* pchar;
+	int i, j, k, end, start, state, cls, prefix = 0, suffix = 0;
+
+	if (!hlEnabled) return 0;
+	if (len + 1 > hl->size) {
+		if (!(pchar = realloc(hl->text, (len + 256) * 3))) return 0;
+		hl->text = pchar;
+		hl->cls = (unsigned char*)pchar + len + 256;
+		hl->state = hl->cls + len + 256;
+		hl->size = len + 256;
+	}
 
-void initHistoryQueue(void) {
-	FILE* hf;
-	char command[MAX_COMLEN];
-	char* homedir;
-	int ch, pcommand;
+	if (old->text) {
+		while (prefix < len && prefix < old->len && text[prefix] == old->text[prefix]) prefix++;
+		while (suffix < len - prefix && suffix < old->len - prefix && text[len - 1 - suffix] == old->text[old->len - 1 - suffix]) suffix++;
+	}
+	if (old->text && prefix == len && len == old->len) return old->cls;
 
-	homedir = getenv("HOME");
-	if (!homedir) return;
+	for (start = prefix > 0 ? prefix - 1 : 0; start > 0 && old->state[start] == HS_NONE; start--);
+	if (start > 0) {
+		memcpy(hl->cls, old->cls, start);
+		memcpy(hl->state, old->state, start);
+		state = old->state[start];
+	}
+	else state = HS_COMMAND;
 
-	if (snprintf(command, MAX_COMLEN, "%s/.mysh_history", homedir) < 0) return;
-	if ((hf = fopen(command, "r")) == NULL) return;
+	for (i = start;; i = end) {
+		j = i - len + old->len;
+		if (old->text && i >= len - suffix && i > prefix && j >= 0 && old->state[j] == state) {
+			memcpy(hl->cls + i, old->cls + j, len - i);
+			memcpy(hl->state + i, old->state + j, len - i + 1);
+			break;
+		}
+		hl->state[i] = state;
+		if (i >= len) break;
 
-	pcommand = 0;
-	while ((ch = fgetc(hf)) != EOF && pcommand < MAX_COMLEN) {
-		if (ch == '\n') {
-			if (pcommand == 0) continue;
-			command[pcommand] = 0;
-			queueHistoryQueue(command);
-			pcommand = 0;
+		end = i + 1;
+		hl->cls[i] = HL_NONE;
+		if (text[i] == ' ' || text[i] == '\t') continue;
+
+		if (text[i] == '#') {
+			for (; end < len; end++) hl->cls[end] = HL_NONE;
 		}
-		else command[pcommand++] = ch;
+		else if (strchr("|&;()<>", text[i])) {
+			if (end < len && text[end] == text[i] && strchr("|&;<>", text[i])) end++;
+			else if (end < len && (text[i] == '<' || text[i] == '>') && strchr("&>|", text[end])) end++;
+			hl->cls[end - 1] = HL_NONE;
+			if (text[i] == '<' || text[i] == '>') state = HS_TARGET | (state & HS_COMMAND);
+			else if (text[i] == ')') state = 0;
+			else state = HS_COMMAND;
+		}
+		else {
+			end = highlightWord(text, i, len, hl->cls);
+			for (k = i; k < end && isdigit((unsigned char)text[k]); k++);
+			if (k == end && end < len && (text[end] == '<' || text[end] == '>')) cls = -1;
+			else if (state & HS_TARGET) state &= ~HS_TARGET;
+			else if (state & HS_NAME) state = 0;
+			else if (state & HS_COMMAND) {
+				for (k = i; k < end && (isalnum((unsigned char)text[k]) || text[k] == '_'); k++);
+				if (k > i && k < end && text[k] == '=' && !isdigit((unsigned char)text[i])) cls = -1;
+				else {
+					for (k = 0; k < sizeof(hlKeywords) / sizeof(char*); k++) {
+						if (strlen(hlKeywords[k]) == end - i && strncmp(hlKeywords[k], text + i, end - i) == 0) break;
+					}
+					if (k < sizeof(hlKeywords) / sizeof(char*)) {
+						cls = HL_KEYWORD;
+						if (strcmp(hlKeywords[k], "for") == 0 || strcmp(hlKeywords[k], "case") == 0 || strcmp(hlKeywords[k], "function") == 0) state = HS_NAME;
+						else if (strcmp(hlKeywords[k], "fi") == 0 || strcmp(hlKeywords[k], "done") == 0
+							|| strcmp(hlKeywords[k], "esac") == 0 || strcmp(hlKeywords[k], "}") == 0) state = 0;
+					}
+					else {
+						for (k = i; k < end && !strchr("\\'\"$`*?[", text[k]); k++);
+						cls = k == end ? commandClass(text + i, end - i) : -1;
+						state = 0;
+					}
+					for (k = i; cls >= 0 && k < end; k++) hl->cls[k] = cls;
+				}
+			}
+		}
+		for (k = i + 1; k < end; k++) hl->state[k] = HS_NONE;
 	}
 
-	fclose(hf);
+	memcpy(hl->text, text, len);
+	hl->len = len;
+	hlCur = !hlCur;
+	return hl->cls;
 }
 
-void queueHistoryQueue(char* command) {
-	char* pchar;
-	int num;
+int highlightWord(const char* text, int i, int len, unsigned char* cls) {
+	int depth;
+	char quote, open;
 
-	if ((pchar = strdup(command)) == NULL) {
-		perror("mysh: queueHistoryQueue()");
-		return;
+	while (i < len && !strchr(" \t|&;()<>", text[i])) {
+		cls[i] = HL_NONE;
+		switch (text[i]) {
+		case '\\':
+			if (++i < len) cls[i++] = HL_NONE;
+			break;
+		case '\'':
+		case '"':
+			quote = text[i];
+			cls[i++] = HL_STRING;
+			while (i < len && text[i] != quote) {
+				if (quote == '"' && text[i] == '\\' && i + 1 < len) cls[i++] = HL_STRING;
+				cls[i++] = HL_STRING;
+			}
+			if (i < len) cls[i++] = HL_STRING;
+			break;
+		case '$':
+			i++;
+			if (i < len && (text[i] == '(' || text[i] == '{')) {
+				open = text[i];
+				quote = open == '(' ? ')' : '}';
+				for (depth = 0; i < len; i++) {
+					cls[i] = HL_NONE;
+					if (text[i] == open) depth++;
+					else if (text[i] == quote && --depth == 0) break;
+				}
+				if (i < len) cls[i++] = HL_NONE;
+			}
+			break;
+		case '*':
+		case '?':
+		case '[':
+		case ']':
+			cls[i++] = HL_GLOB;
+			break;
+		default:
+			i++;
+			break;
+		}
 	}
 
-	if (nHistoryQueue == 0) num = 1;
-	else num = historyQueue[(startHistoryQueue + nHistoryQueue - 1) % MAX_HISTORIES].num + 1;
+	return i;
+}
 
-	if (nHistoryQueue < MAX_HISTORIES) {
-		historyQueue[(startHistoryQueue + nHistoryQueue) % MAX_HISTORIES].command = pchar;
-		historyQueue[(startHistoryQueue + nHistoryQueue) % MAX_HISTORIES].num = num;
-		nHistoryQueue++;
-	}
-	else {
-		free(historyQueue[startHistoryQueue].command);
-		historyQueue[startHistoryQueue].command = pchar;
-		historyQueue[startHistoryQueue].num = num;
-		startHistoryQueue = (startHistoryQueue + 1) == MAX_HISTORIES ? 0 : (startHistoryQueue + 1);
+void putHighlighted(const char* text, const unsigned char* cls, int from, int to) {
+	int i, cur = HL_NONE;
+
+	for (i = from; i < to; i++) {
+		if (cls && cls[i] != cur) {
+			cur = cls[i];
+			fputs(hlColors[cur], stdout);
+		}
+		putchar(text[i]);
 	}
+	if (cur != HL_NONE) fputs(hlColors[HL_NONE], stdout);
 }
 
-int checkHistoryQueue(int num, char* string, int len) {
-	if (nHistoryQueue == 0) return -1;
+////////////////////////////////////////
+//FUNCTION utf8Decode
+//FUNCTION charWidth
+//FUNCTION displayWidth
+//FUNCTION nextChar
+//FUNCTION prevChar
+////////////////////////////////////////
 
-	if (num > 0) {
-		int startnum;
+int utf8Decode(const char* text, int len, int* pcp) {
+	const unsigned char* p = (const unsigned char*)text;
+	int i, n, cp;
 
-		startnum = historyQueue[startHistoryQueue].num;
-		if (num >= startnum && num < startnum + nHistoryQueue) {
-			return (startHistoryQueue + (num - startnum)) % MAX_HISTORIES;
-		}
+	*pcp = p[0];
+	if (p[0] < 0xC2 || p[0] > 0xF4) return 1;
+
+	n = p[0] < 0xE0 ? 2 : p[0] < 0xF0 ? 3 : 4;
+	if (n > len) return 1;
+
+	cp = p[0] & (0x7F >> n);
+	for (i = 1; i < n; i++) {
+		if ((p[i] & 0xC0) != 0x80) return 1;
+		cp = cp << 6 | (p[i] & 0x3F);
 	}
-	else if (num < 0) {
-		if (nHistoryQueue + num >= 0) {
-			return (startHistoryQueue + nHistoryQueue + num) % MAX_HISTORIES;
+	*pcp = cp;
+	return n;
+}
+
+int charWidth(int cp) {
+	const struct WIDTHRANGE* table = widthZero;
+	int lo, hi, mid, n = nWidthZero, width = 0;
+
+	if (cp < 0x300) return 1;
+
+	for (;;) {
+		lo = 0;
+		hi = n - 1;
+		while (lo <= hi) {
+			mid = (lo + hi) / 2;
+			if (cp < table[mid].first) hi = mid - 1;
+			else if (cp > table[mid].last) lo = mid + 1;
+			else return width;
 		}
+		if (table == widthWide) return 1;
+		table = widthWide;
+		n = nWidthWide;
+		width = 2;
 	}
-	else if (string && len>0) {
-		int i;
+}
 
-		for (i = nHistoryQueue - 1; i >= 0; i--) {
-			if (strncmp(historyQueue[(startHistoryQueue + i) % MAX_HISTORIES].command, string, len) == 0) {
-				return (startHistoryQueue + i) % MAX_HISTORIES;
-			}
+int displayWidth(const char* text, int len) {
+	int i, cp, width = 0;
+
+	for (i = 0; i < len;) {
+		if ((unsigned char)text[i] < 0x80) {
+			width++;
+			i++;
+			continue;
 		}
+		i += utf8Decode(text + i, len - i, &cp);
+		width += charWidth(cp);
 	}
 
-	return -1;
+	return width;
 }
 
-void saveHistoryQueue(void) {
-	FILE* hf;
-	char command[MAX_COMLEN];
-	char* homedir;
-	int i;
-
-	homedir = getenv("HOME");
-	if (!homedir) return;
-
-	if (snprintf(command, MAX_COMLEN, "%s/.mysh_history", homedir) < 0) return;
-	if ((hf = fopen(command, "w")) == NULL) return;
+int nextChar(const char* text, int len, int pos) {
+	int n, cp;
 
-	for (i = 0; i < nHistoryQueue; i++) {
-		fprintf(hf, "%s\n", historyQueue[(startHistoryQueue + i) % MAX_HISTORIES].command);
-		free(historyQueue[(startHistoryQueue + i) % MAX_HISTORIES].command);
+	pos += utf8Decode(text + pos, len - pos, &cp);
+	while (pos < len) {
+		n = utf8Decode(text + pos, len - pos, &cp);
+		if (charWidth(cp) != 0) break;
+		pos += n;
 	}
 
-	fclose(hf);
+	return pos;
 }
 
-////////////////////////////////////////
-//FUNCTION freeAliasList
-////////////////////////////////////////
+int prevChar(const char* text, int pos) {
+	int start, cp;
 
-void freeAliasList(void) {
-	struct ALIAS* alias = aliasList;
-	struct ALIAS* next;
-	while (alias) {
-		next = alias->next;
-		free(alias->alias);
-		free(alias->command);
-		free(alias);
-		alias = next;
+	while (pos > 0) {
+		for (start = pos - 1; start > 0 && pos - start < 4 && (text[start] & 0xC0) == 0x80; start--);
+		if (utf8Decode(text + start, pos - start, &cp) != pos - start) {
+			start = pos - 1;
+			cp = (unsigned char)text[start];
+		}
+		pos = start;
+		if (charWidth(cp) != 0) break;
 	}
+
+	return pos;
 }
 
 ////////////////////////////////////////
@@ -1181,13 +9547,34 @@ void freeAliasList(void) {
 ////////////////////////////////////////
 
 void exitShell(int exitcode) {
+	struct JOB* job;
+
+	if (vmForked) {
+		fflush(stdout);
+		_exit(exitcode);
+	}
 	if (myshOntty) {
-		saveHistoryQueue();
+		if (termRaw) resetTerm();
+		if (replayFile) printKeyHistogram();
+		else saveHistoryQueue();
 	}
+	if (recordFile) fclose(recordFile);
 	freeAliasList();
+	freeVarTable();
+	freeFunctions();
+	while (nFrames > 0) popFrame();
+	free(frames);
+	free(readBuf);
 	while (pDirStack > 0) {
 		free(dirStack[--pDirStack]);
 	}
+	free(dirStack);
+	free(logicalPwd);
+	while (jobList) {
+		job = jobList->next;
+		free(jobList);
+		jobList = job;
+	}
 	exit(exitcode);
 }
 
@@ -1201,58 +9588,94 @@ int haveChar(char* string, char ch) {
 
 int redrawCommand(char* command, int len, int cursor, int s) {
 	struct winsize wsz;
-	int ret, i, commandlen;
+	char rendered[MAX_PROMPTBUF];
+	const char* curPrompt = ">";
+	const unsigned char* cls;
+	int ret, i, end, width, commandlen, promptlen;
+
+	if (!promptCont) {
+		renderPrompt(rendered, MAX_PROMPTBUF);
+		curPrompt = rendered;
+	}
 
 	ret = ioctl(0, TIOCGWINSZ, &wsz);
-	if (ret < 0) return s;
+	if (replayFile) wsz.ws_col = replayCols;
+	else if (ret < 0) return s;
 
-	commandlen = wsz.ws_col - strlen(prompt) - 2; //in freebsd, .. -3;
+	promptlen = strlen(curPrompt);
+	commandlen = wsz.ws_col - displayWidth(curPrompt, promptlen) - 2; //in freebsd, .. -3;
+	cls = highlightLine(command, len);
 
 	if (commandlen > 0) {
-		if (commandlen >= len) {
+		width = displayWidth(command, len);
+		if (commandlen >= width) {
 			s = 0;
 			putchar(13);
-			fputs(prompt, stdout);
+			fputs(curPrompt, stdout);
 			putchar(' ');
-			for (i = 0; i < len; i++) {
-				putchar(command[i]);
-			}
-			for (; i < commandlen + 1; i++) {
+			putHighlighted(command, cls, 0, len);
+			for (i = width; i < commandlen + 1; i++) {
 				putchar(' ');
 			}
-			for (i = commandlen; i >= cursor; i--) {
+			for (i = commandlen - displayWidth(command, cursor); i >= 0; i--) {
 				putchar('\b');
 			}
 		}
 		else {
-			if (len - s < commandlen) s = len - commandlen;
+			width = displayWidth(command + s, len - s);
+			while (s > 0 && width < commandlen) {
+				i = prevChar(command, s);
+				if (width + displayWidth(command + i, s - i) > commandlen) break;
+				width += displayWidth(command + i, s - i);
+				s = i;
+			}
 			if (cursor < s) s = cursor;
-			else if(cursor > s + commandlen) s = cursor - commandlen;
+			else {
+				width = displayWidth(command + s, cursor - s);
+				while (width > commandlen) {
+					i = nextChar(command, len, s);
+					width -= displayWidth(command + s, i - s);
+					s = i;
+				}
+			}
+
+			for (end = s, width = 0; end < len; end = i) {
+				i = nextChar(command, len, end);
+				if (width + displayWidth(command + end, i - end) > commandlen) break;
+				width += displayWidth(command + end, i - end);
+			}
+
 			putchar(13);
-			fputs(prompt, stdout);
+			fputs(curPrompt, stdout);
 			if (s > 0) putchar('<');
 			else putchar(' ');
-			for (i = 0; i < commandlen; i++) {
-				putchar(command[s + i]);
+			putHighlighted(command, cls, s, end);
+			for (; width < commandlen; width++) {
+				putchar(' ');
 			}
-			if (len > s + commandlen) putchar('>');
+			if (end < len) putchar('>');
 			else putchar(' ');
-			for (i = s + commandlen; i >= cursor; i--) {
+			for (i = commandlen - displayWidth(command + s, cursor - s); i >= 0; i--) {
 				putchar('\b');
 			}
 		}
 	} //if (commandlen > 0)
 	else {
 		putchar(13);
-		for (i = 0; i < wsz.ws_col && prompt[i]; i++) {
-			putchar(prompt[i]);
+		for (i = 0, width = 0; i < promptlen; i = end) {
+			end = nextChar(curPrompt, promptlen, i);
+			if (width + displayWidth(curPrompt + i, end - i) > wsz.ws_col) break;
+			width += displayWidth(curPrompt + i, end - i);
+			fwrite(curPrompt + i, 1, end - i, stdout);
 		}
-		if (i < wsz.ws_col) {
+		if (width < wsz.ws_col) {
 			putchar(' ');
-			i++;
-			for (; i < wsz.ws_col; i++) putchar('#');
+			width++;
+			for (; width < wsz.ws_col; width++) putchar('#');
 		}
 	} //else
 
+	fflush(stdout);
+	recordLatency();
 	return s;
 }